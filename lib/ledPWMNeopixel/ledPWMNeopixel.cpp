@@ -7,7 +7,10 @@
 #define NEOPIXEL_LED_PIN -1
 #endif
 
-#if defined(LED_RGBW)
+#if defined(NEOPIXEL_UART)
+// UART1 hardware backend, data out on GPIO2 (NEOPIXEL_LED_PIN is ignored)
+neopixelUart _neopixelPixels(3);
+#elif defined(LED_RGBW)
 Adafruit_NeoPixel _neopixelPixels(3, NEOPIXEL_LED_PIN, NEO_GRBW + NEO_KHZ800);
 #else
 Adafruit_NeoPixel _neopixelPixels(3, NEOPIXEL_LED_PIN, NEO_GRB + NEO_KHZ800);
@@ -24,15 +27,30 @@ void neopixelDriver::begin()
 
 void neopixelDriver::_off()
 {
-    for (uint8_t x = 0; x > 3; x++)
+    for (uint8_t x = 0; x < 3; x++)
     {
         #if defined(LED_RGBW)
         _neopixelPixels.setPixelColor(x,0,0,0,0);      //  Set pixel's color (in RAM)
         #else
         _neopixelPixels.setPixelColor(x,0,0,0);        //  Set pixel's color (in RAM)
         #endif
-        _neopixelPixels.show();                        //  Update drivers to match
     }
+    _show();                                           //  Update drivers to match
+}
+
+// Count only frames which actually went out, the UART backend skips a frame
+// while the last one is still being sent or latched
+void neopixelDriver::_show()
+{
+  #if defined(NEOPIXEL_UART)
+  if (_neopixelPixels.show())
+  {
+    _shows++;
+  }
+  #else
+  _neopixelPixels.show();
+  _shows++;
+  #endif
 }
 
 int neopixelDriver::calculateStep(int prevValue, int endValue) {
@@ -85,7 +103,7 @@ void neopixelDriver::colour(uint8_t r0, uint8_t g0, uint8_t b0, uint8_t w0, uint
     _neopixelPixels.setPixelColor(0,r0,g0,b0,w0);  //  Set pixel's color (in RAM)
     _neopixelPixels.setPixelColor(1,r1,g1,b1,w1);  //  Set pixel's color (in RAM)
     _neopixelPixels.setPixelColor(2,r2,g2,b2,w2);  //  Set pixel's color (in RAM)
-    _neopixelPixels.show();                        //  Update drivers to match
+    _show();                                       //  Update drivers to match
     #endif
 
   prev1[0] = r0;
@@ -123,7 +141,7 @@ void neopixelDriver::colour(uint8_t r0, uint8_t g0, uint8_t b0, uint8_t r1, uint
     _neopixelPixels.setPixelColor(0,r0,g0,b0);     //  Set pixel's color (in RAM)
     _neopixelPixels.setPixelColor(1,r1,g1,b1);     //  Set pixel's color (in RAM)
     _neopixelPixels.setPixelColor(2,r2,g2,b2);     //  Set pixel's color (in RAM)
-    _neopixelPixels.show();                        //  Update drivers to match
+    _show();                                       //  Update drivers to match
 
   prev1[0] = r0;
   prev2[0] = g0;
@@ -185,7 +203,7 @@ void neopixelDriver::crossfade(uint8_t r0, uint8_t g0, uint8_t b0, uint8_t w0, u
   _neopixelPixels.setPixelColor(0,c1Val[0],c2Val[0],c3Val[0],c4Val[0]);     //  Set pixel's color (in RAM)
   _neopixelPixels.setPixelColor(1,c1Val[1],c2Val[1],c3Val[1],c4Val[1]);     //  Set pixel's color (in RAM)
   _neopixelPixels.setPixelColor(2,c1Val[2],c2Val[2],c3Val[2],c4Val[2]);     //  Set pixel's color (in RAM)
-  _neopixelPixels.show();                                                   //  Update drivers to match
+  _show();                                                                  //  Update drivers to match
   #endif
 
   checkFadeComplete();
@@ -219,7 +237,112 @@ void neopixelDriver::crossfade(uint8_t r0, uint8_t g0, uint8_t b0, uint8_t r1, u
   _neopixelPixels.setPixelColor(0,c1Val[0],c2Val[0],c3Val[0]);     //  Set pixel's color (in RAM)
   _neopixelPixels.setPixelColor(1,c1Val[1],c2Val[1],c3Val[1]);     //  Set pixel's color (in RAM)
   _neopixelPixels.setPixelColor(2,c1Val[2],c2Val[2],c3Val[2]);     //  Set pixel's color (in RAM)
-  _neopixelPixels.show();                                          //  Update drivers to match
+  _show();                                                         //  Update drivers to match
 
   checkFadeComplete();
-}
\ No newline at end of file
+}
+
+void neopixelDriver::_render(uint8_t colour[]) {
+  #if defined(LED_RGBW)
+  this->colour(colour[0], colour[1], colour[2], colour[3], colour[4], colour[5], colour[6], colour[7], colour[8], colour[9], colour[10], colour[11]);
+  #else
+  this->colour(colour[0], colour[1], colour[2], colour[4], colour[5], colour[6], colour[8], colour[9], colour[10]);
+  #endif
+}
+
+/* Easing curves in 8-bit fixed point, t and the result both run 0-255
+*/
+uint8_t neopixelDriver::_ease(uint8_t easing, uint8_t t) {
+  uint16_t u = 255 - t;
+
+  switch (easing) {
+    case ANIM_EASE_IN:
+      return ((uint16_t)t * t) >> 8;
+    case ANIM_EASE_OUT:
+      return 255 - ((u * u) >> 8);
+    case ANIM_EASE_IN_OUT:
+      if (t < 128) {
+        return ((uint16_t)t * t) >> 7;
+      }
+      return 255 - ((u * u) >> 7);
+    case ANIM_EASE_STEP:
+      return 255;
+    default:
+      return t;
+  }
+}
+
+void neopixelDriver::play(const animation & anim) {
+  _anim = anim;
+
+  if (_anim.keyframeCount > ANIM_MAX_KEYFRAMES) {
+    _anim.keyframeCount = ANIM_MAX_KEYFRAMES;
+  }
+
+  // Zero length keyframes would never advance the clock
+  for (uint8_t k = 0; k < _anim.keyframeCount; k++) {
+    if (_anim.keyframes[k].durationMs == 0) {
+      _anim.keyframes[k].durationMs = 1;
+    }
+  }
+
+  // Start from whatever is currently being displayed
+  for (uint8_t x = 0; x < 3; x++) {
+    _animFrom[(x * 4) + 0] = c1Val[x];
+    _animFrom[(x * 4) + 1] = c2Val[x];
+    _animFrom[(x * 4) + 2] = c3Val[x];
+    _animFrom[(x * 4) + 3] = c4Val[x];
+  }
+
+  _animKeyframe = 0;
+  _animLoop = 0;
+  _animStartMs = millis();
+  _animLastMs = _animStartMs - ANIM_FRAME_MS;
+  _animating = _anim.keyframeCount > 0;
+}
+
+void neopixelDriver::stop() {
+  _animating = false;
+}
+
+bool neopixelDriver::animate() {
+  if (!_animating) {
+    return false;
+  }
+
+  uint32_t now = millis();
+  if ((now - _animLastMs) < ANIM_FRAME_MS) {
+    return true;
+  }
+  _animLastMs = now;
+
+  // Skip over any keyframes we have already passed
+  while ((now - _animStartMs) >= _anim.keyframes[_animKeyframe].durationMs) {
+    animKeyframe & done = _anim.keyframes[_animKeyframe];
+
+    memcpy(_animFrom, done.colour, ANIM_CHANNELS);
+    _animStartMs += done.durationMs;
+
+    if (++_animKeyframe >= _anim.keyframeCount) {
+      _animKeyframe = 0;
+
+      if (_anim.loops && ++_animLoop >= _anim.loops) {
+        _animating = false;
+        _render(_animFrom);
+        return false;
+      }
+    }
+  }
+
+  animKeyframe & next = _anim.keyframes[_animKeyframe];
+  uint8_t t = ((now - _animStartMs) * 256UL) / next.durationMs;
+  uint8_t eased = _ease(next.easing, t);
+
+  for (uint8_t c = 0; c < ANIM_CHANNELS; c++) {
+    int delta = (int)next.colour[c] - _animFrom[c];
+    _animColour[c] = _animFrom[c] + ((delta * eased) / 255);
+  }
+
+  _render(_animColour);
+  return true;
+}
@@ -13,6 +13,34 @@
 #include <Arduino.h>
 #include <Adafruit_NeoPixel.h>
 
+#if defined(NEOPIXEL_UART)
+#include "neopixelUart.h"
+#endif
+
+// Keyframe animations
+#define ANIM_MAX_KEYFRAMES    8
+#define ANIM_CHANNELS         12      // r, g, b, w for each of the 3 LEDs
+#define ANIM_FRAME_MS         20      // minimum time between rendered frames
+
+#define ANIM_EASE_LINEAR      0
+#define ANIM_EASE_IN          1
+#define ANIM_EASE_OUT         2
+#define ANIM_EASE_IN_OUT      3
+#define ANIM_EASE_STEP        4       // jump straight to the keyframe colour
+
+struct animKeyframe {
+  uint8_t colour[ANIM_CHANNELS];      // colour reached at the end of this keyframe
+  uint16_t durationMs;                // time taken to get there from the previous keyframe
+  uint8_t easing;
+};
+
+struct animation {
+  uint8_t keyframeCount;
+  uint8_t loops;                      // 0 = loop forever
+  uint16_t pmThreshold;               // only play when PM 2.5 is at/above this (0 = always)
+  animKeyframe keyframes[ANIM_MAX_KEYFRAMES];
+};
+
 /*!
  *  @brief  Class that stores state and functions for interacting with PCA9685
  * PWM chip
@@ -29,9 +57,16 @@ public:
   void crossfade(uint8_t r0, uint8_t g0, uint8_t b0, uint8_t w0, uint8_t r1, uint8_t g1, uint8_t b1, uint8_t w1, uint8_t r2, uint8_t g2, uint8_t b2, uint8_t w2); // RGBW - for 3 LEDs
   void crossfade(uint8_t r0, uint8_t g0, uint8_t b0, uint8_t r1, uint8_t g1, uint8_t b1, uint8_t r2, uint8_t g2, uint8_t b2);                                     // RGBW - for 3 LEDs
 
+  void play(const animation & anim);  // start playing an animation (copied, no allocation)
+  void stop();                        // stop playing, leaving the LEDs as they are
+  bool animate();                     // render the next frame, call from loop() - returns false once finished
+  bool isAnimating() { return _animating; }
+  uint32_t showCount() { return _shows; } // frames sent to the LEDs so far
+
 private:
 
 void _off();
+  void _show();
 
   int calculateVal(int step, int val, int i);
   int calculateStep(int prevValue, int endValue);
@@ -50,6 +85,20 @@ void _off();
   int c3Val[3];
   int c4Val[3];
 
+  void _render(uint8_t colour[]);
+  uint8_t _ease(uint8_t easing, uint8_t t);
+
+  animation _anim;
+  bool _animating = false;
+  uint8_t _animKeyframe;
+  uint8_t _animLoop;
+  uint32_t _animStartMs;
+  uint32_t _animLastMs;
+  uint8_t _animFrom[ANIM_CHANNELS];
+  uint8_t _animColour[ANIM_CHANNELS];
+
+  uint32_t _shows = 0;
+
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+// cpp file v0.0.0
+
+#include "neopixelUart.h"
+
+#if defined(ESP8266)
+#include <esp8266_peri.h>
+
+neopixelUart::neopixelUart(uint16_t pixels)
+{
+  _count = pixels > MAX_PIXELS ? MAX_PIXELS : pixels;
+  memset(_pixels, 0, sizeof(_pixels));
+
+  // 2.5us per UART character, plus the latch time
+  _frameUs = (_count * NEOPIXEL_UART_CHANNELS * NEOPIXEL_UART_CHARS_PER_BYTE * 5 / 2) + NEOPIXEL_UART_LATCH_US;
+}
+
+void neopixelUart::begin()
+{
+  Serial1.begin(NEOPIXEL_UART_BAUD, SERIAL_6N1, SERIAL_TX_ONLY);
+
+  // Invert TX so the idle (stop) level is low, as WS2812 expects
+  USC0(UART1) |= (1 << UCTXI);
+}
+
+void neopixelUart::setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b)
+{
+  setPixelColor(n, r, g, b, 0);
+}
+
+void neopixelUart::setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b, uint8_t w)
+{
+  if (n >= _count) return;
+
+  uint8_t * p = &_pixels[n * NEOPIXEL_UART_CHANNELS];
+  p[0] = g;
+  p[1] = r;
+  p[2] = b;
+  #if defined(LED_RGBW)
+  p[3] = w;
+  #endif
+}
+
+bool neopixelUart::canShow()
+{
+  uint8_t fifo = (USS(UART1) >> USTXC) & 0xff;
+  return fifo == 0 && (micros() - _lastShowUs) >= _frameUs;
+}
+
+bool neopixelUart::show()
+{
+  // Still sending (or latching) the last frame - callers refresh the pixels
+  // continually (crossfade/animations) so the next call picks this one up
+  if (!canShow()) return false;
+
+  size_t length = neopixelUartEncode(_pixels, _count * NEOPIXEL_UART_CHANNELS, _encoded);
+
+  // The whole frame fits in the TX FIFO, the hardware does the rest
+  for (size_t i = 0; i < length; i++)
+  {
+    USF(UART1) = _encoded[i];
+  }
+
+  _lastShowUs = micros();
+  return true;
+}
+#endif
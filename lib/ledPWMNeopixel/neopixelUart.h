@@ -0,0 +1,53 @@
+// h file 0.0.0
+
+/*!
+ *
+ * Alternative to Adafruit_NeoPixel for driving the 3 neopixels from the
+ * ESP8266 UART1 hardware (TX on GPIO2) rather than bit-banging. A whole
+ * frame fits in the 128 byte TX FIFO, so show() just loads the FIFO and
+ * returns - interrupts stay enabled and SoftwareSerial keeps receiving.
+ * 
+ */
+
+#ifndef neopixelUart_H
+#define neopixelUart_H
+
+#include <Arduino.h>
+#include "neopixelUartEncoder.h"
+
+#if defined(LED_RGBW)
+#define NEOPIXEL_UART_CHANNELS  4
+#else
+#define NEOPIXEL_UART_CHANNELS  3
+#endif
+
+#define NEOPIXEL_UART_BAUD      3200000
+#define NEOPIXEL_UART_LATCH_US  300     // WS2812B reset time (older parts need just 50us)
+
+/*!
+ *  @brief  Same interface as the parts of Adafruit_NeoPixel we use
+ */
+class neopixelUart {
+public:
+  neopixelUart(uint16_t pixels);
+
+  void begin();
+
+  void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b);
+  void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b, uint8_t w);
+
+  bool show();                      // never blocks, false if the frame was skipped, see canShow()
+  bool canShow();                   // previous frame sent and latched
+
+private:
+  static const uint16_t MAX_PIXELS = 3;
+
+  uint16_t _count;
+  uint8_t _pixels[MAX_PIXELS * NEOPIXEL_UART_CHANNELS];    // wire order, GRB(W)
+  uint8_t _encoded[MAX_PIXELS * NEOPIXEL_UART_CHANNELS * NEOPIXEL_UART_CHARS_PER_BYTE];
+
+  uint32_t _lastShowUs = 0;
+  uint32_t _frameUs;
+};
+
+#endif
@@ -0,0 +1,52 @@
+// h file 0.0.0
+
+/*!
+ *
+ * Encodes WS2812 pixel data as a UART bit stream - at 3.2Mbaud, 6N1 with
+ * the TX line inverted, each UART character (start + 6 data + stop bits)
+ * is 2.5us on the wire which is exactly 2 WS2812 bits. Kept free of any
+ * Arduino dependencies so it can be checked on a host.
+ * 
+ */
+
+#ifndef neopixelUartEncoder_H
+#define neopixelUartEncoder_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// UART characters needed per byte of pixel data
+#define NEOPIXEL_UART_CHARS_PER_BYTE  4
+
+/*!
+ *  Each entry is the 6 data bits for 2 WS2812 bits (MSB first), shown as
+ *  they appear on the (inverted) wire: start, 6 data bits LSB first, stop
+ */
+static const uint8_t _neopixelUartBits[4] = {
+  0b110111,   // on wire: 1 000 100 0 - WS2812 reads 00
+  0b000111,   // on wire: 1 000 111 0 - WS2812 reads 01
+  0b110100,   // on wire: 1 110 100 0 - WS2812 reads 10
+  0b000100,   // on wire: 1 110 111 0 - WS2812 reads 11
+};
+
+// Encode 'length' bytes of pixel data (in wire order, e.g. GRB) into 'out',
+// which must have room for length * NEOPIXEL_UART_CHARS_PER_BYTE bytes
+static inline size_t neopixelUartEncode(const uint8_t * data, size_t length, uint8_t * out)
+{
+  size_t count = 0;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    uint8_t value = data[i];
+
+    for (uint8_t pair = 0; pair < NEOPIXEL_UART_CHARS_PER_BYTE; pair++)
+    {
+      out[count++] = _neopixelUartBits[(value >> 6) & 0x03];
+      value <<= 2;
+    }
+  }
+
+  return count;
+}
+
+#endif
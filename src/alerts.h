@@ -0,0 +1,126 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define ALERT_MAX_RULES     4
+
+// Time constant for smoothing the rise rate. Frames come about a second
+// apart and jitter by a couple of ug/m3, which frame to frame reads as
+// over 100/min either way.
+#define ALERT_RATE_WINDOW_MS    15000
+
+/**
+ * Rate-of-change and threshold alerts, evaluated on every decoded PM frame
+ * (not the 5 frame average) so automations hear about a spike straight away.
+ *
+ * A rule triggers when PM 2.5 reaches 'threshold' or rises faster than
+ * 'riseRatePerMinute' (either can be 0 to disable it). The rate is an
+ * exponential moving average of the frame to frame rate, over about
+ * ALERT_RATE_WINDOW_MS. A rule clears once PM is 'hysteresis' below the
+ * threshold and the rate is 'rateHysteresis' below its limit. After
+ * triggering a rule can't trigger again until 'cooldownMs' has passed.
+ */
+struct alertRule_t {
+    uint16_t threshold;
+    uint16_t riseRatePerMinute;
+    uint16_t hysteresis;            // ug/m3
+    uint16_t rateHysteresis;        // ug/m3 per minute
+    uint32_t cooldownMs;
+};
+
+typedef void (*alertCallback)(uint8_t index, bool triggered, uint16_t pm25, int32_t ratePerMinute);
+
+class alerts {
+public:
+    void onAlert(alertCallback callback) {
+        _callback = callback;
+    }
+
+    void clear() {
+        _count = 0;
+    }
+
+    bool add(const alertRule_t& rule) {
+        if (_count >= ALERT_MAX_RULES) {
+            return false;
+        }
+
+        _rules[_count] = rule;
+        _active[_count] = false;
+        _lastTriggeredMs[_count] = 0;
+        _count++;
+        return true;
+    }
+
+    uint8_t count() {
+        return _count;
+    }
+
+    // Call with every new reading
+    void evaluate(uint16_t pm25, uint32_t nowMs) {
+        // Need two frames for a rate, thresholds can still trigger
+        if (_havePrevious && nowMs != _previousMs) {
+            float elapsedMs = (float)(nowMs - _previousMs);
+            float frameRate = ((int32_t)pm25 - _previousPM25) * 60000.0f / elapsedMs;
+
+            // Weighted by the time since the last frame, so a gap between
+            // bursts counts for more than a frame a second later
+            _rate += (frameRate - _rate) * elapsedMs / (ALERT_RATE_WINDOW_MS + elapsedMs);
+        }
+
+        _previousPM25 = pm25;
+        _previousMs = nowMs;
+        _havePrevious = true;
+
+        int32_t ratePerMinute = (int32_t)lroundf(_rate);
+
+        for (uint8_t i = 0; i < _count; i++) {
+            alertRule_t& rule = _rules[i];
+
+            bool overThreshold = rule.threshold && pm25 >= rule.threshold;
+            bool risingFast = rule.riseRatePerMinute && ratePerMinute >= rule.riseRatePerMinute;
+
+            if (!_active[i]) {
+                if (!overThreshold && !risingFast) {
+                    continue;
+                }
+
+                if (_lastTriggeredMs[i] && (nowMs - _lastTriggeredMs[i]) < rule.cooldownMs) {
+                    continue;
+                }
+
+                _active[i] = true;
+                _lastTriggeredMs[i] = nowMs;
+                _notify(i, true, pm25, ratePerMinute);
+                continue;
+            }
+
+            bool belowThreshold = !rule.threshold || pm25 + rule.hysteresis < rule.threshold;
+            bool settled = !rule.riseRatePerMinute || ratePerMinute + rule.rateHysteresis < rule.riseRatePerMinute;
+
+            if (belowThreshold && settled) {
+                _active[i] = false;
+                _notify(i, false, pm25, ratePerMinute);
+            }
+        }
+    }
+
+private:
+    void _notify(uint8_t index, bool triggered, uint16_t pm25, int32_t ratePerMinute) {
+        if (_callback) {
+            _callback(index, triggered, pm25, ratePerMinute);
+        }
+    }
+
+    alertRule_t _rules[ALERT_MAX_RULES];
+    bool _active[ALERT_MAX_RULES];
+    uint32_t _lastTriggeredMs[ALERT_MAX_RULES];
+    uint8_t _count = 0;
+
+    alertCallback _callback = nullptr;
+
+    bool _havePrevious = false;
+    uint16_t _previousPM25;
+    uint32_t _previousMs;
+    float _rate = 0;                // ug/m3 per minute
+};
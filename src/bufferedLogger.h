@@ -0,0 +1,167 @@
+#pragma once
+
+#include <Arduino.h>
+
+#include <publishQueue.h>
+
+// Ring of complete log lines waiting to be published
+#define LOG_RING_LINES          8
+#define LOG_LINE_SIZE           96
+
+// At most one batch of lines per interval
+#define LOG_FLUSH_INTERVAL_MS   1000
+#define LOG_BATCH_LINES         4
+
+/**
+ * Drop-in replacement for MqttLogger (in MqttAndSerial mode) which never
+ * publishes from inside print(). Lines are written to serial straight away
+ * but appended to a fixed ring for MQTT, and loop() hands them to the
+ * publish queue (as the lowest priority class) in batches (one message,
+ * newline separated) at a bounded rate.
+ *
+ * Consecutive duplicate lines are collapsed into a "repeated N times" line
+ * and lines lost to a full ring are counted.
+ */
+class bufferedLogger : public Print {
+public:
+    bufferedLogger(publishQueue& publisher) : _publisher(publisher) {}
+
+    void setTopic(const char * topic) {
+        strncpy(_topic, topic, sizeof(_topic) - 1);
+        _topic[sizeof(_topic) - 1] = 0;
+    }
+
+    size_t write(uint8_t c) override {
+        Serial.write(c);
+
+        if (c == '\r') {
+            return 1;
+        }
+
+        if (c == '\n') {
+            _line[_lineLength] = 0;
+            _commit(_line);
+            _lineLength = 0;
+            return 1;
+        }
+
+        // Overlong lines are truncated
+        if (_lineLength < LOG_LINE_SIZE - 1) {
+            _line[_lineLength++] = c;
+        }
+
+        return 1;
+    }
+
+    using Print::write;
+
+    // Call from loop(), queues at most one batch per interval
+    void loop() {
+        if ((millis() - _lastFlushMs) < LOG_FLUSH_INTERVAL_MS) {
+            return;
+        }
+
+        if (!_topic[0] || !_publisher.connected()) {
+            return;
+        }
+
+        _lastFlushMs = millis();
+
+        // Report any repeats so far, even if the line is still repeating
+        if (_repeats) {
+            char summary[48];
+            snprintf_P(summary, sizeof(summary), PSTR("[log] last line repeated %u times"), _repeats);
+            _repeats = 0;
+            _push(summary);
+        }
+
+        if (_count == 0) {
+            return;
+        }
+
+        uint8_t lines = _count < LOG_BATCH_LINES ? _count : LOG_BATCH_LINES;
+
+        // Work out the payload length first so we can write it in place
+        size_t length = 0;
+        for (uint8_t i = 0; i < lines; i++) {
+            length += strlen(_lines[(_head + i) % LOG_RING_LINES]) + (i ? 1 : 0);
+        }
+
+        // No room, try again next interval
+        char * payload = (char *)_publisher.reserve(PUBLISH_CLASS_LOG, _topic, length, false);
+        if (!payload) {
+            return;
+        }
+
+        for (uint8_t i = 0; i < lines; i++) {
+            if (i) {
+                *payload++ = '\n';
+            }
+
+            const char * line = _lines[(_head + i) % LOG_RING_LINES];
+            size_t lineLength = strlen(line);
+            memcpy(payload, line, lineLength);
+            payload += lineLength;
+        }
+
+        _head = (_head + lines) % LOG_RING_LINES;
+        _count -= lines;
+        published += lines;
+    }
+
+    uint8_t depth() {
+        return _count;
+    }
+
+    uint32_t published = 0;
+    uint32_t dropped = 0;
+
+private:
+    void _commit(const char * line) {
+        if (!line[0]) {
+            return;
+        }
+
+        if (strcmp(line, _last) == 0) {
+            _repeats++;
+            return;
+        }
+
+        if (_repeats) {
+            char summary[48];
+            snprintf_P(summary, sizeof(summary), PSTR("[log] last line repeated %u times"), _repeats);
+            _repeats = 0;
+            _push(summary);
+        }
+
+        strcpy(_last, line);
+        _push(line);
+    }
+
+    void _push(const char * line) {
+        // Full, lose the oldest line
+        if (_count == LOG_RING_LINES) {
+            _head = (_head + 1) % LOG_RING_LINES;
+            _count--;
+            dropped++;
+        }
+
+        strcpy(_lines[(_head + _count) % LOG_RING_LINES], line);
+        _count++;
+    }
+
+    publishQueue& _publisher;
+    char _topic[64] = {0};
+
+    char _line[LOG_LINE_SIZE];
+    uint8_t _lineLength = 0;
+
+    char _last[LOG_LINE_SIZE] = {0};
+    uint16_t _repeats = 0;
+
+    char _lines[LOG_RING_LINES][LOG_LINE_SIZE];
+    uint8_t _head = 0;
+    uint8_t _count = 0;
+
+    uint32_t _lastFlushMs = 0;
+};
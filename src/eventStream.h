@@ -0,0 +1,112 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClient.h>
+
+// Concurrent Server-Sent Events subscribers
+#define SSE_MAX_CLIENTS         3
+
+// Comment line sent to idle subscribers so proxies/browsers keep the stream open
+#define SSE_KEEPALIVE_MS        15000
+
+/**
+ * Server-Sent Events stream (GET /events) on the REST port. Subscribers are
+ * held in a fixed set of slots, events are formatted on the stack and only
+ * written to clients with room in their TCP send buffer - a slow subscriber
+ * misses events rather than stalling loop().
+ */
+class eventStream {
+public:
+    // Take over a client which sent "GET /events", false if we are full
+    bool subscribe(WiFiClient& client) {
+        _prune();
+
+        for (uint8_t i = 0; i < SSE_MAX_CLIENTS; i++) {
+            if (_active[i]) {
+                continue;
+            }
+
+            // We don't care about the request headers
+            while (client.available()) {
+                client.read();
+            }
+
+            client.setNoDelay(true);
+            client.print(F("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\n"));
+
+            _clients[i] = client;
+            _active[i] = true;
+            return true;
+        }
+
+        client.print(F("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"));
+        return false;
+    }
+
+    void publish(const __FlashStringHelper * event, const char * data) {
+        char message[96];
+        int length = snprintf_P(message, sizeof(message), PSTR("event: %s\ndata: %s\n\n"), (PGM_P)event, data);
+
+        if (length <= 0 || length >= (int)sizeof(message)) {
+            return;
+        }
+
+        _write(message, length);
+    }
+
+    // Call from loop() to drop closed subscribers and keep idle ones alive
+    void loop() {
+        if ((millis() - _lastWriteMs) < SSE_KEEPALIVE_MS) {
+            return;
+        }
+
+        _write(":\n\n", 3);
+    }
+
+    uint8_t subscribers() {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < SSE_MAX_CLIENTS; i++) {
+            if (_active[i]) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    uint32_t dropped = 0;
+
+private:
+    void _write(const char * message, size_t length) {
+        _prune();
+
+        for (uint8_t i = 0; i < SSE_MAX_CLIENTS; i++) {
+            if (!_active[i]) {
+                continue;
+            }
+
+            if (_clients[i].availableForWrite() < length) {
+                dropped++;
+                continue;
+            }
+
+            _clients[i].write((const uint8_t *)message, length);
+        }
+
+        _lastWriteMs = millis();
+    }
+
+    void _prune() {
+        for (uint8_t i = 0; i < SSE_MAX_CLIENTS; i++) {
+            if (_active[i] && !_clients[i].connected()) {
+                // Release the connection, not just the slot
+                _clients[i].stop();
+                _clients[i] = WiFiClient();
+                _active[i] = false;
+            }
+        }
+    }
+
+    WiFiClient _clients[SSE_MAX_CLIENTS];
+    bool _active[SSE_MAX_CLIENTS] = {false};
+    uint32_t _lastWriteMs = 0;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#include <types.h>
+
+/**
+ * Fast restarts - the last applied config, averaging window, LED state and
+ * WiFi BSSID/channel are kept in RTC memory (survives everything except a
+ * power cycle) and the config is also snapshotted to flash. Both are CRC
+ * checked so garbage after a cold boot is ignored.
+ */
+namespace fastBoot {
+    constexpr static const uint32_t RTC_MAGIC = 0x41515331;     // 'AQS1'
+    constexpr static const uint8_t CONFIG_MAGIC = 0xC5;
+
+    uint32_t crc32(const uint8_t * data, size_t length, uint32_t crc = 0) {
+        crc = ~crc;
+
+        while (length--) {
+            crc ^= *data++;
+
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+            }
+        }
+
+        return ~crc;
+    }
+
+    uint32_t rtcCrc(const rtcState_t& rtc) {
+        // CRC everything after the header
+        const size_t header = offsetof(rtcState_t, config);
+        return crc32((const uint8_t *)&rtc + header, sizeof(rtc) - header);
+    }
+
+    bool isWarmBoot() {
+        return ESP.getResetInfoPtr()->reason != REASON_DEFAULT_RST;
+    }
+
+    bool readRtc(uint32_t offset, rtcState_t& rtc) {
+        if (!ESP.rtcUserMemoryRead(offset, (uint32_t *)&rtc, sizeof(rtc))) {
+            return false;
+        }
+
+        return rtc.magic == RTC_MAGIC && rtc.crc == rtcCrc(rtc);
+    }
+
+    void writeRtc(uint32_t offset, rtcState_t& rtc) {
+        rtc.magic = RTC_MAGIC;
+        rtc.crc = rtcCrc(rtc);
+
+        ESP.rtcUserMemoryWrite(offset, (uint32_t *)&rtc, sizeof(rtc));
+    }
+
+    bool readConfig(int offset, configSnapshot_t& config) {
+        if (EEPROM.read(offset) != CONFIG_MAGIC) {
+            return false;
+        }
+
+        uint32_t crc;
+        EEPROM.get(offset + 1, crc);
+        EEPROM.get(offset + 1 + sizeof(crc), config);
+
+        return crc == crc32((const uint8_t *)&config, sizeof(config));
+    }
+
+    void writeConfig(int offset, const configSnapshot_t& config) {
+        // Only touch the flash if something has actually changed
+        configSnapshot_t stored;
+        if (readConfig(offset, stored) && memcmp(&stored, &config, sizeof(config)) == 0) {
+            return;
+        }
+
+        uint32_t crc = crc32((const uint8_t *)&config, sizeof(config));
+
+        EEPROM.write(offset, CONFIG_MAGIC);
+        EEPROM.put(offset + 1, crc);
+        EEPROM.put(offset + 1 + sizeof(crc), config);
+        EEPROM.commit();
+    }
+} // namespace fastBoot
@@ -0,0 +1,350 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+/**
+ * Single source definitions of config/command payloads. Each field is
+ * described once in a table (name, type, range, docs and handler) which
+ * both generates the JSON schema published in the adoption payload and
+ * parses incoming payloads - so the two can't drift apart.
+ *
+ * Parsing walks the payload once, looking each key up by its FNV-1a hash
+ * (precomputed at compile time for the table), validates the value against
+ * the field and hands it to the handler. Unknown keys are left alone for
+ * anything else (e.g. the I2C sensor library) to pick up.
+ *
+ * The parser enforces everything the schema publishes: ranges, enum values,
+ * string lengths, maxItems, colour channels of 0-255 and required fields.
+ * A value which breaks any of them is logged and ignored, and an object
+ * missing a required field is skipped whole.
+ */
+
+// Field types
+#define FIELD_INTEGER           0       // 'number' is the value
+#define FIELD_BOOLEAN           1       // 'number' is 0 or 1
+#define FIELD_ENUM              2       // 'number' is the index into 'values'
+#define FIELD_COLOUR            3       // array of 0-255, 'number' is the item count
+#define FIELD_OBJECT            4       // object with 'children' fields
+#define FIELD_OBJECT_ARRAY      5       // array of objects with 'children' fields, 'number' is the item count
+#define FIELD_STRING            6       // 'number' is the length
+
+// No upper bound for FIELD_INTEGER
+#define FIELD_NO_MAXIMUM        INT32_MAX
+
+#define FIELD_COUNT(fields)     (sizeof(fields) / sizeof(fields[0]))
+
+namespace fields {
+    constexpr uint32_t fnv1a(const char * key, uint32_t hash = 2166136261UL) {
+        return *key ? fnv1a(key + 1, (hash ^ (uint8_t)*key) * 16777619UL) : hash;
+    }
+
+    struct table_t;
+
+    struct field_t {
+        const char * name;
+        uint32_t hash;
+        uint8_t type;
+        int32_t minimum;
+        int32_t maximum;                // or maxItems for arrays
+        const char * const * values;    // FIELD_ENUM
+        uint8_t valueCount;
+        const table_t * children;       // FIELD_OBJECT/FIELD_OBJECT_ARRAY
+        bool required;
+        uint8_t arg;                    // passed to the handler, e.g. a pixel index
+        void (*handler)(JsonVariant value, int32_t number, uint8_t arg);
+        const char * title;
+        const char * description;
+    };
+
+    struct table_t {
+        const field_t * fields;
+        uint8_t count;
+        bool (*begin)();                // before each object, false to skip it
+        void (*end)();                  // after each object
+    };
+
+    typedef void (*handler_t)(JsonVariant value, int32_t number, uint8_t arg);
+
+    constexpr field_t integer(const char * name, int32_t minimum, int32_t maximum, handler_t handler, const char * title = nullptr, const char * description = nullptr) {
+        return { name, fnv1a(name), FIELD_INTEGER, minimum, maximum, nullptr, 0, nullptr, false, 0, handler, title, description };
+    }
+
+    constexpr field_t flag(const char * name, handler_t handler, const char * title = nullptr, const char * description = nullptr) {
+        return { name, fnv1a(name), FIELD_BOOLEAN, 0, 1, nullptr, 0, nullptr, false, 0, handler, title, description };
+    }
+
+    constexpr field_t enumeration(const char * name, const char * const * values, uint8_t valueCount, handler_t handler, const char * title = nullptr, const char * description = nullptr, bool required = false) {
+        return { name, fnv1a(name), FIELD_ENUM, 0, 0, values, valueCount, nullptr, required, 0, handler, title, description };
+    }
+
+    constexpr field_t string(const char * name, uint8_t maxLength, handler_t handler, const char * title = nullptr, const char * description = nullptr) {
+        return { name, fnv1a(name), FIELD_STRING, 0, maxLength, nullptr, 0, nullptr, false, 0, handler, title, description };
+    }
+
+    constexpr field_t colour(const char * name, uint8_t maxItems, handler_t handler, uint8_t arg = 0, const char * description = nullptr) {
+        return { name, fnv1a(name), FIELD_COLOUR, 0, maxItems, nullptr, 0, nullptr, false, arg, handler, nullptr, description };
+    }
+
+    constexpr field_t object(const char * name, const table_t * children, handler_t handler, const char * title = nullptr, const char * description = nullptr) {
+        return { name, fnv1a(name), FIELD_OBJECT, 0, 0, nullptr, 0, children, false, 0, handler, title, description };
+    }
+
+    constexpr field_t objectArray(const char * name, int32_t maxItems, const table_t * children, handler_t handler, const char * title = nullptr, const char * description = nullptr) {
+        return { name, fnv1a(name), FIELD_OBJECT_ARRAY, 0, maxItems, nullptr, 0, children, false, 0, handler, title, description };
+    }
+
+    /*--------------------------- Schema -----------------*/
+    void schema(JsonObject properties, const table_t& table);
+
+    // Required fields of an object's table, if any
+    void _schemaRequired(JsonObject object, const table_t& table) {
+        JsonArray required;
+        for (uint8_t i = 0; i < table.count; i++) {
+            if (table.fields[i].required) {
+                if (required.isNull()) {
+                    required = object.createNestedArray("required");
+                }
+                required.add(table.fields[i].name);
+            }
+        }
+    }
+
+    void _schemaField(JsonObject property, const field_t& field) {
+        if (field.title) {
+            property["title"] = field.title;
+        }
+
+        if (field.description) {
+            property["description"] = field.description;
+        }
+
+        switch (field.type) {
+            case FIELD_INTEGER:
+                property["type"] = "integer";
+                property["minimum"] = field.minimum;
+                if (field.maximum != FIELD_NO_MAXIMUM) {
+                    property["maximum"] = field.maximum;
+                }
+                break;
+
+            case FIELD_BOOLEAN:
+                property["type"] = "boolean";
+                break;
+
+            case FIELD_ENUM: {
+                property["type"] = "string";
+                JsonArray values = property.createNestedArray("enum");
+                for (uint8_t i = 0; i < field.valueCount; i++) {
+                    values.add(field.values[i]);
+                }
+                break;
+            }
+
+            case FIELD_STRING:
+                property["type"] = "string";
+                property["maxLength"] = field.maximum;
+                break;
+
+            case FIELD_COLOUR: {
+                property["type"] = "array";
+                property["maxItems"] = field.maximum;
+                JsonObject items = property.createNestedObject("items");
+                items["type"] = "integer";
+                items["minimum"] = 0;
+                items["maximum"] = 255;
+                break;
+            }
+
+            case FIELD_OBJECT:
+                property["type"] = "object";
+                schema(property.createNestedObject("properties"), *field.children);
+                _schemaRequired(property, *field.children);
+                break;
+
+            case FIELD_OBJECT_ARRAY: {
+                property["type"] = "array";
+                if (field.maximum) {
+                    property["maxItems"] = field.maximum;
+                }
+
+                JsonObject items = property.createNestedObject("items");
+                items["type"] = "object";
+                schema(items.createNestedObject("properties"), *field.children);
+                _schemaRequired(items, *field.children);
+                break;
+            }
+        }
+    }
+
+    // Add the property for just one field of the table, so a schema can be
+    // built (or streamed) a property at a time
+    void schema(JsonObject properties, const table_t& table, uint8_t index) {
+        _schemaField(properties.createNestedObject(table.fields[index].name), table.fields[index]);
+    }
+
+    // Add a property for every field in the table
+    void schema(JsonObject properties, const table_t& table) {
+        for (uint8_t i = 0; i < table.count; i++) {
+            schema(properties, table, i);
+        }
+    }
+
+    /*--------------------------- Parsing -----------------*/
+    void dispatch(JsonObject json, const table_t& table, Print& log);
+
+    void _invalid(Print& log, const char * name) {
+        log.print(F("[AQS] invalid "));
+        log.println(name);
+    }
+
+    void _dispatchField(const field_t& field, JsonVariant value, Print& log) {
+        int32_t number = 0;
+
+        switch (field.type) {
+            case FIELD_INTEGER: {
+                if (!value.is<long>()) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                long integerValue = value.as<long>();
+                if (integerValue < field.minimum || integerValue > field.maximum) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                number = integerValue;
+                break;
+            }
+
+            case FIELD_BOOLEAN:
+                if (!value.is<bool>()) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                number = value.as<bool>();
+                break;
+
+            case FIELD_ENUM: {
+                const char * string = value.as<const char *>();
+                if (!string) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                uint8_t index = 0;
+                while (index < field.valueCount && strcmp(string, field.values[index]) != 0) {
+                    index++;
+                }
+
+                if (index == field.valueCount) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                number = index;
+                break;
+            }
+
+            case FIELD_STRING: {
+                const char * string = value.as<const char *>();
+                if (!string || (int32_t)strlen(string) > field.maximum) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                number = strlen(string);
+                break;
+            }
+
+            case FIELD_COLOUR: {
+                JsonArray array = value.as<JsonArray>();
+                if (array.isNull() || (int32_t)array.size() > field.maximum) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                for (JsonVariant item : array) {
+                    if (!item.is<uint8_t>()) {
+                        _invalid(log, field.name);
+                        return;
+                    }
+                }
+
+                number = array.size();
+                break;
+            }
+
+            case FIELD_OBJECT: {
+                JsonObject object = value.as<JsonObject>();
+                if (object.isNull()) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                if (field.handler) {
+                    field.handler(value, 0, field.arg);
+                }
+
+                dispatch(object, *field.children, log);
+                return;
+            }
+
+            case FIELD_OBJECT_ARRAY: {
+                JsonArray array = value.as<JsonArray>();
+                if (array.isNull() || (field.maximum && (int32_t)array.size() > field.maximum)) {
+                    _invalid(log, field.name);
+                    return;
+                }
+
+                if (field.handler) {
+                    field.handler(value, array.size(), field.arg);
+                }
+
+                for (JsonVariant item : array) {
+                    if (item.is<JsonObject>()) {
+                        dispatch(item.as<JsonObject>(), *field.children, log);
+                    }
+                }
+                return;
+            }
+        }
+
+        field.handler(value, number, field.arg);
+    }
+
+    // Walk the object once, handing each known key to its field's handler
+    void dispatch(JsonObject json, const table_t& table, Print& log) {
+        for (uint8_t i = 0; i < table.count; i++) {
+            if (table.fields[i].required && !json.containsKey(table.fields[i].name)) {
+                _invalid(log, table.fields[i].name);
+                return;
+            }
+        }
+
+        if (table.begin && !table.begin()) {
+            return;
+        }
+
+        for (JsonPair pair : json) {
+            const char * key = pair.key().c_str();
+            uint32_t hash = fnv1a(key);
+
+            for (uint8_t i = 0; i < table.count; i++) {
+                const field_t& field = table.fields[i];
+
+                // Hashes can collide, so confirm on a match
+                if (field.hash == hash && strcmp(field.name, key) == 0) {
+                    _dispatchField(field, pair.value(), log);
+                    break;
+                }
+            }
+        }
+
+        if (table.end) {
+            table.end();
+        }
+    }
+} // namespace fields
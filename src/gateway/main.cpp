@@ -0,0 +1,454 @@
+/**
+  Linux gateway for IKEA vindriktning (PM1006) sensors
+
+  Reads one or more PM1006 sensors wired to USB-UART adapters and publishes
+  their readings with the same topic and payload layout as the firmware,
+  using non-blocking, epoll driven I/O for the ttys and the MQTT socket.
+
+    aqs-gateway [-h host] [-p port] [-t prefix] [-i seconds] <tty>[=<client id>] ...
+
+  e.g.
+    aqs-gateway -h broker.local /dev/ttyUSB0=intake /dev/ttyUSB1=exhaust
+
+  If no client id is given one is derived from the tty name.
+
+  Copyright 2022 Austins Creations
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mosquitto.h>
+
+#include <types.h>
+#include <pm1006.h>
+
+/*--------------------------- Constants ----------------------------------*/
+// Same defaults as the firmware
+#define DEFAULT_UPDATE_SECONDS      60
+#define DEFAULT_MQTT_PORT           1883
+#define MQTT_KEEPALIVE_SECONDS      15
+
+// How often to retry a tty which has gone away (e.g. unplugged)
+#define TTY_RETRY_MS                5000
+
+// How often to retry the broker after a disconnect
+#define MQTT_RETRY_MS               5000
+
+#define MAX_SENSORS                 64
+#define TOPIC_BUFFER_SIZE           64
+
+/*-------------------------- Internal datatypes --------------------------*/
+struct sensor_t {
+  const char * path;
+  char clientId[32];
+  int fd = -1;
+  uint64_t retryMs = 0;
+
+  pm1006::parser parser;
+  particleSensorState_t state;
+
+  // stats
+  uint32_t bytes = 0;
+  uint32_t framesAccepted = 0;
+  uint32_t framesRejected = 0;
+};
+
+/*--------------------------- Global Variables ---------------------------*/
+sensor_t sensors[MAX_SENSORS];
+int sensorCount = 0;
+
+const char * mqttHost = "localhost";
+int mqttPort = DEFAULT_MQTT_PORT;
+const char * topicPrefix = NULL;
+uint32_t updateMs = DEFAULT_UPDATE_SECONDS * 1000;
+
+struct mosquitto * mosq = NULL;
+bool mqttConnected = false;
+uint64_t mqttRetryMs = 0;
+int mqttFd = -1;
+bool mqttWantWrite = false;
+
+int epollFd = -1;
+volatile sig_atomic_t running = 1;
+
+/*--------------------------- Helpers -----------------*/
+uint64_t nowMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// data.u64 carries the sensor index, or this for the MQTT socket
+#define EPOLL_MQTT_ID               UINT64_MAX
+
+void getTopic(char * topic, const char * type, const char * clientId)
+{
+  if (topicPrefix)
+  {
+    snprintf(topic, TOPIC_BUFFER_SIZE, "%s/%s/%s", topicPrefix, type, clientId);
+  }
+  else
+  {
+    snprintf(topic, TOPIC_BUFFER_SIZE, "%s/%s", type, clientId);
+  }
+}
+
+/*--------------------------- Sensors -----------------*/
+bool openSensor(sensor_t & sensor)
+{
+  sensor.fd = open(sensor.path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+  if (sensor.fd < 0)
+  {
+    fprintf(stderr, "[%s] unable to open %s: %s\n", sensor.clientId, sensor.path, strerror(errno));
+    return false;
+  }
+
+  // 9600 8N1, raw
+  struct termios tty;
+  if (tcgetattr(sensor.fd, &tty) != 0)
+  {
+    fprintf(stderr, "[%s] %s is not a tty: %s\n", sensor.clientId, sensor.path, strerror(errno));
+    close(sensor.fd);
+    sensor.fd = -1;
+    return false;
+  }
+
+  cfmakeraw(&tty);
+  cfsetispeed(&tty, B9600);
+  cfsetospeed(&tty, B9600);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tcsetattr(sensor.fd, TCSANOW, &tty);
+  tcflush(sensor.fd, TCIFLUSH);
+
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u64 = &sensor - sensors;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, sensor.fd, &event);
+
+  sensor.parser.reset();
+  fprintf(stderr, "[%s] reading %s\n", sensor.clientId, sensor.path);
+  return true;
+}
+
+void closeSensor(sensor_t & sensor)
+{
+  fprintf(stderr, "[%s] lost %s, retrying\n", sensor.clientId, sensor.path);
+
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, sensor.fd, NULL);
+  close(sensor.fd);
+
+  sensor.fd = -1;
+  sensor.retryMs = nowMs() + TTY_RETRY_MS;
+}
+
+void readSensor(sensor_t & sensor)
+{
+  uint8_t buffer[256];
+
+  while (true)
+  {
+    ssize_t length = read(sensor.fd, buffer, sizeof(buffer));
+
+    if (length < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+      return;
+    }
+
+    if (length <= 0)
+    {
+      closeSensor(sensor);
+      return;
+    }
+
+    sensor.bytes += length;
+
+    for (ssize_t i = 0; i < length; i++)
+    {
+      switch (sensor.parser.feed(buffer[i]))
+      {
+        case pm1006::parser::FRAME:
+          sensor.framesAccepted++;
+          pm1006::addMeasurement(sensor.state, pm1006::pm25(sensor.parser.frame()));
+          break;
+
+        case pm1006::parser::BAD_HEADER:
+        case pm1006::parser::BAD_CHECKSUM:
+          sensor.framesRejected++;
+          break;
+
+        default:
+          break;
+      }
+    }
+  }
+}
+
+/*--------------------------- MQTT -----------------*/
+void mqttOnConnect(struct mosquitto *, void *, int rc)
+{
+  if (rc != 0)
+  {
+    fprintf(stderr, "[mqtt] connect failed: %s\n", mosquitto_connack_string(rc));
+    return;
+  }
+
+  fprintf(stderr, "[mqtt] connected to %s:%d\n", mqttHost, mqttPort);
+  mqttConnected = true;
+}
+
+void mqttOnDisconnect(struct mosquitto *, void *, int rc)
+{
+  fprintf(stderr, "[mqtt] disconnected (%d)\n", rc);
+  mqttConnected = false;
+  mqttRetryMs = nowMs() + MQTT_RETRY_MS;
+}
+
+// Keep epoll watching the (possibly new) MQTT socket, for writes too if
+// mosquitto has anything queued
+void mqttUpdateEpoll()
+{
+  int fd = mosquitto_socket(mosq);
+  bool wantWrite = fd >= 0 && mosquitto_want_write(mosq);
+
+  if (fd == mqttFd && wantWrite == mqttWantWrite)
+  {
+    return;
+  }
+
+  if (mqttFd >= 0 && fd != mqttFd)
+  {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, mqttFd, NULL);
+  }
+
+  if (fd >= 0)
+  {
+    struct epoll_event event;
+    event.events = wantWrite ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    event.data.u64 = EPOLL_MQTT_ID;
+    epoll_ctl(epollFd, fd == mqttFd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+  }
+
+  mqttFd = fd;
+  mqttWantWrite = wantWrite;
+}
+
+void mqttConnect()
+{
+  // The first attempt stores the broker details, retries reuse them
+  static bool attempted = false;
+
+  int rc = attempted
+    ? mosquitto_reconnect_async(mosq)
+    : mosquitto_connect_async(mosq, mqttHost, mqttPort, MQTT_KEEPALIVE_SECONDS);
+
+  attempted = true;
+
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    fprintf(stderr, "[mqtt] unable to connect: %s\n", mosquitto_strerror(rc));
+    mqttRetryMs = nowMs() + MQTT_RETRY_MS;
+    return;
+  }
+
+  mqttRetryMs = 0;
+}
+
+/*--------------------------- Telemetry -----------------*/
+void publishTelemetry()
+{
+  for (int i = 0; i < sensorCount; i++)
+  {
+    sensor_t & sensor = sensors[i];
+
+    fprintf(stderr, "[%s] bytes=%u frames=%u rejected=%u avgPM25=%u%s\n",
+      sensor.clientId, sensor.bytes, sensor.framesAccepted, sensor.framesRejected,
+      sensor.state.avgPM25, sensor.state.valid ? "" : " (not yet valid)");
+
+    if (!sensor.state.valid || !mqttConnected)
+    {
+      continue;
+    }
+
+    char topic[TOPIC_BUFFER_SIZE];
+    getTopic(topic, "tele", sensor.clientId);
+
+    char payload[32];
+    int length = snprintf(payload, sizeof(payload), "{\"pm25\":%u}", sensor.state.avgPM25);
+
+    mosquitto_publish(mosq, NULL, topic, length, payload, 0, false);
+  }
+}
+
+/*--------------------------- Initialisation -------------------------------*/
+void usage(const char * name)
+{
+  fprintf(stderr, "usage: %s [-h host] [-p port] [-t topic prefix] [-i update seconds] <tty>[=<client id>] ...\n", name);
+  exit(1);
+}
+
+void addSensor(char * arg)
+{
+  if (sensorCount >= MAX_SENSORS)
+  {
+    fprintf(stderr, "too many sensors, max %d\n", MAX_SENSORS);
+    exit(1);
+  }
+
+  sensor_t & sensor = sensors[sensorCount++];
+
+  char * equals = strchr(arg, '=');
+  if (equals)
+  {
+    *equals = 0;
+    snprintf(sensor.clientId, sizeof(sensor.clientId), "%s", equals + 1);
+  }
+  else
+  {
+    // /dev/ttyUSB0 -> ttyUSB0
+    const char * slash = strrchr(arg, '/');
+    snprintf(sensor.clientId, sizeof(sensor.clientId), "%s", slash ? slash + 1 : arg);
+  }
+
+  sensor.path = arg;
+}
+
+void stop(int)
+{
+  running = 0;
+}
+
+/*--------------------------- Program -------------------------------*/
+int main(int argc, char ** argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "h:p:t:i:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'h': mqttHost = optarg; break;
+      case 'p': mqttPort = atoi(optarg); break;
+      case 't': topicPrefix = optarg; break;
+      case 'i': updateMs = atoi(optarg) * 1000; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc)
+  {
+    usage(argv[0]);
+  }
+
+  for (int i = optind; i < argc; i++)
+  {
+    addSensor(argv[i]);
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  epollFd = epoll_create1(0);
+
+  for (int i = 0; i < sensorCount; i++)
+  {
+    if (!openSensor(sensors[i]))
+    {
+      sensors[i].retryMs = nowMs() + TTY_RETRY_MS;
+    }
+  }
+
+  mosquitto_lib_init();
+
+  char clientId[32];
+  snprintf(clientId, sizeof(clientId), "aqs-gateway-%d", getpid());
+  mosq = mosquitto_new(clientId, true, NULL);
+  mosquitto_connect_callback_set(mosq, mqttOnConnect);
+  mosquitto_disconnect_callback_set(mosq, mqttOnDisconnect);
+  mqttConnect();
+
+  uint64_t lastUpdateMs = nowMs();
+  uint64_t lastMiscMs = 0;
+
+  while (running)
+  {
+    mqttUpdateEpoll();
+
+    // Wake at least once a second for keepalives/retries
+    struct epoll_event events[16];
+    int count = epoll_wait(epollFd, events, 16, 1000);
+
+    for (int i = 0; i < count; i++)
+    {
+      if (events[i].data.u64 == EPOLL_MQTT_ID)
+      {
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        {
+          mosquitto_loop_read(mosq, 1);
+        }
+        if (events[i].events & EPOLLOUT)
+        {
+          mosquitto_loop_write(mosq, 1);
+        }
+        continue;
+      }
+
+      sensor_t & sensor = sensors[events[i].data.u64];
+      if (sensor.fd < 0)
+      {
+        continue;
+      }
+
+      if (events[i].events & EPOLLIN)
+      {
+        readSensor(sensor);
+      }
+      else if (events[i].events & (EPOLLERR | EPOLLHUP))
+      {
+        closeSensor(sensor);
+      }
+    }
+
+    uint64_t now = nowMs();
+
+    if ((now - lastMiscMs) >= 1000)
+    {
+      lastMiscMs = now;
+      mosquitto_loop_misc(mosq);
+
+      if (!mqttConnected && mqttRetryMs && now >= mqttRetryMs)
+      {
+        mqttConnect();
+      }
+
+      for (int i = 0; i < sensorCount; i++)
+      {
+        if (sensors[i].fd < 0 && now >= sensors[i].retryMs && !openSensor(sensors[i]))
+        {
+          sensors[i].retryMs = now + TTY_RETRY_MS;
+        }
+      }
+    }
+
+    if (updateMs && (now - lastUpdateMs) >= updateMs)
+    {
+      lastUpdateMs = now;
+      publishTelemetry();
+    }
+  }
+
+  mosquitto_disconnect(mosq);
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+
+  return 0;
+}
@@ -0,0 +1,530 @@
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiServer.h>
+#include <WiFiClient.h>
+
+// Concurrent HTTP connections, anything more waits to be accepted
+#define HTTP_POOL_SLOTS             4
+
+// Each slot has a fixed buffer, allocated with the pool, for its request
+// and then its response. A request is at most HTTP_REQUEST_MAX_BYTES (line,
+// headers and body), leaving room for the start of a response rendered
+// while the request is still being read. Once it has been read the response
+// has the whole buffer, which only has to hold the largest streamed part
+// (about 1.2KB, the animation command's schema in /adopt). 4 slots are 6KB
+// of .bss.
+#define HTTP_SLOT_BUFFER_SIZE       1536
+#define HTTP_REQUEST_MAX_BYTES      1408
+
+// A whole request must arrive within this, so idle and slowloris clients
+// can't hold a slot
+#define HTTP_REQUEST_TIMEOUT_MS     5000
+
+// A response must keep making progress, or the client is dropped
+#define HTTP_WRITE_TIMEOUT_MS       10000
+
+// Time allowed for a response to be acked before the connection is closed
+#define HTTP_CLOSE_TIMEOUT_MS       2000
+
+// Longest a blocking write (see httpResponse) may wait on the client
+#define HTTP_SPILL_TIMEOUT_MS       1000
+
+// Bytes written to one client per loop() at most
+#define HTTP_WRITE_SLICE            1460
+
+// Slot states
+#define HTTP_SLOT_FREE              0
+#define HTTP_SLOT_READING           1       // waiting for the rest of the request
+#define HTTP_SLOT_WRITING           2       // draining the response, rendering streamed parts
+#define HTTP_SLOT_CLOSING           3       // waiting for the response to be acked
+
+/**
+ * A slot's response, rendered into the slot's buffer and drained a slice at
+ * a time as the client's TCP send buffer allows. If a response outgrows the
+ * buffer, what is buffered so far is written out then and there, waiting on
+ * the client (a blocking write, counted). Large responses should be streamed
+ * in parts which each fit (see httpRequest_t::stream()) so this never
+ * happens.
+ */
+class httpResponse : public Print {
+public:
+    // Once, when the pool is created
+    void begin(WiFiClient& client, uint8_t * buffer, uint32_t * blockingWrites) {
+        _client = &client;
+        _buffer = buffer;
+        _blockingWrites = blockingWrites;
+    }
+
+    // Empty, with the response starting at 'start' in the buffer
+    void reset(size_t start) {
+        _start = start;
+        _head = start;
+        _end = start;
+        failed = false;
+    }
+
+    // The request ahead of the response has been read, move what is buffered
+    // down over it so the response has the whole buffer
+    void reclaim() {
+        size_t count = pending();
+        memmove(_buffer, _buffer + _head, count);
+
+        _start = 0;
+        _head = 0;
+        _end = count;
+    }
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t * buffer, size_t size) override {
+        size_t written = 0;
+
+        while (size && !failed) {
+            if (_end == HTTP_SLOT_BUFFER_SIZE) {
+                _spill();
+                continue;
+            }
+
+            size_t count = min(size, (size_t)(HTTP_SLOT_BUFFER_SIZE - _end));
+            memcpy(_buffer + _end, buffer, count);
+
+            _end += count;
+            buffer += count;
+            size -= count;
+            written += count;
+        }
+
+        return written;
+    }
+
+    using Print::write;
+
+    // Bytes waiting to be written
+    size_t pending() {
+        return _end - _head;
+    }
+
+    // Write up to 'limit' bytes, which the client's send buffer must have room for
+    size_t drain(size_t limit) {
+        size_t count = _client->write(_buffer + _head, min(pending(), limit));
+        _head += count;
+        return count;
+    }
+
+    bool failed = false;            // a blocking write didn't complete
+
+private:
+    void _spill() {
+        (*_blockingWrites)++;
+
+        size_t count = pending();
+        if (_client->write(_buffer + _head, count) != count) {
+            failed = true;
+        }
+
+        _head = _start;
+        _end = _start;
+    }
+
+    WiFiClient * _client = NULL;
+    uint8_t * _buffer = NULL;
+    uint32_t * _blockingWrites = NULL;
+
+    size_t _start = 0;
+    size_t _head = 0;               // next byte to write
+    size_t _end = 0;
+};
+
+// Renders part 'part' (from 0) of a streamed response, false once there
+// are no more parts (having written nothing)
+typedef bool (*httpStreamer_t)(Print& out, uint16_t part);
+
+// A complete request, handed to the pool's handler
+struct httpRequest_t {
+    WiFiClient& client;
+    const uint8_t * data;
+    size_t length;
+    httpResponse& response;
+    httpStreamer_t streamer;
+    bool detached;
+
+    // Request line of "GET <path>" (with or without a query string)
+    bool isGet(const char * path) {
+        size_t pathLength = strlen(path);
+
+        if (length < pathLength + 5) {
+            return false;
+        }
+
+        if (memcmp(data, "GET ", 4) != 0 || memcmp(data + 4, path, pathLength) != 0) {
+            return false;
+        }
+
+        return data[pathLength + 4] == ' ' || data[pathLength + 4] == '?';
+    }
+
+    // Respond a part at a time, each rendered into the slot's buffer once
+    // the last has been written, so the response is never held whole
+    void stream(httpStreamer_t streamer) {
+        this->streamer = streamer;
+    }
+
+    // The handler has taken the connection over (e.g. an event stream), the
+    // pool forgets it without closing it
+    void detach() {
+        detached = true;
+    }
+};
+
+/**
+ * Client over a request already buffered by the pool, so code written to
+ * serve a socket to completion (e.g. the REST API) never waits on the wire.
+ * Reads come from the buffered request, writes go to the slot's response.
+ * Once the request has been read in full the response is given its space
+ * (see httpResponse::reclaim()), so request.data is no longer valid.
+ */
+class httpBufferedClient : public Client {
+public:
+    httpBufferedClient(httpRequest_t& request) : _request(request) {}
+
+    int connect(IPAddress, uint16_t) override { return 0; }
+    int connect(const char *, uint16_t) override { return 0; }
+
+    size_t write(uint8_t c) override {
+        return _request.response.write(c);
+    }
+
+    size_t write(const uint8_t * buffer, size_t size) override {
+        return _request.response.write(buffer, size);
+    }
+
+    int available() override {
+        return _request.length - _position;
+    }
+
+    int read() override {
+        if (_position == _request.length) {
+            return -1;
+        }
+
+        uint8_t c = _request.data[_position];
+        _advance(1);
+        return c;
+    }
+
+    int read(uint8_t * buffer, size_t size) override {
+        size_t count = min(size, _request.length - _position);
+        memcpy(buffer, _request.data + _position, count);
+        _advance(count);
+        return count;
+    }
+
+    int peek() override {
+        return _position < _request.length ? _request.data[_position] : -1;
+    }
+
+    void flush() override {}
+
+    // The pool closes the connection once the response has been written
+    void stop() override {}
+
+    uint8_t connected() override {
+        return _request.client.connected();
+    }
+
+    operator bool() override {
+        return true;
+    }
+
+private:
+    void _advance(size_t count) {
+        _position += count;
+
+        if (count && _position == _request.length) {
+            _request.response.reclaim();
+        }
+    }
+
+    httpRequest_t& _request;
+    size_t _position = 0;
+};
+
+/**
+ * Fixed pool of HTTP connection slots on the REST port, advanced a slice at
+ * a time from loop(). Requests are read as they arrive until complete, then
+ * handed to the handler which renders its response (or the first of its
+ * streamed parts) into the slot's buffer - that is written out only as fast
+ * as the client's TCP send buffer takes it. A slow or half-open client only
+ * ever holds its own slot, never loop(). Nothing is allocated per request.
+ */
+class httpPool {
+public:
+    typedef void (*handler_t)(httpRequest_t& request);
+
+    httpPool(WiFiServer& server) : _server(server) {
+        for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+            _slots[i].response.begin(_slots[i].client, _slots[i].buffer, &blockingWrites);
+        }
+    }
+
+    void onRequest(handler_t handler) {
+        _handler = handler;
+    }
+
+    // Call from loop()
+    void loop() {
+        _accept();
+
+        // At most one request rendered per loop(), they are the costly part
+        bool dispatched = false;
+
+        for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+            slot_t& slot = _slots[i];
+
+            if (slot.state == HTTP_SLOT_READING && !dispatched) {
+                dispatched = _read(slot);
+            }
+
+            if (slot.state == HTTP_SLOT_WRITING) {
+                _write(slot);
+            }
+
+            if (slot.state == HTTP_SLOT_CLOSING) {
+                _close(slot);
+            }
+        }
+    }
+
+    uint8_t active() {
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+            if (_slots[i].state != HTTP_SLOT_FREE) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // Response bytes waiting to be written
+    size_t bytes() {
+        size_t count = 0;
+        for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+            if (_slots[i].state == HTTP_SLOT_WRITING) {
+                count += _slots[i].response.pending();
+            }
+        }
+        return count;
+    }
+
+    uint32_t requests = 0;
+    uint32_t rejected = 0;          // request too large
+    uint32_t timeouts = 0;          // idle, slowloris or stalled clients evicted
+    uint32_t blockingWrites = 0;    // responses (or parts) too big for the slot buffer
+
+private:
+    struct slot_t {
+        uint8_t state = HTTP_SLOT_FREE;
+        WiFiClient client;
+        uint8_t buffer[HTTP_SLOT_BUFFER_SIZE];
+        size_t length = 0;          // of the request
+        httpResponse response;
+        httpStreamer_t streamer = NULL;
+        uint16_t part = 0;          // next streamed part
+        size_t sendBuffer = 0;      // TCP send buffer with nothing in flight
+        uint32_t deadlineMs = 0;
+    };
+
+    // Only take a new connection once there is a slot for it, the rest wait
+    // in the server's backlog
+    void _accept() {
+        for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+            slot_t& slot = _slots[i];
+            if (slot.state != HTTP_SLOT_FREE) {
+                continue;
+            }
+
+            WiFiClient client = _server.available();
+            if (!client) {
+                return;
+            }
+
+            client.setNoDelay(true);
+            client.setTimeout(HTTP_SPILL_TIMEOUT_MS);
+
+            slot.client = client;
+            slot.length = 0;
+            slot.sendBuffer = client.availableForWrite();
+            slot.deadlineMs = millis() + HTTP_REQUEST_TIMEOUT_MS;
+            slot.state = HTTP_SLOT_READING;
+            return;
+        }
+    }
+
+    // Take whatever has arrived, true if a request was dispatched
+    bool _read(slot_t& slot) {
+        size_t available = slot.client.available();
+        if (available) {
+            size_t room = HTTP_REQUEST_MAX_BYTES - slot.length;
+            slot.length += slot.client.read(slot.buffer + slot.length, min(available, room));
+        }
+
+        if (_complete(slot)) {
+            _dispatch(slot);
+            return true;
+        }
+
+        if (slot.length == HTTP_REQUEST_MAX_BYTES) {
+            rejected++;
+            _respond(slot, F("HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n"));
+            return false;
+        }
+
+        if (!slot.client.connected()) {
+            _release(slot);
+        } else if ((int32_t)(millis() - slot.deadlineMs) >= 0) {
+            timeouts++;
+            _release(slot);
+        }
+
+        return false;
+    }
+
+    // Headers received, plus any Content-Length of body
+    bool _complete(slot_t& slot) {
+        const uint8_t * end = NULL;
+        for (size_t i = 3; i < slot.length; i++) {
+            if (memcmp(slot.buffer + i - 3, "\r\n\r\n", 4) == 0) {
+                end = slot.buffer + i + 1;
+                break;
+            }
+        }
+
+        if (!end) {
+            return false;
+        }
+
+        size_t headerLength = end - slot.buffer;
+        return slot.length >= headerLength + _contentLength(slot.buffer, headerLength);
+    }
+
+    size_t _contentLength(const uint8_t * headers, size_t length) {
+        static const char name[] = "\r\ncontent-length:";
+        size_t nameLength = sizeof(name) - 1;
+
+        for (size_t i = 0; i + nameLength < length; i++) {
+            if (strncasecmp((const char *)headers + i, name, nameLength) != 0) {
+                continue;
+            }
+
+            size_t value = 0;
+            for (i += nameLength; i < length && (headers[i] == ' ' || isdigit(headers[i])); i++) {
+                if (headers[i] != ' ') {
+                    value = value * 10 + (headers[i] - '0');
+                }
+            }
+            return value;
+        }
+
+        return 0;
+    }
+
+    void _dispatch(slot_t& slot) {
+        requests++;
+
+        // Anything the handler writes goes after the request, which it may
+        // still be reading, until it has read it all
+        slot.response.reset(slot.length);
+
+        httpRequest_t request = { slot.client, slot.buffer, slot.length, slot.response, NULL, false };
+        _handler(request);
+
+        if (request.detached) {
+            slot.client = WiFiClient();
+            slot.state = HTTP_SLOT_FREE;
+            return;
+        }
+
+        if (slot.response.failed) {
+            timeouts++;
+            _release(slot);
+            return;
+        }
+
+        slot.streamer = request.streamer;
+        slot.part = 0;
+        slot.deadlineMs = millis() + HTTP_WRITE_TIMEOUT_MS;
+        slot.state = HTTP_SLOT_WRITING;
+    }
+
+    // Short canned response, in place of the request
+    void _respond(slot_t& slot, const __FlashStringHelper * response) {
+        slot.response.reset(0);
+        slot.response.print(response);
+
+        slot.streamer = NULL;
+        slot.deadlineMs = millis() + HTTP_WRITE_TIMEOUT_MS;
+        slot.state = HTTP_SLOT_WRITING;
+    }
+
+    void _write(slot_t& slot) {
+        if (!slot.client.connected()) {
+            _release(slot);
+            return;
+        }
+
+        // Render the next streamed part once the last has all gone
+        if (!slot.response.pending() && slot.streamer) {
+            slot.response.reset(0);
+            if (!slot.streamer(slot.response, slot.part++)) {
+                slot.streamer = NULL;
+            }
+        }
+
+        if (slot.response.failed) {
+            timeouts++;
+            _release(slot);
+            return;
+        }
+
+        size_t room = min((size_t)slot.client.availableForWrite(), (size_t)HTTP_WRITE_SLICE);
+        if (room && slot.response.pending() && slot.response.drain(room)) {
+            slot.deadlineMs = millis() + HTTP_WRITE_TIMEOUT_MS;
+        }
+
+        if (!slot.response.pending() && !slot.streamer) {
+            slot.deadlineMs = millis() + HTTP_CLOSE_TIMEOUT_MS;
+            slot.state = HTTP_SLOT_CLOSING;
+        } else if ((int32_t)(millis() - slot.deadlineMs) >= 0) {
+            timeouts++;
+            _release(slot);
+        }
+    }
+
+    // Closing with data still unacked waits for it, so only close once the
+    // send buffer has drained (or the client has gone)
+    void _close(slot_t& slot) {
+        bool acked = (size_t)slot.client.availableForWrite() >= slot.sendBuffer;
+
+        if (acked || !slot.client.connected() || (int32_t)(millis() - slot.deadlineMs) >= 0) {
+            _release(slot);
+        }
+    }
+
+    void _release(slot_t& slot) {
+        slot.response.reset(0);
+        slot.streamer = NULL;
+
+        // Release the connection, not just the slot
+        slot.client.stop();
+        slot.client = WiFiClient();
+        slot.state = HTTP_SLOT_FREE;
+    }
+
+    WiFiServer& _server;
+    handler_t _handler = NULL;
+
+    slot_t _slots[HTTP_POOL_SLOTS];
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Raw binary LED frames - a fast path for driving the pixels which skips
+ * JSON parsing entirely. Frames are copied straight into the LED buffer.
+ *
+ *   byte 0     magic (0x4C - 'L')
+ *   byte 1     bytes per pixel in this frame (3 = RGB, 4 = RGBW)
+ *   byte 2     index of the first pixel in this frame
+ *   byte 3     number of pixels in this frame
+ *   byte 4..   packed pixel data (pixel count * bytes per pixel)
+ */
+namespace ledFrame {
+    constexpr static const uint8_t MAGIC = 0x4C;
+    constexpr static const uint8_t HEADER_SIZE = 4;
+
+    // Copy a frame into 'colour' (a buffer of 'pixels' x 'channels' bytes),
+    // returns false if the frame is malformed, leaving 'colour' untouched
+    bool apply(const uint8_t * payload, unsigned int length, uint8_t * colour, uint8_t pixels, uint8_t channels) {
+        if (length < HEADER_SIZE || payload[0] != MAGIC) {
+            return false;
+        }
+
+        const uint8_t bpp = payload[1];
+        const uint8_t first = payload[2];
+        const uint8_t count = payload[3];
+
+        if ((bpp != 3 && bpp != 4) || count == 0 || first >= pixels || count > pixels - first) {
+            return false;
+        }
+
+        if (length != HEADER_SIZE + (unsigned int)count * bpp) {
+            return false;
+        }
+
+        const uint8_t * src = payload + HEADER_SIZE;
+        uint8_t * dst = colour + first * channels;
+
+        for (uint8_t p = 0; p < count; p++) {
+            for (uint8_t c = 0; c < channels; c++) {
+                // RGB frames sent to RGBW pixels leave the white channel off
+                dst[c] = c < bpp ? src[c] : 0;
+            }
+
+            src += bpp;
+            dst += channels;
+        }
+
+        return true;
+    }
+} // namespace ledFrame
@@ -38,19 +38,41 @@
 /*--------------------------- Libraries -------------------------------*/
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
+#include <Ticker.h>
 #include <WiFiManager.h>
 #include <OXRS_MQTT.h>
 #include <OXRS_API.h>
-#include <MqttLogger.h>
 #include <OXRS_SENSORS.h>           // For QWICC I2C sensors
+#include <EEPROM.h>
 
 // IKEA sensor reading tools from
 // https://github.com/Hypfer/esp8266-vindriktning-particle-sensor
 #include <serialCom.h>
 #include <types.h>
+#include <fastBoot.h>
+#include <teleQueue.h>
+#include <metrics.h>
+#include <seqlock.h>
+#include <publishQueue.h>
+#include <bufferedLogger.h>
+#include <eventStream.h>
+#include <httpPool.h>
+#include <stallWatchdog.h>
+#include <networkState.h>
+#include <alerts.h>
+#include <fields.h>
+
+#if PM_SENSOR_COUNT < 1 || PM_SENSOR_COUNT > 4
+#error "PM_SENSOR_COUNT must be between 1 and 4"
+#endif
+
+#if defined(NEOPIXEL_UART) && PIN_UART_RX == 2
+#error "NEOPIXEL_UART drives the LEDs from GPIO2 (UART1 TX), move the PM sensor to another PIN_UART_RX"
+#endif
 
 #if defined(LED_RGBW) || defined(LED_RGB)
 #include "ledPWMNeopixel.h"
+#include <ledFrame.h>
 #endif
 
 /*--------------------------- Constants ----------------------------------*/
@@ -67,6 +89,7 @@
 // Supported LED modes
 #define LED_MODE_AUTO               0
 #define LED_MODE_MANUAL             1
+#define LED_MODE_ANIMATION          2
 
 // Supported LED states
 #define LED_STATE_OFF               0
@@ -81,6 +104,74 @@
 // Default auto mode led brightness
 #define DEFAULT_AUTO_BRIGHTNESS 50
 
+// loop() stages running longer than this are recorded (see stallWatchdog.h)
+#define DEFAULT_STALL_THRESHOLD_MS  1000
+
+// LED layout
+#define LED_PIXEL_COUNT             3
+#if defined(LED_RGBW)
+#define LED_CHANNEL_COUNT           4
+#else
+#define LED_CHANNEL_COUNT           3
+#endif
+
+// Supported payload encodings
+#define PAYLOAD_ENCODING_JSON       0
+#define PAYLOAD_ENCODING_MSGPACK    1
+
+// Sub-topic added to the topic of MessagePack encoded payloads
+#define MSGPACK_TOPIC_SUFFIX        "/msgpack"
+
+// Sub-topic (of our command topic) for raw binary LED frames
+#define LED_FRAME_TOPIC_SUFFIX      "/leds"
+
+// Room for any of our topics, including sub-topics
+#define TOPIC_BUFFER_SIZE           64
+
+// Emulated EEPROM (flash) layout
+#define EEPROM_SIZE                 1024
+#define EEPROM_ANIMATION_OFFSET     0
+#define EEPROM_ANIMATION_MAGIC      0xA5
+#define EEPROM_CONFIG_OFFSET        256
+#define EEPROM_TELE_QUEUE_OFFSET    512
+
+// Telemetry store-and-forward queue
+#define TELE_QUEUE_RAM_SIZE         16      // readings held in RAM
+#define TELE_QUEUE_SPILL_SIZE       ((EEPROM_SIZE - EEPROM_TELE_QUEUE_OFFSET - 16) / sizeof(teleReading_t))   // readings held in flash once RAM is full
+#define TELE_DRAIN_INTERVAL_MS      500     // minimum time between backlog batches
+#define TELE_DRAIN_BATCH_SIZE       5       // readings published per batch
+#define TELE_DRAIN_JITTER_MS        5000    // random delay before draining, spreads reconnect storms
+
+// How often to retry publishing adoption info which didn't go on connect
+#define ADOPT_RETRY_MS              10000
+
+// RTC user memory layout (offsets are in 4 byte blocks)
+#define RTC_FAST_BOOT_OFFSET        0
+#define RTC_STALL_LOG_OFFSET        (RTC_FAST_BOOT_OFFSET + (sizeof(rtcState_t) + 3) / 4)
+#define RTC_STALL_STAGE_OFFSET      (RTC_STALL_LOG_OFFSET + (sizeof(stallLog_t) + 3) / 4)
+#define RTC_USER_MEMORY_SIZE        512
+
+// How often to refresh the fast boot state in RTC memory
+#define FAST_BOOT_SAVE_MS           1000
+
+// How often to check for a stalled loop() stage, from a timer
+#define STALL_CHECK_INTERVAL_MS     100
+
+// How often to publish UART link quality diagnostics
+#define DIAGNOSTICS_INTERVAL_MS     300000
+
+// How long to try the remembered BSSID/channel before falling back to saved creds
+#define FAST_WIFI_TIMEOUT_MS        3000
+
+// How long to try saved WiFi creds before starting the captive portal
+#define WIFI_CONNECT_TIMEOUT_MS     20000
+
+// Built-in animation timings (milliseconds)
+#define BREATHE_DURATION_MS         1500
+#define PULSE_ON_DURATION_MS        250
+#define PULSE_OFF_DURATION_MS       750
+#define CHASE_DURATION_MS           300
+
 /*--------------------------- Global Variables ---------------------------*/
 // stack size counter (for determine used heap size on ESP8266)
 char * g_stack_start;
@@ -92,6 +183,15 @@ uint32_t g_auto_fade_interval_us = DEFAULT_FADE_INTERVAL_US;
 // LED auto mode brightness
 uint8_t g_auto_brightness = DEFAULT_AUTO_BRIGHTNESS;
 
+// Encoding used for telemetry and adoption payloads
+uint8_t payloadEncoding = PAYLOAD_ENCODING_JSON;
+
+// Also publish each reading to its own retained subtopic of tele
+bool retainedMetrics = false;
+
+// Record loop() stages which take longer than this (0 = off)
+uint16_t stallThresholdMs = DEFAULT_STALL_THRESHOLD_MS;
+
 // LED controls
 uint8_t ledMode = LED_MODE_AUTO;
 uint8_t ledState = LED_STATE_OFF;
@@ -103,11 +203,70 @@ uint32_t fadeIntervalUs = DEFAULT_FADE_INTERVAL_US;
 unsigned long lastFadeUs;
 unsigned long lastAutoFadeUs;
 
+// raw binary LED frame topic (built once we know our client id)
+char ledFrameTopic[TOPIC_BUFFER_SIZE];
+
+// uploaded (or built-in) animation, played in animation mode
+#if defined(LED_RGBW) || defined(LED_RGB)
+animation ledAnimation;
+bool ledAnimationPending = true;
+#endif
+
 //IKEA variables
 uint32_t updateMs = DEFAULT_IKEA_UPDATE_MS;
 uint32_t lastUpdate;
 uint16_t ledPM = 0;
 
+// fast boot variables
+rtcState_t rtcState;
+bool rtcStateValid = false;
+uint32_t lastFastBootSave;
+bool firstTelemetrySent = false;
+
+// diagnostics variables
+uint32_t lastDiagnostics = 0;
+
+// command latency variables (see commandAck_t)
+uint32_t commandReceivedMs;
+uint32_t commandReceivedUs;
+char commandCorrelationId[CORRELATION_ID_SIZE];
+bool commandChangedLeds = false;
+bool restartPending = false;
+commandAck_t commandAck;
+
+// device clock, carries on across warm restarts
+uint32_t clockOffsetMs = 0;
+uint32_t bootEpoch;
+
+// latest time-aligned sample, taken on each PM frame
+teleReading_t teleSample;
+bool teleSampleValid = false;
+
+// last values on the retained per-metric subtopics, and which of them
+// (TELE_HAS_xxx) the broker has
+teleReading_t teleRetained;
+uint16_t teleRetainedFlags = 0;
+
+// loop timing (microseconds between loop() calls)
+uint32_t lastLoopStartUs;
+uint32_t loopPeriodUs = 0;
+uint32_t loopPeriodMaxUs = 0;
+uint32_t loopCount = 0;
+
+// telemetry backlog variables
+uint32_t teleDrainNotBefore;
+uint32_t teleDrainStartMs;
+uint32_t teleLastDrainMs;
+uint32_t teleLastDrainDurationMs = 0;
+uint16_t teleDrainCount = 0;
+
+// adoption info still to publish since we connected
+bool adoptPending = false;
+uint32_t adoptRetryMs;
+
+// network variables
+bool restApiStarted = false;
+
 /*--------------------------- Instantiate Global Objects -----------------*/
 // WiFi client
 WiFiClient client;
@@ -116,15 +275,59 @@ WiFiClient client;
 PubSubClient mqttClient(client);
 OXRS_MQTT mqtt(mqttClient);
 
+// Everything we publish goes via here, see publishQueue.h
+publishQueue publisher(mqttClient, client);
+
+// WiFi captive portal (non-blocking, see networkState.h)
+WiFiManager wm;
+
+// Network bring-up, polled from loop()
+networkState netState;
+
 // REST API
 WiFiServer server(REST_API_PORT);
 OXRS_API api(mqtt);
 
+// Connections on the REST port, served a slice at a time (see httpPool.h)
+httpPool http(server);
+
+// PM threshold/rate-of-change alerts
+alerts pmAlerts;
+
+// Live readings over Server-Sent Events (GET /events)
+eventStream events;
+
+// Which loop() stage is running, recording any that stall
+stallWatchdog stalls;
+Ticker stallTicker;
+
 // Logging
-MqttLogger logger(mqttClient, "log", MqttLoggerMode::MqttAndSerial);
+bufferedLogger logger(publisher);
+
+// IKEA sensors, the first is the primary which drives the LEDs and alerts
+// (more sensors with e.g. -DPM_SENSOR_COUNT=2 -DPIN_UART_RX_2=14)
+const uint8_t pmSensorPins[PM_SENSOR_COUNT] = {
+  PIN_UART_RX,
+#if PM_SENSOR_COUNT > 1
+  PIN_UART_RX_2,
+#endif
+#if PM_SENSOR_COUNT > 2
+  PIN_UART_RX_3,
+#endif
+#if PM_SENSOR_COUNT > 3
+  PIN_UART_RX_4,
+#endif
+};
+
+serialCom pmSensors[PM_SENSOR_COUNT];
+
+// Data structure for each IKEA sensor - only ever written by UART acquisition,
+// everything else reads consistent snapshots from sensorState
+particleSensorState_t acquisitionState[PM_SENSOR_COUNT];
+seqlock<particleSensorState_t> sensorState[PM_SENSOR_COUNT];
 
-// Data structure for the IKEA sensor
-particleSensorState_t state;
+// Readings waiting for MQTT to come back
+teleQueue<teleReading_t, TELE_QUEUE_RAM_SIZE> teleBacklog;
 
 // I2C sensors
 OXRS_SENSORS sensors(mqtt);
@@ -171,6 +374,11 @@ void getSystemJson(JsonVariant json)
 
   system["fileSystemUsedBytes"] = fsInfo.usedBytes;
   system["fileSystemTotalBytes"] = fsInfo.totalBytes;
+
+  JsonObject backlog = system.createNestedObject("telemetryBacklog");
+  backlog["depth"] = teleBacklog.depth();
+  backlog["drops"] = teleBacklog.drops;
+  backlog["lastDrainMs"] = teleLastDrainDurationMs;
 }
 
 void getNetworkJson(JsonVariant json)
@@ -188,150 +396,6 @@ void getNetworkJson(JsonVariant json)
   network["mac"] = mac_display;
 }
 
-void getConfigSchemaJson(JsonVariant json)
-{
-  JsonObject configSchema = json.createNestedObject("configSchema");
-  
-  // Config schema metadata
-  configSchema["$schema"] = JSON_SCHEMA_VERSION;
-  configSchema["title"] = FW_SHORT_NAME;
-  configSchema["type"] = "object";
-
-  JsonObject properties = configSchema.createNestedObject("properties");
-
-  JsonObject updateSeconds = properties.createNestedObject("ikeaSensorUpdateSeconds");
-  updateSeconds["title"] = "IKEA Sensor Update Interval (seconds)";
-  updateSeconds["description"] = "How often to read and report the values from the IKEA sensor  (defaults to 60 seconds, setting to 0 disables sensor reports). Must be a number between 0 and 86400 (i.e. 1 day).";
-  updateSeconds["type"] = "integer";
-  updateSeconds["minimum"] = 0;
-  updateSeconds["maximum"] = 86400;
-
-  #if defined(LED_RGBW) || defined(LED_RGB)
-  JsonObject ledMode = properties.createNestedObject("ledMode");
-  ledMode["type"] = "string";
-  ledMode["description"] = "What mode led's should function in on startup (defaults to auto)";
-  JsonArray ledModeEnum = ledMode.createNestedArray("enum");
-  ledModeEnum.add("auto");
-  ledModeEnum.add("manual");
-
-  JsonObject autoFadeIntervalUs = properties.createNestedObject("autoFadeIntervalUs");
-  autoFadeIntervalUs["type"] = "integer";
-  autoFadeIntervalUs["minimum"] = 0;
-  autoFadeIntervalUs["description"] = "Controls color fading in Auto mode, in microseconds (defaults to 20000us)";
-
-  JsonObject autoBrightness = properties.createNestedObject("autoBrightness");
-  autoBrightness["type"] = "integer";
-  autoFadeIntervalUs["minimum"] = 0;
-  autoBrightness["maximum"] = 255;
-  autoBrightness["description"] = "Controls overall brightness of leds in auto mode (0-255 possible) (defaults to 50)";
-  
-  JsonObject fadeIntervalUs = properties.createNestedObject("fadeIntervalUs");
-  fadeIntervalUs["type"] = "integer";
-  fadeIntervalUs["minimum"] = 0;
-  fadeIntervalUs["description"] = "Default time to fade from off -> on (and vice versa), in microseconds (defaults to 20000us)";
-  #endif
-
-  // Add any sensor config
-  sensors.setConfigSchema(properties);
-}
-
-void getCommandSchemaJson(JsonVariant json)
-{
-  JsonObject commandSchema = json.createNestedObject("commandSchema");
-  
-  // Command schema metadata
-  commandSchema["$schema"] = JSON_SCHEMA_VERSION;
-  commandSchema["title"] = FW_SHORT_NAME;
-  commandSchema["type"] = "object";
-
-  JsonObject properties = commandSchema.createNestedObject("properties");
-
-  #if defined(LED_RGBW) || defined(LED_RGB)
-  JsonObject LED = properties.createNestedObject("LED");
-  LED["type"] = "array";
-  LED["description"] = "Set the operation of Neopixels - auto will have the leds act like the one ikea had built in show green, yellow, red. Manaul gives you full control over each led along with fade speed and state of on / off";
-  
-  JsonObject LEDItems = LED.createNestedObject("items");
-  LEDItems["type"] = "object";
-
-  JsonObject LEDProperties = LEDItems.createNestedObject("properties");
-
-  JsonObject mode = LEDProperties.createNestedObject("mode");
-  mode["type"] = "string";
-  JsonArray modeEnum = mode.createNestedArray("enum");
-  modeEnum.add("auto");
-  modeEnum.add("manual");
-
-  JsonObject state = LEDProperties.createNestedObject("state");
-  state["type"] = "string";
-  JsonArray stateEnum = state.createNestedArray("enum");
-  stateEnum.add("on");
-  stateEnum.add("off");
-
-  JsonObject pixel1 = LEDProperties.createNestedObject("pixel1");
-  pixel1["type"] = "array";
-  #if defined(LED_RGBW)
-  pixel1["maxItems"] = 4;
-  #elif defined(RGB)
-  pixel1["maxItems"] = 3;
-  #endif
-  
-  JsonObject pixel1Items = pixel1.createNestedObject("items");
-  pixel1Items["type"] = "integer";
-  pixel1Items["minimum"] = 0;
-  pixel1Items["maximum"] = 255;
-
-  JsonObject pixel2 = LEDProperties.createNestedObject("pixel2");
-  pixel2["type"] = "array";
-  #if defined(LED_RGBW)
-  pixel2["maxItems"] = 4;
-  #elif defined(RGB)
-  pixel2["maxItems"] = 3;
-  #endif
-  
-  JsonObject pixel2Items = pixel2.createNestedObject("items");
-  pixel2Items["type"] = "integer";
-  pixel2Items["minimum"] = 0;
-  pixel2Items["maximum"] = 255;
-
-  JsonObject pixel3 = LEDProperties.createNestedObject("pixel3");
-  pixel3["type"] = "array";
-  #if defined(LED_RGBW)
-  pixel3["maxItems"] = 4;
-  #elif defined(RGB)
-  pixel3["maxItems"] = 3;
-  #endif
-  
-  JsonObject pixel3Items = pixel3.createNestedObject("items");
-  pixel3Items["type"] = "integer";
-  pixel3Items["minimum"] = 0;
-  pixel3Items["maximum"] = 255;
-
-  JsonObject fadeIntervalUs = LEDProperties.createNestedObject("fadeIntervalUs");
-  fadeIntervalUs["type"] = "integer";
-  fadeIntervalUs["minimum"] = 0;
-
-  JsonArray required = LEDItems.createNestedArray("required");
-  required.add("mode");
-  #endif
-
-  JsonObject restart = properties.createNestedObject("restart");
-  restart["type"] = "boolean";
-
-  // Add any sensor commands
-  sensors.setCommandSchema(properties);
-}
-
-void apiAdopt(JsonVariant json)
-{
-  // Build device adoption info
-  getFirmwareJson(json);
-  getSystemJson(json);
-  getNetworkJson(json);
-  getConfigSchemaJson(json);
-  getCommandSchemaJson(json);
-}
-
 /*--------------------------- LED -----------------*/
 void ledFade(uint8_t colour[])
 {
@@ -349,6 +413,15 @@ void ledFade(uint8_t colour[])
   }
 }
 
+void ledShow(uint8_t colour[])
+{
+  #if defined(LED_RGBW)
+    pixelDriver.colour(colour[0], colour[1], colour[2], colour[3], colour[4], colour[5], colour[6], colour[7], colour[8], colour[9], colour[10], colour[11]);
+  #elif defined(LED_RGB)
+    pixelDriver.colour(colour[0], colour[1], colour[2], colour[3], colour[4], colour[5], colour[6], colour[7], colour[8]);
+  #endif
+}
+
 void ledGreen()
 {
   #if defined(LED_RGBW)
@@ -380,6 +453,7 @@ void autoPixels()
 {
   if ((micros() - lastAutoFadeUs) > g_auto_fade_interval_us)
   {
+    particleSensorState_t state = sensorState[0].read();
     if (state.valid)
     {
       DynamicJsonDocument json(10);
@@ -405,6 +479,117 @@ void autoPixels()
   }
 }
 
+/*--------------------------- LED animations -----------------*/
+#if defined(LED_RGBW) || defined(LED_RGB)
+void setAnimationColour(animKeyframe & keyframe, uint8_t pixel, uint8_t colour[])
+{
+  memcpy(&keyframe.colour[pixel * 4], colour, 4);
+}
+
+void builtinAnimation(const char * name, uint8_t colour[])
+{
+  uint8_t off[4] = {0};
+
+  memset(&ledAnimation, 0, sizeof(ledAnimation));
+
+  if (strcmp(name, "breathe") == 0)
+  {
+    // fade all pixels up and down
+    ledAnimation.keyframeCount = 2;
+    for (uint8_t pixel = 0; pixel < LED_PIXEL_COUNT; pixel++)
+    {
+      setAnimationColour(ledAnimation.keyframes[0], pixel, colour);
+    }
+    ledAnimation.keyframes[0].durationMs = BREATHE_DURATION_MS;
+    ledAnimation.keyframes[0].easing = ANIM_EASE_IN_OUT;
+    ledAnimation.keyframes[1].durationMs = BREATHE_DURATION_MS;
+    ledAnimation.keyframes[1].easing = ANIM_EASE_IN_OUT;
+  }
+  else if (strcmp(name, "pulse") == 0)
+  {
+    // quick flash of all pixels, only while the air is bad
+    ledAnimation.keyframeCount = 2;
+    ledAnimation.pmThreshold = HIGH_PARTICLE_COUNT;
+    for (uint8_t pixel = 0; pixel < LED_PIXEL_COUNT; pixel++)
+    {
+      setAnimationColour(ledAnimation.keyframes[0], pixel, colour);
+    }
+    ledAnimation.keyframes[0].durationMs = PULSE_ON_DURATION_MS;
+    ledAnimation.keyframes[0].easing = ANIM_EASE_OUT;
+    ledAnimation.keyframes[1].durationMs = PULSE_OFF_DURATION_MS;
+    ledAnimation.keyframes[1].easing = ANIM_EASE_IN;
+  }
+  else if (strcmp(name, "chase") == 0)
+  {
+    // one pixel lit at a time
+    ledAnimation.keyframeCount = LED_PIXEL_COUNT;
+    for (uint8_t k = 0; k < LED_PIXEL_COUNT; k++)
+    {
+      for (uint8_t pixel = 0; pixel < LED_PIXEL_COUNT; pixel++)
+      {
+        setAnimationColour(ledAnimation.keyframes[k], pixel, pixel == k ? colour : off);
+      }
+      ledAnimation.keyframes[k].durationMs = CHASE_DURATION_MS;
+      ledAnimation.keyframes[k].easing = ANIM_EASE_STEP;
+    }
+  }
+  else
+  {
+    logger.println(F("[AQS] invalid builtin animation"));
+  }
+}
+
+void loadAnimation()
+{
+  if (EEPROM.read(EEPROM_ANIMATION_OFFSET) != EEPROM_ANIMATION_MAGIC)
+  {
+    // nothing uploaded yet, default to a gentle breathe
+    uint8_t colour[4] = {0, 0, g_auto_brightness, 0};
+    builtinAnimation("breathe", colour);
+    return;
+  }
+
+  EEPROM.get(EEPROM_ANIMATION_OFFSET + 1, ledAnimation);
+}
+
+void saveAnimation()
+{
+  EEPROM.write(EEPROM_ANIMATION_OFFSET, EEPROM_ANIMATION_MAGIC);
+  EEPROM.put(EEPROM_ANIMATION_OFFSET + 1, ledAnimation);
+  EEPROM.commit();
+}
+
+void animationPixels()
+{
+  particleSensorState_t state = sensorState[0].read();
+  if (state.valid)
+  {
+    ledPM = state.avgPM25;
+  }
+
+  // Threshold animations only play while the air is bad, auto mode otherwise
+  if (ledAnimation.pmThreshold && ledPM < ledAnimation.pmThreshold)
+  {
+    if (!ledAnimationPending)
+    {
+      pixelDriver.stop();
+      ledAnimationPending = true;
+    }
+
+    autoPixels();
+    return;
+  }
+
+  if (ledAnimationPending)
+  {
+    pixelDriver.play(ledAnimation);
+    ledAnimationPending = false;
+  }
+
+  pixelDriver.animate();
+}
+#endif
+
 void processPixels()
 {
   #if defined(LED_RGBW) 
@@ -428,225 +613,1633 @@ void processPixels()
   #endif
 }
 
-/*--------------------------- MQTT/API -----------------*/
-void mqttConnected() 
+/*--------------------------- Fast boot -----------------*/
+void snapshotConfig(configSnapshot_t & config)
 {
-  // MqttLogger doesn't copy the logging topic to an internal
-  // buffer so we have to use a static array here
-  static char logTopic[64];
-  logger.setTopic(mqtt.getLogTopic(logTopic));
-
-  // Publish device adoption info
-  DynamicJsonDocument json(JSON_ADOPT_MAX_SIZE);
-  mqtt.publishAdopt(api.getAdopt(json.as<JsonVariant>()));
-
-  // Log the fact we are now connected
-  logger.println("[AQS] mqtt connected");
-  // turn first LED green to show mqtt connected and device ready
-  #if defined(LED_RGBW) 
-  pixelDriver.colour(0, 20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-  #elif defined(LED_RGB)
-  pixelDriver.colour(0, 20, 0, 0, 0, 0, 0, 0, 0);
-  #endif
+  memset(&config, 0, sizeof(config));
+  config.updateMs = updateMs;
+  config.fadeIntervalUs = g_fade_interval_us;
+  config.autoFadeIntervalUs = g_auto_fade_interval_us;
+  config.autoBrightness = g_auto_brightness;
+  config.ledMode = ledMode;
+  config.payloadEncoding = payloadEncoding;
+  config.retainedMetrics = retainedMetrics;
+  config.stallThresholdMs = stallThresholdMs;
 }
 
-void mqttDisconnected(int state) 
+void applyConfigSnapshot(const configSnapshot_t & config)
 {
-  // turn first LED orange for disconnected mqtt
-  #if defined(LED_RGBW)
-  pixelDriver.colour(15, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-  #elif defined(LED_RGB)
-  pixelDriver.colour(15, 5, 0, 0, 0, 0, 0, 0, 0);
-  #endif
-  // Log the disconnect reason
-  // See https://github.com/knolleary/pubsubclient/blob/2d228f2f862a95846c65a8518c79f48dfc8f188c/src/PubSubClient.h#L44
-  switch (state)
-  {
-    case MQTT_CONNECTION_TIMEOUT:
-      logger.println(F("[AQS] mqtt connection timeout"));
-      break;
-    case MQTT_CONNECTION_LOST:
-      logger.println(F("[AQS] mqtt connection lost"));
-      break;
-    case MQTT_CONNECT_FAILED:
-      logger.println(F("[AQS] mqtt connect failed"));
-      break;
-    case MQTT_DISCONNECTED:
-      logger.println(F("[AQS] mqtt disconnected"));
-      break;
-    case MQTT_CONNECT_BAD_PROTOCOL:
-      logger.println(F("[AQS] mqtt bad protocol"));
-      break;
-    case MQTT_CONNECT_BAD_CLIENT_ID:
-      logger.println(F("[AQS] mqtt bad client id"));
-      break;
-    case MQTT_CONNECT_UNAVAILABLE:
-      logger.println(F("[AQS] mqtt unavailable"));
-      break;
-    case MQTT_CONNECT_BAD_CREDENTIALS:
-      logger.println(F("[AQS] mqtt bad credentials"));
-      break;      
-    case MQTT_CONNECT_UNAUTHORIZED:
-      logger.println(F("[AQS] mqtt unauthorised"));
-      break;      
-  }
+  updateMs = config.updateMs;
+  g_fade_interval_us = config.fadeIntervalUs;
+  fadeIntervalUs = g_fade_interval_us;
+  g_auto_fade_interval_us = config.autoFadeIntervalUs;
+  g_auto_brightness = config.autoBrightness;
+  ledMode = config.ledMode;
+  payloadEncoding = config.payloadEncoding;
+  retainedMetrics = config.retainedMetrics;
+  stallThresholdMs = config.stallThresholdMs;
+  stalls.thresholdMs = stallThresholdMs;
 }
 
-void mqttCallback(char * topic, uint8_t * payload, unsigned int length) 
+uint32_t deviceMs()
 {
-  // Pass this message down to our MQTT handler
-  mqtt.receive(topic, payload, length);
+  return clockOffsetMs + millis();
 }
 
-void mqttConfig(JsonVariant json)
+void saveFastBootState()
 {
-  if (json.containsKey("ikeaSensorUpdateSeconds"))
-  {
-    updateMs = json["ikeaSensorUpdateSeconds"].as<uint32_t>() * 1000L;
-  }
+  memset(&rtcState, 0, sizeof(rtcState));
 
-  #if defined(LED_RGBW) || defined(LED_RGB)
-  if (json.containsKey("ledMode"))
-  {
-    if (strcmp(json["mode"], "auto") == 0)
-    {
-      ledMode = LED_MODE_AUTO;
-    }
-    else if (strcmp(json["mode"], "manual") == 0)
-    {
-      ledMode = LED_MODE_MANUAL;
-    }
-    else 
-    {
-      logger.println(F("[AQS] invalid configured ledMode"));
-    }
-  }
-  
-  if (json.containsKey("autoFadeIntervalUs"))
-  {
-    g_auto_fade_interval_us = json["autoFadeIntervalUs"].as<uint32_t>();
-  }
+  rtcState.clockMs = deviceMs();
+  rtcState.epoch = bootEpoch;
 
-  if (json.containsKey("autoBrightness"))
+  snapshotConfig(rtcState.config);
+  rtcState.sensor = sensorState[0].read();
+  rtcState.ledState = ledState;
+  memcpy(rtcState.ledColour, ledColour, sizeof(rtcState.ledColour));
+
+  // Ack a restart command once we're back
+  if (restartPending && commandAck.awaitingRestart)
   {
-    g_auto_brightness = json["autoBrightness"].as<uint32_t>();
+    memcpy(rtcState.restartCorrelationId, commandAck.correlationId, sizeof(rtcState.restartCorrelationId));
+    rtcState.restartReceivedMs = commandAck.receivedMs;
   }
 
-  if (json.containsKey("fadeIntervalUs"))
+  if (WiFi.status() == WL_CONNECTED)
   {
-    g_fade_interval_us = json["fadeIntervalUs"].as<uint32_t>();
-    fadeIntervalUs = g_fade_interval_us;
+    memcpy(rtcState.wifiBssid, WiFi.BSSID(), sizeof(rtcState.wifiBssid));
+    rtcState.wifiChannel = WiFi.channel();
   }
-  #endif
 
-  // Let the sensors handle any config
-  sensors.conf(json);
+  fastBoot::writeRtc(RTC_FAST_BOOT_OFFSET, rtcState);
+  lastFastBootSave = millis();
 }
 
-void jsonLedCommand(JsonVariant json)
+void restoreFastBootState()
 {
-  #if defined(LED_RGBW) || defined(LED_RGB)
-  if (json.containsKey("mode"))
+  // Warm restarts resume exactly where we left off
+  if (fastBoot::isWarmBoot() && fastBoot::readRtc(RTC_FAST_BOOT_OFFSET, rtcState))
   {
-    if (strcmp(json["mode"], "auto") == 0)
-    {
-      ledMode = LED_MODE_AUTO;
-    }
-    else if (strcmp(json["mode"], "manual") == 0)
-    {
-      ledMode = LED_MODE_MANUAL;
-    }
-    else 
+    rtcStateValid = true;
+
+    clockOffsetMs = rtcState.clockMs;
+    bootEpoch = rtcState.epoch;
+
+    applyConfigSnapshot(rtcState.config);
+    acquisitionState[0] = rtcState.sensor;
+    sensorState[0].write(acquisitionState[0]);
+    ledState = rtcState.ledState;
+    memcpy(ledColour, rtcState.ledColour, sizeof(ledColour));
+
+    if (rtcState.restartCorrelationId[0])
     {
-      logger.println(F("[AQS] invalid mode"));
+      memcpy(commandAck.correlationId, rtcState.restartCorrelationId, sizeof(commandAck.correlationId));
+      commandAck.receivedMs = rtcState.restartReceivedMs;
+      commandAck.awaitingRestart = true;
     }
+
+    logger.println(F("[AQS] warm boot, state restored from rtc memory"));
+    return;
   }
 
-  if (json.containsKey("state"))
+  // Cold boot, start a new clock epoch
+  bootEpoch = ESP.random();
+
+  // Otherwise fall back to the last config we were sent
+  configSnapshot_t config;
+  if (fastBoot::readConfig(EEPROM_CONFIG_OFFSET, config))
   {
-    if (strcmp(json["state"], "off") == 0)
-    {
-      ledState = LED_STATE_OFF;
-    }
-    else if (strcmp(json["state"], "on") == 0)
-    {
-      ledState = LED_STATE_ON;
-    }
-    else 
-    {
-      logger.println(F("[AQS] invalid state"));
-    }
+    applyConfigSnapshot(config);
+    logger.println(F("[AQS] config restored from flash"));
   }
+}
 
-    if (json.containsKey("pixel1"))
-    {
-      JsonArray array = json["pixel1"].as<JsonArray>();
-      uint8_t colour = 0;
+/*--------------------------- Payload encoding -----------------*/
+// Serialize straight into a publish queue slot, false if there was no room.
+// MessagePack payloads go to the topic with a '/msgpack' suffix.
+bool queueJson(uint8_t cls, char * topic, JsonVariant json, bool retained, bool msgPack)
+{
+  if (msgPack)
+  {
+    strncat(topic, MSGPACK_TOPIC_SUFFIX, TOPIC_BUFFER_SIZE - strlen(topic) - 1);
 
-      for (JsonVariant v : array)
+    size_t length = measureMsgPack(json);
+    uint8_t * payload = publisher.reserve(cls, topic, length, retained);
+    if (!payload)
+    {
+      return false;
+    }
+
+    serializeMsgPack(json, payload, length);
+    return true;
+  }
+
+  size_t length = measureJson(json);
+  uint8_t * payload = publisher.reserve(cls, topic, length, retained);
+  if (!payload)
+  {
+    return false;
+  }
+
+  // reserve() leaves room for the null serializeJson() adds
+  serializeJson(json, (char *)payload, length + 1);
+  return true;
+}
+
+bool publishTelemetryJson(JsonVariant json)
+{
+  char topic[TOPIC_BUFFER_SIZE];
+  return queueJson(PUBLISH_CLASS_TELEMETRY, mqtt.getTelemetryTopic(topic), json, false, payloadEncoding == PAYLOAD_ENCODING_MSGPACK);
+}
+
+// Adoption info is too big for the publish queue, so it is serialized
+// straight into the MQTT connection (see publishQueue::beginDirect)
+bool publishAdoptJson(JsonVariant json)
+{
+  char topic[TOPIC_BUFFER_SIZE];
+  mqtt.getAdoptTopic(topic);
+
+  bool msgPack = payloadEncoding == PAYLOAD_ENCODING_MSGPACK;
+  if (msgPack)
+  {
+    strncat(topic, MSGPACK_TOPIC_SUFFIX, TOPIC_BUFFER_SIZE - strlen(topic) - 1);
+  }
+
+  size_t length = msgPack ? measureMsgPack(json) : measureJson(json);
+  Print * out = publisher.beginDirect(PUBLISH_CLASS_PRIORITY, topic, length, true);
+  if (!out)
+  {
+    return false;
+  }
+
+  if (msgPack)
+  {
+    serializeMsgPack(json, *out);
+  }
+  else
+  {
+    serializeJson(json, *out);
+  }
+
+  if (!publisher.endDirect())
+  {
+    return false;
+  }
+
+  logger.print(F("[AQS] adoption info published, "));
+  logger.print(length);
+  logger.println(F(" bytes"));
+  return true;
+}
+
+// Publish adoption info, retrying from loop() until it goes
+void publishAdopt()
+{
+  DynamicJsonDocument json(JSON_ADOPT_MAX_SIZE);
+
+  // No memory for the document is as much a failure as a failed publish
+  adoptPending = json.capacity() == 0 || !publishAdoptJson(api.getAdopt(json.as<JsonVariant>()));
+
+  if (adoptPending)
+  {
+    adoptRetryMs = millis() + ADOPT_RETRY_MS;
+    logger.println(F("[AQS] failed to publish adoption info, will retry"));
+  }
+}
+
+/*--------------------------- Telemetry -----------------*/
+// Read the I2C sensors alongside each PM frame so everything we publish
+// comes from the same moment
+void takeSample()
+{
+  StaticJsonDocument<256> json;
+  sensors.tele(json.as<JsonVariant>());
+
+  memset(&teleSample, 0, sizeof(teleSample));
+  teleSample.ms = deviceMs();
+
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    particleSensorState_t state = sensorState[i].read();
+
+    // The primary is always valid by the time we sample, the others may not be yet
+    if (state.valid)
+    {
+      teleSample.flags |= TELE_HAS_PM_SENSOR(i);
+      teleSample.pm25[i] = state.avgPM25;
+    }
+  }
+
+  if (json.containsKey("temperature"))
+  {
+    teleSample.flags |= TELE_HAS_TEMPERATURE;
+    teleSample.temperature = round(json["temperature"].as<float>() * 100.0f);
+  }
+
+  if (json.containsKey("humidity"))
+  {
+    teleSample.flags |= TELE_HAS_HUMIDITY;
+    teleSample.humidity = round(json["humidity"].as<float>() * 100.0f);
+  }
+
+  if (json.containsKey("lux"))
+  {
+    teleSample.flags |= TELE_HAS_LUX;
+    teleSample.lux = json["lux"].as<uint32_t>();
+  }
+
+  teleSampleValid = true;
+}
+
+bool publishReading(teleReading_t & reading, bool backlog)
+{
+  DynamicJsonDocument json(192 + (PM_SENSOR_COUNT > 1 ? JSON_ARRAY_SIZE(PM_SENSOR_COUNT) + PM_SENSOR_COUNT * JSON_OBJECT_SIZE(2) : 0));
+
+  // Primary sensor, as always
+  json["pm25"] = reading.pm25[0];
+
+  // Every sensor under its own index (1 = primary)
+  if (PM_SENSOR_COUNT > 1)
+  {
+    JsonArray list = json.createNestedArray("sensors");
+    for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+    {
+      if (i == 0 || (reading.flags & TELE_HAS_PM_SENSOR(i)))
       {
-        ledColour[colour++] = v.as<uint8_t>();
+        JsonObject sensor = list.createNestedObject();
+        sensor["index"] = i + 1;
+        sensor["pm25"] = reading.pm25[i];
       }
     }
+  }
+
+  if (reading.flags & TELE_HAS_TEMPERATURE)
+  {
+    json["temperature"] = reading.temperature / 100.0f;
+  }
+
+  if (reading.flags & TELE_HAS_HUMIDITY)
+  {
+    json["humidity"] = reading.humidity / 100.0f;
+  }
+
+  if (reading.flags & TELE_HAS_LUX)
+  {
+    json["lux"] = reading.lux;
+  }
+
+  // Queued readings say how old they are
+  if (backlog)
+  {
+    json["ageMs"] = deviceMs() - reading.ms;
+  }
+
+  return publishTelemetryJson(json.as<JsonVariant>());
+}
+
+// Returns true if published now, false if queued for later
+bool queueReading(teleReading_t & reading)
+{
+  // Keep readings in order, anything new waits behind the backlog
+  if (mqttClient.connected() && teleBacklog.depth() == 0)
+  {
+    if (publishReading(reading, false))
+    {
+      return true;
+    }
+  }
+
+  teleBacklog.push(reading);
+  return false;
+}
+
+// Publish (or with an empty value, clear) one retained metric subtopic,
+// e.g. tele/<id>/pm25
+bool publishRetainedMetric(const char * name, const char * value)
+{
+  char topic[TOPIC_BUFFER_SIZE];
+  mqtt.getTelemetryTopic(topic);
+  strncat(topic, "/", TOPIC_BUFFER_SIZE - strlen(topic) - 1);
+  strncat(topic, name, TOPIC_BUFFER_SIZE - strlen(topic) - 1);
+
+  return publisher.push(PUBLISH_CLASS_TELEMETRY, topic, (const uint8_t *)value, strlen(value), true);
+}
+
+// Subtopic of each PM sensor, the primary is pm25 like the combined
+// message and the rest are by index
+void pmMetricName(char * name, size_t size, uint8_t sensor)
+{
+  if (sensor == 0)
+  {
+    strncpy_P(name, PSTR("pm25"), size);
+  }
+  else
+  {
+    snprintf_P(name, size, PSTR("sensors/%u/pm25"), sensor + 1);
+  }
+}
+
+// Hundredths as a decimal, e.g. 2153 -> "21.53"
+void formatHundredths(char * buffer, size_t size, int32_t value)
+{
+  snprintf_P(buffer, size, PSTR("%s%ld.%02ld"), value < 0 ? "-" : "", labs(value) / 100, labs(value) % 100);
+}
+
+// Publish one metric if it is in the reading and has changed since it was
+// last published, true once it has been (so the caller keeps the value). A
+// metric which has dropped out of the reading has its subtopic cleared,
+// rather than leave the broker serving a stale value. Anything which can't
+// be queued is retried with the next reading.
+bool updateRetainedMetric(const char * name, uint16_t flag, bool changed, const char * value, const teleReading_t & reading)
+{
+  if (!(reading.flags & flag))
+  {
+    if ((teleRetainedFlags & flag) && publishRetainedMetric(name, ""))
+    {
+      teleRetainedFlags &= ~flag;
+    }
+    return false;
+  }
+
+  if (!changed && (teleRetainedFlags & flag))
+  {
+    return false;
+  }
+
+  if (!publishRetainedMetric(name, value))
+  {
+    return false;
+  }
+
+  teleRetainedFlags |= flag;
+  return true;
+}
+
+// Each metric of a live reading to its own retained subtopic, so new
+// subscribers get the current values straight away. Only changes are
+// published, so steady state costs no extra traffic.
+void publishRetainedMetrics(const teleReading_t & reading)
+{
+  if (!retainedMetrics || !mqttClient.connected())
+  {
+    return;
+  }
+
+  char name[24];
+  char value[16];
+
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    pmMetricName(name, sizeof(name), i);
+    utoa(reading.pm25[i], value, 10);
+    if (updateRetainedMetric(name, TELE_HAS_PM_SENSOR(i), reading.pm25[i] != teleRetained.pm25[i], value, reading))
+    {
+      teleRetained.pm25[i] = reading.pm25[i];
+    }
+  }
+
+  formatHundredths(value, sizeof(value), reading.temperature);
+  if (updateRetainedMetric("temperature", TELE_HAS_TEMPERATURE, reading.temperature != teleRetained.temperature, value, reading))
+  {
+    teleRetained.temperature = reading.temperature;
+  }
+
+  formatHundredths(value, sizeof(value), reading.humidity);
+  if (updateRetainedMetric("humidity", TELE_HAS_HUMIDITY, reading.humidity != teleRetained.humidity, value, reading))
+  {
+    teleRetained.humidity = reading.humidity;
+  }
+
+  ultoa(reading.lux, value, 10);
+  if (updateRetainedMetric("lux", TELE_HAS_LUX, reading.lux != teleRetained.lux, value, reading))
+  {
+    teleRetained.lux = reading.lux;
+  }
+}
+
+// Remove every retained metric subtopic we have published
+void clearRetainedMetrics()
+{
+  if (!mqttClient.connected())
+  {
+    return;
+  }
+
+  char name[24];
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    if (teleRetainedFlags & TELE_HAS_PM_SENSOR(i))
+    {
+      pmMetricName(name, sizeof(name), i);
+      publishRetainedMetric(name, "");
+    }
+  }
+
+  if (teleRetainedFlags & TELE_HAS_TEMPERATURE)
+  {
+    publishRetainedMetric("temperature", "");
+  }
+
+  if (teleRetainedFlags & TELE_HAS_HUMIDITY)
+  {
+    publishRetainedMetric("humidity", "");
+  }
+
+  if (teleRetainedFlags & TELE_HAS_LUX)
+  {
+    publishRetainedMetric("lux", "");
+  }
+
+  teleRetainedFlags = 0;
+}
+
+bool publishBacklogReading(teleReading_t & reading)
+{
+  return publishReading(reading, true);
+}
+
+// Drain the backlog in small rate-limited batches once MQTT is back
+void drainBacklog()
+{
+  if (teleBacklog.depth() == 0 || !mqttClient.connected())
+  {
+    return;
+  }
+
+  if ((int32_t)(millis() - teleDrainNotBefore) < 0 || (millis() - teleLastDrainMs) < TELE_DRAIN_INTERVAL_MS)
+  {
+    return;
+  }
+
+  if (teleDrainCount == 0)
+  {
+    teleDrainStartMs = millis();
+  }
+
+  teleDrainCount += teleBacklog.drain(TELE_DRAIN_BATCH_SIZE, publishBacklogReading);
+  teleLastDrainMs = millis();
+
+  if (teleBacklog.depth() == 0)
+  {
+    teleLastDrainDurationMs = millis() - teleDrainStartMs;
+
+    logger.print(F("[AQS] tele backlog of "));
+    logger.print(teleDrainCount);
+    logger.print(F(" readings drained in "));
+    logger.print(teleLastDrainDurationMs);
+    logger.println(F("ms"));
+
+    teleDrainCount = 0;
+  }
+}
+
+/*--------------------------- Metrics -----------------*/
+// One UART link counter for every sensor
+void uartCounter(Print & out, const __FlashStringHelper * name, const __FlashStringHelper * help, uint32_t uartStats_t::* field)
+{
+  metrics::counterHeader(out, name, help);
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    metrics::sample(out, name, F("sensor"), i + 1, pmSensors[i].stats.*field, true);
+  }
+}
+
+// GET /metrics - Prometheus text exposition, streamed a part at a time (see
+// httpPool.h) so it is never held whole. Each part has to fit in a slot's
+// buffer (HTTP_SLOT_BUFFER_SIZE), with 4 PM sensors the biggest is ~1.1KB,
+// and a family split over parts is still written out in one piece.
+void metricsPm(Print & out, uint8_t)
+{
+  // Unlabelled PM metrics are the primary sensor
+  particleSensorState_t state = sensorState[0].read();
+
+  out.print(F("HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n"));
+
+  metrics::gauge(out, F("aqs_pm25"), F("Latest PM 2.5 reading (ug/m3)"), (uint32_t)state.latest());
+  metrics::gauge(out, F("aqs_pm25_average"), F("Averaged PM 2.5 (ug/m3)"), (uint32_t)state.avgPM25);
+  metrics::gauge(out, F("aqs_pm25_average_valid"), F("1 once a full averaging window has been collected"), (uint32_t)state.valid);
+  metrics::gauge(out, F("aqs_pm25_window_index"), F("Position in the averaging window"), (uint32_t)state.measurementIdx);
+
+  if (teleSample.flags & TELE_HAS_TEMPERATURE)
+  {
+    metrics::gauge(out, F("aqs_temperature_celsius"), F("Temperature at the last PM frame"), teleSample.temperature / 100.0f);
+  }
+  if (teleSample.flags & TELE_HAS_HUMIDITY)
+  {
+    metrics::gauge(out, F("aqs_humidity_percent"), F("Humidity at the last PM frame"), teleSample.humidity / 100.0f);
+  }
+  if (teleSample.flags & TELE_HAS_LUX)
+  {
+    metrics::gauge(out, F("aqs_lux"), F("Light level at the last PM frame"), teleSample.lux);
+  }
+}
+
+// Every sensor, labelled by index (1 = primary)
+void metricsSensors(Print & out, uint8_t)
+{
+  if (PM_SENSOR_COUNT == 1)
+  {
+    return;
+  }
+
+  particleSensorState_t states[PM_SENSOR_COUNT];
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    states[i] = sensorState[i].read();
+  }
+
+  metrics::header(out, F("aqs_sensor_pm25_average"), F("gauge"), F("Averaged PM 2.5 per sensor (ug/m3)"));
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    metrics::sample(out, F("aqs_sensor_pm25_average"), F("sensor"), i + 1, states[i].avgPM25);
+  }
+
+  metrics::header(out, F("aqs_sensor_pm25_average_valid"), F("gauge"), F("1 once a sensor has a full averaging window"));
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    metrics::sample(out, F("aqs_sensor_pm25_average_valid"), F("sensor"), i + 1, states[i].valid);
+  }
+}
+
+// UART link quality, labelled by sensor index
+void metricsUartCounts(Print & out, uint8_t)
+{
+  uartCounter(out, F("aqs_uart_bytes"), F("Bytes received from the PM sensor"), &uartStats_t::bytes);
+  uartCounter(out, F("aqs_uart_frames"), F("PM sensor frames with a valid header and checksum"), &uartStats_t::framesAccepted);
+  uartCounter(out, F("aqs_uart_header_errors"), F("PM sensor frames with a bad header"), &uartStats_t::headerErrors);
+}
+
+void metricsUartErrors(Print & out, uint8_t)
+{
+  uartCounter(out, F("aqs_uart_checksum_errors"), F("PM sensor frames with a bad checksum"), &uartStats_t::checksumErrors);
+  uartCounter(out, F("aqs_uart_overflows"), F("PM sensor RX buffer overflows"), &uartStats_t::overflows);
+  uartCounter(out, F("aqs_uart_resyncs"), F("Times bytes were discarded to find a PM sensor frame header"), &uartStats_t::resyncs);
+}
+
+// One sensor's frame gap histogram, the family header goes with the first
+void metricsUartGaps(Print & out, uint8_t sensor)
+{
+  if (sensor == 0)
+  {
+    metrics::header(out, F("aqs_uart_frame_gap_ms"), F("histogram"), F("Time between PM sensor frames"));
+  }
+
+  const uartStats_t & stats = pmSensors[sensor].stats;
+  metrics::histogram(out, F("aqs_uart_frame_gap_ms"), F("sensor"), sensor + 1, UART_GAP_BUCKETS_MS, stats.gaps, UART_GAP_BUCKET_COUNT, stats.gapSumMs);
+}
+
+void metricsSystem(Print & out, uint8_t)
+{
+  metrics::gauge(out, F("aqs_loop_period_us"), F("Time between the last two loop() calls"), loopPeriodUs);
+  metrics::gauge(out, F("aqs_loop_period_max_us"), F("Longest time between loop() calls"), loopPeriodMaxUs);
+  metrics::counter(out, F("aqs_loop"), F("loop() calls"), loopCount);
+  metrics::counter(out, F("aqs_loop_stalls"), F("loop() stages which took longer than the stall threshold"), stalls.history.recorded);
+
+  metrics::gauge(out, F("aqs_heap_free_bytes"), F("Free heap"), ESP.getFreeHeap());
+  metrics::gauge(out, F("aqs_heap_max_block_bytes"), F("Largest free heap block"), (uint32_t)ESP.getMaxFreeBlockSize());
+  metrics::gauge(out, F("aqs_heap_fragmentation_percent"), F("Heap fragmentation"), (uint32_t)ESP.getHeapFragmentation());
+}
+
+// Per publish queue class
+const char * const PUBLISH_CLASSES[PUBLISH_CLASS_COUNT] = { "priority", "telemetry", "log" };
+
+void metricsPublish(Print & out, uint8_t)
+{
+  metrics::gauge(out, F("aqs_tele_backlog_depth"), F("Readings waiting to be published"), (uint32_t)teleBacklog.depth());
+  metrics::counter(out, F("aqs_tele_backlog_drops"), F("Readings dropped from a full backlog"), teleBacklog.drops);
+  metrics::gauge(out, F("aqs_tele_backlog_last_drain_ms"), F("Time taken to drain the last backlog after reconnecting"), teleLastDrainDurationMs);
+
+  metrics::gauge(out, F("aqs_publish_queue_depth"), F("Messages waiting to be published"), (uint32_t)publisher.depth());
+  metrics::gauge(out, F("aqs_publish_queue_bytes"), F("Bytes of messages waiting to be published"), (uint32_t)publisher.bytes());
+
+  metrics::counterHeader(out, F("aqs_publish"), F("Messages published"));
+  for (uint8_t i = 0; i < PUBLISH_CLASS_COUNT; i++)
+  {
+    metrics::sample(out, F("aqs_publish"), F("class"), PUBLISH_CLASSES[i], publisher.published[i], true);
+  }
+
+  metrics::counterHeader(out, F("aqs_publish_dropped"), F("Messages dropped from a full publish queue, or failed"));
+  for (uint8_t i = 0; i < PUBLISH_CLASS_COUNT; i++)
+  {
+    metrics::sample(out, F("aqs_publish_dropped"), F("class"), PUBLISH_CLASSES[i], publisher.drops[i], true);
+  }
+}
+
+void metricsLatency(Print & out, uint8_t)
+{
+  metrics::header(out, F("aqs_publish_latency_ms"), F("gauge"), F("Time the last message spent queued"));
+  for (uint8_t i = 0; i < PUBLISH_CLASS_COUNT; i++)
+  {
+    metrics::sample(out, F("aqs_publish_latency_ms"), F("class"), PUBLISH_CLASSES[i], publisher.lastLatencyMs[i]);
+  }
+
+  metrics::header(out, F("aqs_publish_latency_max_ms"), F("gauge"), F("Longest time a message has spent queued"));
+  for (uint8_t i = 0; i < PUBLISH_CLASS_COUNT; i++)
+  {
+    metrics::sample(out, F("aqs_publish_latency_max_ms"), F("class"), PUBLISH_CLASSES[i], publisher.maxLatencyMs[i]);
+  }
+
+  metrics::gauge(out, F("aqs_log_depth"), F("Log lines waiting to be published"), (uint32_t)logger.depth());
+  metrics::counter(out, F("aqs_log_lines_dropped"), F("Log lines dropped from a full log buffer"), logger.dropped);
+
+  metrics::gauge(out, F("aqs_events_subscribers"), F("Connected /events subscribers"), (uint32_t)events.subscribers());
+  metrics::counter(out, F("aqs_events_dropped"), F("Events not sent to a slow /events subscriber"), events.dropped);
+}
+
+void metricsHttp(Print & out, uint8_t)
+{
+  metrics::gauge(out, F("aqs_http_connections"), F("HTTP connection slots in use"), (uint32_t)http.active());
+  metrics::gauge(out, F("aqs_http_response_bytes"), F("Bytes of HTTP responses waiting to be written"), (uint32_t)http.bytes());
+  metrics::counter(out, F("aqs_http_requests"), F("HTTP requests served"), http.requests);
+  metrics::counter(out, F("aqs_http_rejected"), F("HTTP requests too large"), http.rejected);
+  metrics::counter(out, F("aqs_http_timeouts"), F("Idle, slow or stalled HTTP clients dropped"), http.timeouts);
+  metrics::counter(out, F("aqs_http_blocking_writes"), F("HTTP responses too big for a slot buffer, written waiting on the client"), http.blockingWrites);
+
+  metrics::gauge(out, F("aqs_uptime_ms"), F("Device clock (carries on across warm restarts)"), deviceMs());
+}
+
+// Parts in order, 'perSensor' parts once for every sensor
+struct metricsPart_t
+{
+  void (*write)(Print & out, uint8_t sensor);
+  bool perSensor;
+};
+
+const metricsPart_t METRICS_PARTS[] = {
+  { metricsPm, false },
+  { metricsSensors, false },
+  { metricsUartCounts, false },
+  { metricsUartErrors, false },
+  { metricsUartGaps, true },
+  { metricsSystem, false },
+  { metricsPublish, false },
+  { metricsLatency, false },
+  { metricsHttp, false },
+};
+
+bool writeMetrics(Print & out, uint16_t part)
+{
+  for (const metricsPart_t & entry : METRICS_PARTS)
+  {
+    uint8_t count = entry.perSensor ? PM_SENSOR_COUNT : 1;
+    if (part < count)
+    {
+      entry.write(out, part);
+      return true;
+    }
+
+    part -= count;
+  }
+
+  return false;
+}
+
+/*--------------------------- Diagnostics -----------------*/
+#define DIAGNOSTICS_JSON_SIZE       (JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(UART_GAP_BUCKET_COUNT) + JSON_ARRAY_SIZE(PM_SENSOR_COUNT) + PM_SENSOR_COUNT * (JSON_OBJECT_SIZE(8) + JSON_ARRAY_SIZE(UART_GAP_BUCKET_COUNT)))
+
+// UART link quality for every sensor, the gap histogram counts frames by
+// the time since the previous frame, up to each of gapBucketsMs (and one
+// more bucket for anything longer)
+void getDiagnostics(JsonVariant json)
+{
+  json["type"] = "diagnostics";
+
+  JsonArray bounds = json.createNestedArray("gapBucketsMs");
+  for (uint8_t b = 0; b < UART_GAP_BUCKET_COUNT - 1; b++)
+  {
+    bounds.add(UART_GAP_BUCKETS_MS[b]);
+  }
+
+  JsonArray uart = json.createNestedArray("uart");
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    const uartStats_t & stats = pmSensors[i].stats;
+
+    JsonObject sensor = uart.createNestedObject();
+    sensor["index"] = i + 1;
+    sensor["bytes"] = stats.bytes;
+    sensor["framesAccepted"] = stats.framesAccepted;
+    sensor["headerErrors"] = stats.headerErrors;
+    sensor["checksumErrors"] = stats.checksumErrors;
+    sensor["overflows"] = stats.overflows;
+    sensor["resyncs"] = stats.resyncs;
+
+    JsonArray gaps = sensor.createNestedArray("gaps");
+    for (uint8_t b = 0; b < UART_GAP_BUCKET_COUNT; b++)
+    {
+      gaps.add(stats.gaps[b]);
+    }
+  }
+}
+
+// Published as a status event every DIAGNOSTICS_INTERVAL_MS
+void publishDiagnostics()
+{
+  DynamicJsonDocument json(DIAGNOSTICS_JSON_SIZE);
+  getDiagnostics(json.as<JsonVariant>());
+
+  char topic[TOPIC_BUFFER_SIZE];
+  queueJson(PUBLISH_CLASS_TELEMETRY, mqtt.getStatusTopic(topic), json.as<JsonVariant>(), false, false);
+}
+
+// GET /diagnostics, streamed as a single part (about 1KB with 4 PM sensors)
+bool writeDiagnostics(Print & out, uint16_t part)
+{
+  if (part > 0)
+  {
+    return false;
+  }
+
+  DynamicJsonDocument json(DIAGNOSTICS_JSON_SIZE);
+  getDiagnostics(json.as<JsonVariant>());
+
+  out.print(F("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n"));
+  serializeJson(json, out);
+  return true;
+}
+
+/*--------------------------- Events -----------------*/
+// Push each decoded frame, and each new average, to /events subscribers
+void publishFrameEvents(uint8_t sensor, particleSensorState_t & state)
+{
+  if (events.subscribers() == 0)
+  {
+    return;
+  }
+
+  char data[48];
+
+  snprintf_P(data, sizeof(data), PSTR("{\"sensor\":%u,\"pm25\":%u}"), sensor + 1, state.latest());
+  events.publish(F("frame"), data);
+
+  // A new average is calculated each time the window wraps
+  if (state.valid && state.measurementIdx == 0)
+  {
+    snprintf_P(data, sizeof(data), PSTR("{\"sensor\":%u,\"avgPM25\":%u}"), sensor + 1, state.avgPM25);
+    events.publish(F("average"), data);
+  }
+}
+
+/*--------------------------- Alerts -----------------*/
+// Published as soon as a frame trips (or clears) a rule
+void alertEvent(uint8_t index, bool triggered, uint16_t pm25, int32_t ratePerMinute)
+{
+  StaticJsonDocument<128> json;
+  json["index"] = index + 1;
+  json["type"] = "alert";
+  json["event"] = triggered ? "triggered" : "cleared";
+  json["pm25"] = pm25;
+  json["ratePerMinute"] = ratePerMinute;
+
+  char topic[TOPIC_BUFFER_SIZE];
+  queueJson(PUBLISH_CLASS_PRIORITY, mqtt.getStatusTopic(topic), json.as<JsonVariant>(), false, false);
+}
+
+/*--------------------------- Command acks -----------------*/
+void publishCommandAck()
+{
+  StaticJsonDocument<192> json;
+  json["type"] = "ack";
+  json["correlationId"] = commandAck.correlationId;
+  json["receivedMs"] = commandAck.receivedMs;
+
+  if (commandAck.awaitingRestart)
+  {
+    // Device clock carries on across the restart
+    json["restartMs"] = deviceMs() - commandAck.receivedMs;
+  }
+  else
+  {
+    json["applyUs"] = commandAck.applyUs;
+    if (commandAck.showUs)
+    {
+      json["showUs"] = commandAck.showUs;
+    }
+  }
+
+  char topic[TOPIC_BUFFER_SIZE];
+  queueJson(PUBLISH_CLASS_PRIORITY, mqtt.getStatusTopic(topic), json.as<JsonVariant>(), false, false);
+
+  commandAck.correlationId[0] = 0;
+  commandAck.awaitingShow = false;
+  commandAck.awaitingRestart = false;
+}
+
+// Called once a command with a correlationId has been applied, the ack goes
+// now or after the first LED frame with the change (or the restart)
+void startCommandAck()
+{
+  // Only one ack in flight, anything still waiting goes without its show time
+  if (commandAck.awaitingShow)
+  {
+    publishCommandAck();
+  }
+
+  memcpy(commandAck.correlationId, commandCorrelationId, sizeof(commandAck.correlationId));
+  commandAck.receivedMs = commandReceivedMs;
+  commandAck.receivedUs = commandReceivedUs;
+  commandAck.applyUs = micros() - commandReceivedUs;
+  commandAck.showUs = 0;
+
+  if (restartPending)
+  {
+    commandAck.awaitingRestart = true;
+    return;
+  }
+
+  #if defined(LED_RGBW) || defined(LED_RGB)
+  if (commandChangedLeds)
+  {
+    commandAck.showCount = pixelDriver.showCount();
+    commandAck.awaitingShow = true;
+    return;
+  }
+  #endif
+
+  publishCommandAck();
+}
+
+/*--------------------------- Stall watchdog -----------------*/
+// Names of the rst_info reset reasons
+const char * const RESET_REASONS[] = { "power on", "hardware watchdog", "exception", "software watchdog", "restart", "deep sleep", "external" };
+
+static_assert(RTC_STALL_STAGE_OFFSET * 4 + sizeof(stallStage_t) <= RTC_USER_MEMORY_SIZE, "stall log doesn't fit in RTC memory");
+
+// Every change goes straight to RTC memory, we may be about to be reset
+void saveStallLog(const stallLog_t & history)
+{
+  ESP.rtcUserMemoryWrite(RTC_STALL_LOG_OFFSET, (uint32_t *)&history, sizeof(history));
+}
+
+// The running stage, written as each starts, for after a watchdog reset
+void saveStallStage(const stallStage_t & stage)
+{
+  ESP.rtcUserMemoryWrite(RTC_STALL_STAGE_OFFSET, (uint32_t *)&stage, sizeof(stage));
+}
+
+// Stall records are time stamped with the device clock
+uint32_t stallClock()
+{
+  return deviceMs();
+}
+
+void checkStalls()
+{
+  stalls.check();
+}
+
+// Once the device clock has been restored, pick up any stalls recorded
+// before a warm restart (including the one we may have been reset in)
+void initialiseStallWatchdog()
+{
+  // Read before begin() overwrites the saved stage
+  stallLog_t saved = {};
+  stallStage_t stage = {};
+  bool warm = fastBoot::isWarmBoot() &&
+    ESP.rtcUserMemoryRead(RTC_STALL_LOG_OFFSET, (uint32_t *)&saved, sizeof(saved)) &&
+    ESP.rtcUserMemoryRead(RTC_STALL_STAGE_OFFSET, (uint32_t *)&stage, sizeof(stage));
+
+  stalls.thresholdMs = stallThresholdMs;
+  stalls.begin(stallClock, saveStallLog, saveStallStage);
+
+  if (warm)
+  {
+    stalls.restore(saved, stage, ESP.getResetInfoPtr()->reason);
+  }
+
+  stallTicker.attach_ms(STALL_CHECK_INTERVAL_MS, checkStalls);
+}
+
+// Each stall not yet published as a status event
+void publishStalls()
+{
+  while (stalls.pending())
+  {
+    const stallRecord_t & record = stalls.next();
+
+    StaticJsonDocument<192> json;
+    json["type"] = "stall";
+    json["stage"] = STALL_STAGE_NAMES[record.stage];
+    json["startMs"] = record.startMs;
+    json["durationMs"] = record.durationMs;
+
+    // We never came back from this one
+    if ((record.flags & STALL_FLAG_RESET) && record.resetReason < FIELD_COUNT(RESET_REASONS))
+    {
+      json["reset"] = RESET_REASONS[record.resetReason];
+    }
+
+    char topic[TOPIC_BUFFER_SIZE];
+    if (!queueJson(PUBLISH_CLASS_TELEMETRY, mqtt.getStatusTopic(topic), json.as<JsonVariant>(), false, false))
+    {
+      return;
+    }
+
+    stalls.published();
+  }
+}
+
+/*--------------------------- MQTT/API -----------------*/
+void mqttConnected() 
+{
+  char logTopic[TOPIC_BUFFER_SIZE];
+  logger.setTopic(mqtt.getLogTopic(logTopic));
+
+  // Publish device adoption info
+  publishAdopt();
+
+  #if defined(LED_RGBW) || defined(LED_RGB)
+  // Subscribe to the raw binary LED frame topic
+  mqtt.getCommandTopic(ledFrameTopic);
+  strncat(ledFrameTopic, LED_FRAME_TOPIC_SUFFIX, sizeof(ledFrameTopic) - strlen(ledFrameTopic) - 1);
+  mqttClient.subscribe(ledFrameTopic);
+  #endif
+
+  // Don't drain any backlog straight away, so a fleet reconnecting
+  // together doesn't all hit the broker at the same moment
+  teleDrainNotBefore = millis() + random(TELE_DRAIN_JITTER_MS);
+
+  // The broker may not have kept our retained metrics, publish them all again
+  teleRetainedFlags = 0;
+
+  // Ack any restart command now we are back
+  if (commandAck.awaitingRestart)
+  {
+    publishCommandAck();
+  }
+
+  // Report any stalls, including one we were reset in
+  publishStalls();
+
+  // Log the fact we are now connected
+  logger.println("[AQS] mqtt connected");
+  // turn first LED green to show mqtt connected and device ready
+  #if defined(LED_RGBW) 
+  pixelDriver.colour(0, 20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  #elif defined(LED_RGB)
+  pixelDriver.colour(0, 20, 0, 0, 0, 0, 0, 0, 0);
+  #endif
+}
+
+void mqttDisconnected(int state) 
+{
+  // turn first LED orange for disconnected mqtt
+  #if defined(LED_RGBW)
+  pixelDriver.colour(15, 5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  #elif defined(LED_RGB)
+  pixelDriver.colour(15, 5, 0, 0, 0, 0, 0, 0, 0);
+  #endif
+  // Log the disconnect reason
+  // See https://github.com/knolleary/pubsubclient/blob/2d228f2f862a95846c65a8518c79f48dfc8f188c/src/PubSubClient.h#L44
+  switch (state)
+  {
+    case MQTT_CONNECTION_TIMEOUT:
+      logger.println(F("[AQS] mqtt connection timeout"));
+      break;
+    case MQTT_CONNECTION_LOST:
+      logger.println(F("[AQS] mqtt connection lost"));
+      break;
+    case MQTT_CONNECT_FAILED:
+      logger.println(F("[AQS] mqtt connect failed"));
+      break;
+    case MQTT_DISCONNECTED:
+      logger.println(F("[AQS] mqtt disconnected"));
+      break;
+    case MQTT_CONNECT_BAD_PROTOCOL:
+      logger.println(F("[AQS] mqtt bad protocol"));
+      break;
+    case MQTT_CONNECT_BAD_CLIENT_ID:
+      logger.println(F("[AQS] mqtt bad client id"));
+      break;
+    case MQTT_CONNECT_UNAVAILABLE:
+      logger.println(F("[AQS] mqtt unavailable"));
+      break;
+    case MQTT_CONNECT_BAD_CREDENTIALS:
+      logger.println(F("[AQS] mqtt bad credentials"));
+      break;      
+    case MQTT_CONNECT_UNAUTHORIZED:
+      logger.println(F("[AQS] mqtt unauthorised"));
+      break;      
+  }
+}
+
+void ledFrameCommand(uint8_t * payload, unsigned int length)
+{
+  #if defined(LED_RGBW) || defined(LED_RGB)
+  if (!ledFrame::apply(payload, length, ledColour, LED_PIXEL_COUNT, LED_CHANNEL_COUNT))
+  {
+    logger.println(F("[AQS] invalid led frame"));
+    return;
+  }
+
+  // Frames are shown immediately, no fading
+  ledMode = LED_MODE_MANUAL;
+  ledState = LED_STATE_ON;
+  ledShow(ledColour);
+  #endif
+}
+
+void mqttCallback(char * topic, uint8_t * payload, unsigned int length) 
+{
+  // Raw binary LED frames bypass the JSON command handler
+  if (ledFrameTopic[0] && strcmp(topic, ledFrameTopic) == 0)
+  {
+    ledFrameCommand(payload, length);
+    return;
+  }
+
+  // Start of any command's latency (see commandAck_t)
+  commandReceivedMs = deviceMs();
+  commandReceivedUs = micros();
+
+  // Pass this message down to our MQTT handler
+  mqtt.receive(topic, payload, length);
+}
+
+/*--------------------------- Config/command fields -----------------*/
+// Every config and command field is defined once, in the tables below,
+// which generate both the schemas in the adoption payload and the parsers
+// (see fields.h). Enum values are in the order of their #defines.
+const char * const PAYLOAD_ENCODINGS[] = { "json", "msgpack" };
+
+void setUpdateSeconds(JsonVariant, int32_t number, uint8_t)
+{
+  updateMs = number * 1000L;
+}
+
+void setPayloadEncoding(JsonVariant, int32_t number, uint8_t)
+{
+  payloadEncoding = number;
+}
+
+void setStallThreshold(JsonVariant, int32_t number, uint8_t)
+{
+  stallThresholdMs = number;
+  stalls.thresholdMs = stallThresholdMs;
+}
+
+void setRetainedMetrics(JsonVariant, int32_t number, uint8_t)
+{
+  // Don't leave stale values behind for new subscribers
+  if (retainedMetrics && !number)
+  {
+    clearRetainedMetrics();
+  }
+
+  retainedMetrics = number;
+}
+
+// Alert rules are built up one item at a time
+alertRule_t alertRule;
+
+void clearAlerts(JsonVariant, int32_t, uint8_t)
+{
+  pmAlerts.clear();
+}
+
+bool beginAlert()
+{
+  memset(&alertRule, 0, sizeof(alertRule));
+  return true;
+}
+
+void endAlert()
+{
+  if (!pmAlerts.add(alertRule))
+  {
+    logger.println(F("[AQS] too many alerts, ignoring the rest"));
+  }
+}
+
+void setAlertThreshold(JsonVariant, int32_t number, uint8_t)
+{
+  alertRule.threshold = number;
+}
+
+void setAlertRiseRate(JsonVariant, int32_t number, uint8_t)
+{
+  alertRule.riseRatePerMinute = number;
+}
+
+void setAlertHysteresis(JsonVariant, int32_t number, uint8_t)
+{
+  alertRule.hysteresis = number;
+}
+
+void setAlertRateHysteresis(JsonVariant, int32_t number, uint8_t)
+{
+  alertRule.rateHysteresis = number;
+}
+
+void setAlertCooldown(JsonVariant, int32_t number, uint8_t)
+{
+  alertRule.cooldownMs = number * 1000UL;
+}
+
+const fields::field_t alertFields[] = {
+  fields::integer("threshold", 0, 1000, setAlertThreshold),
+  fields::integer("riseRatePerMinute", 0, 1000, setAlertRiseRate),
+  fields::integer("hysteresis", 0, 1000, setAlertHysteresis),
+  fields::integer("rateHysteresis", 0, 1000, setAlertRateHysteresis),
+  fields::integer("cooldownSeconds", 0, 86400, setAlertCooldown),
+};
+const fields::table_t alertTable = { alertFields, FIELD_COUNT(alertFields), beginAlert, endAlert };
+
+#if defined(LED_RGBW) || defined(LED_RGB)
+const char * const LED_MODES[] = { "auto", "manual", "animation" };
+const char * const LED_STATES[] = { "off", "on" };
+const char * const BUILTIN_ANIMATIONS[] = { "breathe", "pulse", "chase" };
+const char * const EASINGS[] = { "linear", "in", "out", "inOut", "step" };
+
+// Shared by the ledMode config and LED mode command
+void setLedMode(JsonVariant, int32_t number, uint8_t)
+{
+  ledMode = number;
+  if (ledMode == LED_MODE_ANIMATION)
+  {
+    ledAnimationPending = true;
+  }
+}
+
+void setAutoFadeInterval(JsonVariant, int32_t number, uint8_t)
+{
+  g_auto_fade_interval_us = number;
+}
+
+void setAutoBrightness(JsonVariant, int32_t number, uint8_t)
+{
+  g_auto_brightness = number;
+}
+
+void setDefaultFadeInterval(JsonVariant, int32_t number, uint8_t)
+{
+  g_fade_interval_us = number;
+  fadeIntervalUs = g_fade_interval_us;
+}
+
+// LED commands fade at the default rate unless they say otherwise
+bool beginLedCommand()
+{
+  fadeIntervalUs = g_fade_interval_us;
+  commandChangedLeds = true;
+  return true;
+}
+
+void setLedState(JsonVariant, int32_t number, uint8_t)
+{
+  ledState = number;
+}
+
+void setPixelColour(JsonVariant value, int32_t, uint8_t pixel)
+{
+  uint8_t channel = 0;
+  for (JsonVariant v : value.as<JsonArray>())
+  {
+    ledColour[(pixel * LED_CHANNEL_COUNT) + channel++] = v.as<uint8_t>();
+  }
+}
+
+void setFadeInterval(JsonVariant, int32_t number, uint8_t)
+{
+  fadeIntervalUs = number;
+}
+
+const fields::field_t ledFields[] = {
+  fields::enumeration("mode", LED_MODES, FIELD_COUNT(LED_MODES), setLedMode, nullptr, nullptr, true),
+  fields::enumeration("state", LED_STATES, FIELD_COUNT(LED_STATES), setLedState),
+  fields::colour("pixel1", LED_CHANNEL_COUNT, setPixelColour, 0),
+  fields::colour("pixel2", LED_CHANNEL_COUNT, setPixelColour, 1),
+  fields::colour("pixel3", LED_CHANNEL_COUNT, setPixelColour, 2),
+  fields::integer("fadeIntervalUs", 0, FIELD_NO_MAXIMUM, setFadeInterval),
+};
+const fields::table_t ledTable = { ledFields, FIELD_COUNT(ledFields), beginLedCommand, nullptr };
+
+// Animation uploads are staged and only applied once the whole object is parsed
+animation stagedAnimation;
+int8_t stagedBuiltin;
+uint8_t stagedColour[4];
+bool stagedKeyframes;
+int16_t stagedLoops;
+int32_t stagedPmThreshold;
+
+bool beginAnimation()
+{
+  memset(&stagedAnimation, 0, sizeof(stagedAnimation));
+  stagedBuiltin = -1;
+  stagedColour[0] = 0;
+  stagedColour[1] = 0;
+  stagedColour[2] = g_auto_brightness;
+  stagedColour[3] = 0;
+  stagedKeyframes = false;
+  stagedLoops = -1;
+  stagedPmThreshold = -1;
+  return true;
+}
+
+void endAnimation()
+{
+  // A builtin wins over keyframes
+  if (stagedBuiltin >= 0)
+  {
+    builtinAnimation(BUILTIN_ANIMATIONS[stagedBuiltin], stagedColour);
+  }
+  else if (stagedKeyframes)
+  {
+    memcpy(&ledAnimation, &stagedAnimation, sizeof(ledAnimation));
+  }
+  else
+  {
+    logger.println(F("[AQS] animation needs a builtin or keyframes"));
+    return;
+  }
+
+  if (stagedLoops >= 0)
+  {
+    ledAnimation.loops = stagedLoops;
+  }
+
+  if (stagedPmThreshold >= 0)
+  {
+    ledAnimation.pmThreshold = stagedPmThreshold;
+  }
+
+  // Upload once, play locally - keep it across restarts
+  saveAnimation();
+  ledAnimationPending = true;
+  commandChangedLeds = true;
+}
+
+void setBuiltin(JsonVariant, int32_t number, uint8_t)
+{
+  stagedBuiltin = number;
+}
+
+void setBuiltinColour(JsonVariant value, int32_t, uint8_t)
+{
+  uint8_t channel = 0;
+  for (JsonVariant v : value.as<JsonArray>())
+  {
+    stagedColour[channel++] = v.as<uint8_t>();
+  }
+}
+
+void setKeyframes(JsonVariant, int32_t, uint8_t)
+{
+  stagedKeyframes = true;
+}
+
+bool beginKeyframe()
+{
+  if (stagedAnimation.keyframeCount >= ANIM_MAX_KEYFRAMES)
+  {
+    logger.println(F("[AQS] too many keyframes, ignoring the rest"));
+    return false;
+  }
+
+  return true;
+}
+
+void endKeyframe()
+{
+  stagedAnimation.keyframeCount++;
+}
+
+void setKeyframeColour(JsonVariant value, int32_t, uint8_t pixel)
+{
+  animKeyframe & keyframe = stagedAnimation.keyframes[stagedAnimation.keyframeCount];
+
+  uint8_t channel = 0;
+  for (JsonVariant v : value.as<JsonArray>())
+  {
+    keyframe.colour[(pixel * 4) + channel++] = v.as<uint8_t>();
+  }
+}
+
+void setKeyframeDuration(JsonVariant, int32_t number, uint8_t)
+{
+  stagedAnimation.keyframes[stagedAnimation.keyframeCount].durationMs = number;
+}
+
+void setKeyframeEasing(JsonVariant, int32_t number, uint8_t)
+{
+  stagedAnimation.keyframes[stagedAnimation.keyframeCount].easing = number;
+}
+
+void setLoops(JsonVariant, int32_t number, uint8_t)
+{
+  stagedLoops = number;
+}
+
+void setPmThreshold(JsonVariant, int32_t number, uint8_t)
+{
+  stagedPmThreshold = number;
+}
 
-    if (json.containsKey("pixel2"))
-    {
-      JsonArray array = json["pixel2"].as<JsonArray>();
-      #if defined(LED_RGBW)
-      uint8_t colour = 4;
-      #elif defined(LED_RGB)
-      uint8_t colour = 3;
-      #endif
+const fields::field_t keyframeFields[] = {
+  fields::colour("pixel1", 4, setKeyframeColour, 0),
+  fields::colour("pixel2", 4, setKeyframeColour, 1),
+  fields::colour("pixel3", 4, setKeyframeColour, 2),
+  fields::integer("durationMs", 0, 65535, setKeyframeDuration),
+  fields::enumeration("easing", EASINGS, FIELD_COUNT(EASINGS), setKeyframeEasing),
+};
+const fields::table_t keyframeTable = { keyframeFields, FIELD_COUNT(keyframeFields), beginKeyframe, endKeyframe };
+
+const fields::field_t animationFields[] = {
+  fields::enumeration("builtin", BUILTIN_ANIMATIONS, FIELD_COUNT(BUILTIN_ANIMATIONS), setBuiltin),
+  fields::colour("colour", 4, setBuiltinColour),
+  fields::objectArray("keyframes", ANIM_MAX_KEYFRAMES, &keyframeTable, setKeyframes),
+  fields::integer("loops", 0, 255, setLoops, nullptr, "Number of times to play the animation (defaults to 0, loop forever)"),
+  fields::integer("pmThreshold", 0, 65535, setPmThreshold, nullptr, "Only play while PM 2.5 is at or above this, otherwise behave like auto mode (defaults to 0, always play)"),
+};
+const fields::table_t animationTable = { animationFields, FIELD_COUNT(animationFields), beginAnimation, endAnimation };
+#endif
 
-      for (JsonVariant v : array)
-      {
-        ledColour[colour++] = v.as<uint8_t>();
-      }
-    }
+// Restarts once the rest of the command has been handled
+void restartCommand(JsonVariant, int32_t number, uint8_t)
+{
+  restartPending = number;
+}
 
-    if (json.containsKey("pixel3"))
-    {
-      JsonArray array = json["pixel3"].as<JsonArray>();
-      #if defined(LED_RGBW)
-      uint8_t colour = 8;
-      #elif defined(LED_RGB)
-      uint8_t colour = 6;
-      #endif
+void setCorrelationId(JsonVariant value, int32_t, uint8_t)
+{
+  strcpy(commandCorrelationId, value.as<const char *>());
+}
 
-      for (JsonVariant v : array)
-      {
-        ledColour[colour++] = v.as<uint8_t>();
-      }
+const fields::field_t configFields[] = {
+  fields::integer("ikeaSensorUpdateSeconds", 0, 86400, setUpdateSeconds,
+    "IKEA Sensor Update Interval (seconds)",
+    "How often to read and report the values from the IKEA sensor  (defaults to 60 seconds, setting to 0 disables sensor reports). Must be a number between 0 and 86400 (i.e. 1 day)."),
+  fields::enumeration("payloadEncoding", PAYLOAD_ENCODINGS, FIELD_COUNT(PAYLOAD_ENCODINGS), setPayloadEncoding,
+    "Payload Encoding",
+    "Encoding for telemetry and adoption payloads (defaults to json). MessagePack payloads are published to the usual topic with a '/msgpack' suffix."),
+  fields::integer("stallThresholdMs", 0, 60000, setStallThreshold,
+    "Stall Threshold (ms)",
+    "Any part of the main loop (network, mqtt, api, leds, uart, telemetry or the system between loops) which takes longer than this is published as a 'stall' status event, even if the device was reset by the watchdog during it (defaults to 1000ms, 0 disables)."),
+  fields::flag("retainedMetrics", setRetainedMetrics,
+    "Retained Metrics",
+    "Also publish each reading to its own retained subtopic of the telemetry topic (e.g. 'pm25', 'temperature'), only when it changes, so new subscribers get the current values straight away (defaults to false)."),
+  #if defined(LED_RGBW) || defined(LED_RGB)
+  fields::enumeration("ledMode", LED_MODES, FIELD_COUNT(LED_MODES), setLedMode, nullptr,
+    "What mode led's should function in on startup (defaults to auto)"),
+  fields::integer("autoFadeIntervalUs", 0, FIELD_NO_MAXIMUM, setAutoFadeInterval, nullptr,
+    "Controls color fading in Auto mode, in microseconds (defaults to 20000us)"),
+  fields::integer("autoBrightness", 0, 255, setAutoBrightness, nullptr,
+    "Controls overall brightness of leds in auto mode (0-255 possible) (defaults to 50)"),
+  fields::integer("fadeIntervalUs", 0, FIELD_NO_MAXIMUM, setDefaultFadeInterval, nullptr,
+    "Default time to fade from off -> on (and vice versa), in microseconds (defaults to 20000us)"),
+  #endif
+  fields::objectArray("alerts", ALERT_MAX_RULES, &alertTable, clearAlerts,
+    "PM 2.5 Alerts",
+    "Rules checked on every sensor frame, publishing an event straight away when PM 2.5 reaches a threshold or rises faster than a rate (set either to 0 to ignore it). The rate is smoothed over about 15 seconds. Alerts clear once PM is 'hysteresis' below the threshold and the rate is 'rateHysteresis' below its limit."),
+};
+const fields::table_t configTable = { configFields, FIELD_COUNT(configFields), nullptr, nullptr };
+
+const fields::field_t commandFields[] = {
+  #if defined(LED_RGBW) || defined(LED_RGB)
+  fields::objectArray("LED", 0, &ledTable, nullptr, nullptr,
+    "Set the operation of Neopixels - auto will have the leds act like the one ikea had built in show green, yellow, red. Manaul gives you full control over each led along with fade speed and state of on / off"),
+  fields::object("animation", &animationTable, nullptr, nullptr,
+    "Upload an animation, stored on the device and played when the LEDs are in animation mode. Either pick a built-in (optionally with a colour) or supply up to 8 keyframes"),
+  #endif
+  fields::flag("restart", restartCommand),
+  fields::string("correlationId", CORRELATION_ID_SIZE - 1, setCorrelationId, nullptr,
+    "Optional id for this command, echoed back in an ack status event with the time taken to apply it (and show it on the LEDs, or to come back after a restart)"),
+};
+const fields::table_t commandTable = { commandFields, FIELD_COUNT(commandFields), nullptr, nullptr };
+
+void setSchemaMetadata(JsonObject schema)
+{
+  schema["$schema"] = JSON_SCHEMA_VERSION;
+  schema["title"] = FW_SHORT_NAME;
+  schema["type"] = "object";
+}
+
+void setSensorConfigSchema(JsonObject properties)
+{
+  sensors.setConfigSchema(properties);
+}
+
+void setSensorCommandSchema(JsonObject properties)
+{
+  sensors.setCommandSchema(properties);
+}
+
+void getConfigSchemaJson(JsonVariant json)
+{
+  JsonObject configSchema = json.createNestedObject("configSchema");
+  
+  // Config schema metadata
+  setSchemaMetadata(configSchema);
+
+  JsonObject properties = configSchema.createNestedObject("properties");
+  fields::schema(properties, configTable);
+
+  // Add any sensor config
+  setSensorConfigSchema(properties);
+}
+
+void getCommandSchemaJson(JsonVariant json)
+{
+  JsonObject commandSchema = json.createNestedObject("commandSchema");
+  
+  // Command schema metadata
+  setSchemaMetadata(commandSchema);
+
+  JsonObject properties = commandSchema.createNestedObject("properties");
+  fields::schema(properties, commandTable);
+
+  // Add any sensor commands
+  setSensorCommandSchema(properties);
+}
+
+void apiAdopt(JsonVariant json)
+{
+  // Build device adoption info
+  getFirmwareJson(json);
+  getSystemJson(json);
+  getNetworkJson(json);
+  getConfigSchemaJson(json);
+  getCommandSchemaJson(json);
+}
+
+void mqttConfig(JsonVariant json)
+{
+  fields::dispatch(json.as<JsonObject>(), configTable, logger);
+
+  // Let the sensors handle any config
+  sensors.conf(json);
+
+  // Snapshot the applied config so we can restore it on the next boot
+  configSnapshot_t config;
+  snapshotConfig(config);
+  fastBoot::writeConfig(EEPROM_CONFIG_OFFSET, config);
+}
+
+void mqttCommand(JsonVariant json)
+{
+  commandCorrelationId[0] = 0;
+  commandChangedLeds = false;
+  restartPending = false;
+
+  fields::dispatch(json.as<JsonObject>(), commandTable, logger);
+
+  // Let the sensors handle any commands
+  sensors.cmnd(json);
+
+  if (commandCorrelationId[0])
+  {
+    startCommandAck();
+  }
+
+  if (restartPending)
+  {
+    saveFastBootState();
+    teleBacklog.persist();
+    stalls.exit();
+    ESP.restart();
+  }
+}
+
+/*--------------------------- REST -----------------*/
+// GET /adopt is built a part at a time in a document of this size, the
+// largest part (the animation command's schema) is about 1.2KB serialized
+#define ADOPT_PART_JSON_SIZE        2048
+
+typedef void (*jsonBuilder_t)(JsonVariant json);
+typedef void (*schemaBuilder_t)(JsonObject properties);
+
+// The adoption info members ahead of the schemas, as apiAdopt() adds them
+const jsonBuilder_t ADOPT_MEMBERS[] = {
+  getFirmwareJson,
+  getSystemJson,
+  getNetworkJson,
+};
+
+// Members of an object without its braces, a comma ahead of each unless
+// it is the first
+void writeJsonMembers(Print & out, JsonObject object, bool first)
+{
+  for (JsonPair member : object)
+  {
+    if (!first)
+    {
+      out.print(',');
     }
+    first = false;
+
+    out.print('"');
+    out.print(member.key().c_str());
+    out.print(F("\":"));
+    serializeJson(member.value(), out);
+  }
+}
 
-  if (json.containsKey("fadeIntervalUs"))
+// Part 'part' of the config or command schema in GET /adopt, its metadata
+// then a property per field then any sensor properties, false past the end
+bool writeSchemaPart(Print & out, JsonDocument & json, uint16_t part, const __FlashStringHelper * name, const fields::table_t & table, schemaBuilder_t sensorSchema)
+{
+  JsonObject object = json.to<JsonObject>();
+
+  if (part == 0)
   {
-    fadeIntervalUs = json["fadeIntervalUs"].as<uint32_t>();
+    out.print(F(",\""));
+    out.print(name);
+    out.print(F("\":{"));
+
+    setSchemaMetadata(object);
+    writeJsonMembers(out, object, true);
+    out.print(F(",\"properties\":{"));
+    return true;
   }
-  else
+
+  if (part <= table.count)
   {
-    fadeIntervalUs = g_fade_interval_us;
+    fields::schema(object, table, part - 1);
+    writeJsonMembers(out, object, part == 1);
+    return true;
   }
-  #endif
+
+  if (part == table.count + 1)
+  {
+    sensorSchema(object);
+    writeJsonMembers(out, object, table.count == 0);
+    out.print(F("}}"));
+    return true;
+  }
+
+  return false;
 }
 
-void mqttCommand(JsonVariant json)
+// GET /adopt, the same adoption info as the REST API serves but streamed a
+// member (or a schema property) at a time, rather than built whole in a
+// JSON_ADOPT_MAX_SIZE document and written out waiting on the client
+bool writeAdopt(Print & out, uint16_t part)
 {
-  if (json.containsKey("LED"))
+  DynamicJsonDocument json(ADOPT_PART_JSON_SIZE);
+
+  uint16_t memberCount = sizeof(ADOPT_MEMBERS) / sizeof(ADOPT_MEMBERS[0]);
+  if (part < memberCount)
   {
-    for (JsonVariant led : json["LED"].as<JsonArray>())
+    if (part == 0)
     {
-      jsonLedCommand(led);
+      out.print(F("HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nConnection: close\r\n\r\n{"));
     }
+
+    ADOPT_MEMBERS[part](json.as<JsonVariant>());
+    writeJsonMembers(out, json.as<JsonObject>(), part == 0);
+    return true;
   }
+  part -= memberCount;
 
-  if (json.containsKey("restart") && json["restart"].as<bool>())
+  if (writeSchemaPart(out, json, part, F("configSchema"), configTable, setSensorConfigSchema))
   {
-    ESP.restart();
+    return true;
   }
+  part -= configTable.count + 2;
 
-  // Let the sensors handle any commands
-  sensors.cmnd(json);
+  if (writeSchemaPart(out, json, part, F("commandSchema"), commandTable, setSensorCommandSchema))
+  {
+    // Close the adoption info after its last part
+    if (part == commandTable.count + 1)
+    {
+      out.print('}');
+    }
+    return true;
+  }
+
+  return false;
+}
+
+// Each complete request on the REST port, /metrics, /diagnostics, /adopt
+// and /events are served directly and everything else by the REST API
+void httpRequest(httpRequest_t & request)
+{
+  if (request.isGet("/metrics"))
+  {
+    request.stream(writeMetrics);
+  }
+  else if (request.isGet("/diagnostics"))
+  {
+    request.stream(writeDiagnostics);
+  }
+  else if (request.isGet("/adopt"))
+  {
+    request.stream(writeAdopt);
+  }
+  else if (request.isGet("/events"))
+  {
+    // Stays open, owned by the event stream from here
+    if (events.subscribe(request.client))
+    {
+      request.detach();
+    }
+  }
+  else
+  {
+    // The request is already buffered, so the API never waits on the wire
+    httpBufferedClient client(request);
+    api.loop(&client);
+  }
 }
 
 /*--------------------------- Initialisation -------------------------------*/
@@ -680,6 +2273,9 @@ void initialiseMqtt(byte * mac)
 
   // Start listening for MQTT messages
   mqttClient.setCallback(mqttCallback);  
+
+  // Alerts are published as status events
+  pmAlerts.onAlert(alertEvent);
 }
 
 void initialiseRestApi(void)
@@ -695,34 +2291,60 @@ void initialiseRestApi(void)
   api.onAdopt(apiAdopt);
 
   server.begin();
+  http.onRequest(httpRequest);
 }
 
-void initialiseWifi(byte * mac)
+/*--------------------------- Network -------------------------------*/
+uint32_t networkClock()
 {
-  // Ensure we are in the correct WiFi mode
-  WiFi.mode(WIFI_STA);
+  return millis();
+}
 
-  // Get WiFi base MAC address
-  WiFi.macAddress(mac);
+bool wifiIsConnected()
+{
+  return WiFi.status() == WL_CONNECTED;
+}
 
-  // Format the MAC address for display
-  char mac_display[18];
-  sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+bool wifiHasCredentials()
+{
+  return WiFi.SSID().length() > 0;
+}
 
-  // Display MAC/IP addresses on serial
-  logger.print(F("[AQS] mac address: "));
-  logger.println(mac_display);
+void wifiConnect()
+{
+  WiFi.begin();
+}
 
-  // Update OLED display
-  sensors.oled(mac);
+void wifiStartPortal()
+{
+  logger.println(F("[AQS] starting wifi captive portal"));
+
+  // Portal is serviced by wm.process() from netState.loop()
+  wm.setConfigPortalBlocking(false);
+  wm.startConfigPortal("OXRS_WiFi", "superhouse");
+}
 
-  // Connect using saved creds, or start captive portal if none found
-  // Blocks until connected or the portal is closed
-  WiFiManager wm;
-  if (!wm.autoConnect("OXRS_WiFi", "superhouse"))
+bool wifiProcessPortal()
+{
+  return wm.process();
+}
+
+const networkState::driver_t WIFI_DRIVER = {
+  networkClock,
+  wifiIsConnected,
+  wifiHasCredentials,
+  wifiConnect,
+  wifiStartPortal,
+  wifiProcessPortal,
+};
+
+void wifiConnected(uint8_t fromState, uint32_t elapsedMs)
+{
+  if (fromState == NET_STATE_FAST_CONNECTING)
   {
-    // If we are unable to connect then restart
-    ESP.restart();
+    logger.print(F("[AQS] fast wifi connect in "));
+    logger.print(elapsedMs);
+    logger.println(F("ms"));
   }
 
   // Update OLED display
@@ -737,13 +2359,48 @@ void initialiseWifi(byte * mac)
   pixelDriver.colour(0, 0, 20, 0, 0, 0, 0, 0, 0);
   #endif
 
+  // Set up the REST API once we have an IP address
+  if (!restApiStarted)
+  {
+    initialiseRestApi();
+    restApiStarted = true;
+  }
+}
+
+void initialiseWifi(byte * mac)
+{
+  // Ensure we are in the correct WiFi mode
+  WiFi.mode(WIFI_STA);
+
+  // Get WiFi base MAC address
+  WiFi.macAddress(mac);
+
+  // Format the MAC address for display
+  char mac_display[18];
+  sprintf_P(mac_display, PSTR("%02X:%02X:%02X:%02X:%02X:%02X"), mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+
+  // Display MAC/IP addresses on serial
+  logger.print(F("[AQS] mac address: "));
+  logger.println(mac_display);
+
+  // Update OLED display
+  sensors.oled(mac);
+
   // Set up MQTT (don't attempt to connect yet)
   initialiseMqtt(mac);
 
-  // Set up the REST API once we have an IP address
-  initialiseRestApi();
-}
+  // Start connecting - this doesn't block, netState.loop() takes it from here
+  bool fastConnecting = rtcStateValid && rtcState.wifiChannel != 0;
+  if (fastConnecting)
+  {
+    // Skip the scan by going straight to the AP we were last connected to
+    WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), rtcState.wifiChannel, rtcState.wifiBssid);
+  }
 
+  netState.fastTimeoutMs = FAST_WIFI_TIMEOUT_MS;
+  netState.connectTimeoutMs = WIFI_CONNECT_TIMEOUT_MS;
+  netState.begin(WIFI_DRIVER, wifiConnected, fastConnecting);
+}
 
 /*--------------------------- Program -------------------------------*/
 void setup()
@@ -765,31 +2422,89 @@ void setup()
   // Set up serial
   initialiseSerial();  
 
+  // Load anything we have stored in flash
+  EEPROM.begin(EEPROM_SIZE);
+  #if defined(LED_RGBW) || defined(LED_RGB)
+  loadAnimation();
+  #endif
+
+  // Resume from a warm restart, or at least restore our last config
+  restoreFastBootState();
+
+  // Watch for stalls from here on
+  initialiseStallWatchdog();
+
+  // Pick up any readings queued (in flash) before a warm restart
+  teleBacklog.begin(EEPROM_TELE_QUEUE_OFFSET, TELE_QUEUE_SPILL_SIZE, bootEpoch);
+
   // Start the I2C bus
   Wire.begin(I2C_SDA, I2C_SCL);
 
   // Start the sensor library (scan for attached sensors)
   sensors.begin();
 
-  // Set up network and obtain an IP address
+  // A warm restart has a valid PM average already, no need to wait for a frame
+  if (sensorState[0].read().valid)
+  {
+    takeSample();
+  }
+
+  // Setup Ikea sensor software serial connection - before the network
+  // so we are reading PM data straight away, even if we never get online
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    pmSensors[i].begin(pmSensorPins[i]);
+  }
+
+  // Start network bring-up, this continues in the background (see netState.loop())
   byte mac[6];
   initialiseWifi(mac);
 
-  // Setup Ikea sensor software serial connection
-  serialCom::setup();
-
 }
 
 void loop()
 {
-  // Check our MQTT broker connection is still ok
-  mqtt.loop();
+  // Time between loop() calls, i.e. how long everything below takes
+  uint32_t loopStartUs = micros();
+  loopPeriodUs = loopStartUs - lastLoopStartUs;
+  lastLoopStartUs = loopStartUs;
+  if (loopCount++ > 0 && loopPeriodUs > loopPeriodMaxUs)
+  {
+    loopPeriodMaxUs = loopPeriodUs;
+  }
+
+  // Advance WiFi connection/captive portal
+  stalls.enter(STALL_STAGE_NETWORK);
+  netState.loop();
+
+  if (netState.online())
+  {
+    // Check our MQTT broker connection is still ok
+    stalls.enter(STALL_STAGE_MQTT);
+    mqtt.loop();
+
+    // Retry adoption info if it didn't go when we connected
+    if (adoptPending && mqttClient.connected() && (int32_t)(millis() - adoptRetryMs) >= 0)
+    {
+      publishAdopt();
+    }
 
-  // Handle any API requests
-  WiFiClient client = server.available();
-  api.loop(&client);
+    // Ship any buffered log lines
+    logger.loop();
+
+    // Publish whatever the socket will take without blocking
+    publisher.loop();
+
+    // Keep any event stream subscribers alive
+    stalls.enter(STALL_STAGE_API);
+    events.loop();
+
+    // Advance any HTTP connections, never waiting on a slow client
+    http.loop();
+  }
 
   #if defined(LED_RGBW) || defined(LED_RGB)
+  stalls.enter(STALL_STAGE_LEDS);
   if (ledMode == LED_MODE_MANUAL)
   {
     processPixels();
@@ -798,29 +2513,105 @@ void loop()
   {
     autoPixels();
   }
+  if (ledMode == LED_MODE_ANIMATION)
+  {
+    animationPixels();
+  }
+
+  // First frame shown since a command changed the LEDs
+  if (commandAck.awaitingShow && pixelDriver.showCount() != commandAck.showCount)
+  {
+    commandAck.showUs = micros() - commandAck.receivedUs;
+    publishCommandAck();
+  }
   #endif
 
-  serialCom::handleUart(state);
+  // Publish each new frame to consumers, and sample everything on the PM frame cadence
+  stalls.enter(STALL_STAGE_UART);
+  for (uint8_t i = 0; i < PM_SENSOR_COUNT; i++)
+  {
+    if (!pmSensors[i].handleUart(acquisitionState[i]))
+    {
+      continue;
+    }
+
+    sensorState[i].write(acquisitionState[i]);
+    publishFrameEvents(i, acquisitionState[i]);
+
+    // Alerts get every frame from the primary, not just the average
+    if (i == 0)
+    {
+      pmAlerts.evaluate(acquisitionState[0].latest(), millis());
+
+      if (acquisitionState[0].valid)
+      {
+        takeSample();
+      }
+    }
+  }
+
+  // Periodic UART link quality diagnostics
+  stalls.enter(STALL_STAGE_TELEMETRY);
+  if (mqttClient.connected() && (millis() - lastDiagnostics) > DIAGNOSTICS_INTERVAL_MS)
+  {
+    lastDiagnostics = millis();
+    publishDiagnostics();
+  }
+
+  // Publish anything queued while MQTT was down
+  drainBacklog();
+
+  // Report stalls as they happen too, not just after reconnecting
+  if (mqttClient.connected() && stalls.pending())
+  {
+    publishStalls();
+  }
+
+  if ((millis() - lastFastBootSave) > FAST_BOOT_SAVE_MS)
+  {
+    saveFastBootState();
+  }
+
+  // Publish the first valid reading as soon as we can, rather than
+  // waiting for a full update interval after boot
+  if (!firstTelemetrySent && teleSampleValid && updateMs != 0 && mqttClient.connected() && teleBacklog.depth() == 0)
+  {
+    lastUpdate = millis() - updateMs - 1;
+  }
 
   if ((millis() - lastUpdate) > updateMs)
   {
     lastUpdate = millis();
     logger.println(F("[AQS] tele update ready"));
 
-    if (state.valid)
+    if (teleSampleValid)
     {
       if (updateMs == 0)
       {
+        stalls.enter(STALL_STAGE_SYSTEM);
         return;
       }
       logger.println(F("[AQS] tele state valid"));
-      DynamicJsonDocument json(500);
-      json["pm25"] = state.avgPM25;
-      if (!json.isNull())
+      publishRetainedMetrics(teleSample);
+      if (!queueReading(teleSample))
+      {
+        logger.println(F("[AQS] tele data queued"));
+      }
+      else
       {
-        mqtt.publishTelemetry(json.as<JsonVariant>());
         logger.println(F("[AQS] tele data sent"));
+
+        if (!firstTelemetrySent)
+        {
+          firstTelemetrySent = true;
+          logger.print(F("[AQS] boot to first telemetry: "));
+          logger.print(millis());
+          logger.println(F("ms"));
+        }
       }
     }
   }
+
+  // Anything from here until the next loop() is the SDK/WiFi stack
+  stalls.enter(STALL_STAGE_SYSTEM);
 }
\ No newline at end of file
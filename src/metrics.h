@@ -0,0 +1,119 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * Prometheus/OpenMetrics text exposition helpers. Everything is printed
+ * straight to the client from flash, no buffers or JSON documents.
+ */
+namespace metrics {
+    void _name(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * suffix) {
+        out.print(name);
+        if (suffix) {
+            out.print(suffix);
+        }
+    }
+
+    void _header(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * suffix, const __FlashStringHelper * type, const __FlashStringHelper * help) {
+        out.print(F("# HELP "));
+        _name(out, name, suffix);
+        out.print(' ');
+        out.println(help);
+        out.print(F("# TYPE "));
+        _name(out, name, suffix);
+        out.print(' ');
+        out.println(type);
+    }
+
+    void header(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * type, const __FlashStringHelper * help) {
+        _header(out, name, nullptr, type, help);
+    }
+
+    // Counter samples are named <name>_total, so in the text format (where
+    // the family name has to match its samples) the header is too
+    void counterHeader(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * help) {
+        _header(out, name, F("_total"), F("counter"), help);
+    }
+
+    void gauge(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * help, uint32_t value) {
+        header(out, name, F("gauge"), help);
+        out.print(name);
+        out.print(' ');
+        out.println(value);
+    }
+
+    void gauge(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * help, float value) {
+        header(out, name, F("gauge"), help);
+        out.print(name);
+        out.print(' ');
+        out.println(value, 2);
+    }
+
+    void counter(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * help, uint32_t value) {
+        counterHeader(out, name, help);
+        out.print(name);
+        out.print(F("_total "));
+        out.println(value);
+    }
+
+    // One labelled line of a metric with several series (e.g. per sensor),
+    // after a single header() (or counterHeader()) for them all
+    void sample(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * label, const char * labelValue, uint32_t value, bool counter = false) {
+        out.print(name);
+        if (counter) {
+            out.print(F("_total"));
+        }
+        out.print('{');
+        out.print(label);
+        out.print(F("=\""));
+        out.print(labelValue);
+        out.print(F("\"} "));
+        out.println(value);
+    }
+
+    void sample(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * label, uint32_t labelValue, uint32_t value, bool counter = false) {
+        char buffer[12];
+        sample(out, name, label, ultoa(labelValue, buffer, 10), value, counter);
+    }
+
+    // Cumulative buckets, sum and count of one labelled histogram series.
+    // 'counts' holds per bucket (not cumulative) counts, with one more
+    // entry than 'bounds' for anything above the last bound.
+    void histogram(Print& out, const __FlashStringHelper * name, const __FlashStringHelper * label, uint32_t labelValue, const uint32_t * bounds, const uint32_t * counts, uint8_t buckets, uint32_t sum) {
+        uint32_t cumulative = 0;
+
+        for (uint8_t i = 0; i < buckets; i++) {
+            cumulative += counts[i];
+
+            out.print(name);
+            out.print(F("_bucket{"));
+            out.print(label);
+            out.print(F("=\""));
+            out.print(labelValue);
+            out.print(F("\",le=\""));
+            if (i < buckets - 1) {
+                out.print(bounds[i]);
+            } else {
+                out.print(F("+Inf"));
+            }
+            out.print(F("\"} "));
+            out.println(cumulative);
+        }
+
+        out.print(name);
+        out.print(F("_sum{"));
+        out.print(label);
+        out.print(F("=\""));
+        out.print(labelValue);
+        out.print(F("\"} "));
+        out.println(sum);
+
+        out.print(name);
+        out.print(F("_count{"));
+        out.print(label);
+        out.print(F("=\""));
+        out.print(labelValue);
+        out.print(F("\"} "));
+        out.println(cumulative);
+    }
+} // namespace metrics
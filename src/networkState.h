@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+
+// Network bring-up states (polled from loop)
+#define NET_STATE_FAST_CONNECTING   0
+#define NET_STATE_CONNECTING        1
+#define NET_STATE_PORTAL            2
+#define NET_STATE_CONNECTED         3
+
+/**
+ * WiFi bring-up as a polled state machine, so nothing in loop() has to wait
+ * for the network. Tries the remembered AP first (if the caller started a
+ * fast connect), then the saved credentials, then falls back to the captive
+ * portal. Once connected the SDK takes care of reconnecting if the AP drops.
+ *
+ * The WiFi layer is reached through a table of callbacks, so it can be
+ * mocked on the host.
+ */
+class networkState {
+public:
+    typedef uint32_t (*clockCallback)();
+    typedef void (*connectedCallback)(uint8_t fromState, uint32_t elapsedMs);
+
+    struct driver_t {
+        clockCallback clock;
+        bool (*connected)();            // link up with an IP address
+        bool (*hasCredentials)();       // saved SSID to try
+        void (*connect)();              // start connecting with the saved credentials
+        void (*startPortal)();          // start the captive portal, without blocking
+        bool (*processPortal)();        // service the portal, true once it has connected
+    };
+
+    // Call once the driver is ready. 'fastConnecting' if the caller has
+    // already started connecting to the remembered AP.
+    void begin(const driver_t& driver, connectedCallback onConnected, bool fastConnecting) {
+        _driver = &driver;
+        _onConnected = onConnected;
+
+        if (fastConnecting) {
+            _set(NET_STATE_FAST_CONNECTING);
+        } else {
+            _connect();
+        }
+    }
+
+    void loop() {
+        uint32_t elapsed = _driver->clock() - _stateMs;
+
+        switch (_state) {
+            case NET_STATE_FAST_CONNECTING:
+                if (_driver->connected()) {
+                    _connected(elapsed);
+                } else if (elapsed > fastTimeoutMs) {
+                    _connect();
+                }
+                break;
+
+            case NET_STATE_CONNECTING:
+                if (_driver->connected()) {
+                    _connected(elapsed);
+                } else if (elapsed > connectTimeoutMs) {
+                    _portal();
+                }
+                break;
+
+            case NET_STATE_PORTAL:
+                if (_driver->processPortal()) {
+                    _connected(elapsed);
+                }
+                break;
+
+            case NET_STATE_CONNECTED:
+                // Nothing to do, the SDK reconnects on its own if the AP drops
+                break;
+        }
+    }
+
+    uint8_t state() const {
+        return _state;
+    }
+
+    // Brought up, and the link is currently up
+    bool online() const {
+        return _state == NET_STATE_CONNECTED && _driver->connected();
+    }
+
+    uint32_t fastTimeoutMs = 3000;
+    uint32_t connectTimeoutMs = 20000;
+
+private:
+    void _set(uint8_t state) {
+        _state = state;
+        _stateMs = _driver->clock();
+    }
+
+    void _connect() {
+        // No saved creds means nothing to try, straight to the portal
+        if (!_driver->hasCredentials()) {
+            _portal();
+            return;
+        }
+
+        _driver->connect();
+        _set(NET_STATE_CONNECTING);
+    }
+
+    void _portal() {
+        _driver->startPortal();
+        _set(NET_STATE_PORTAL);
+    }
+
+    void _connected(uint32_t elapsed) {
+        uint8_t from = _state;
+        _set(NET_STATE_CONNECTED);
+
+        if (_onConnected) {
+            _onConnected(from, elapsed);
+        }
+    }
+
+    const driver_t * _driver = nullptr;
+    connectedCallback _onConnected = nullptr;
+
+    uint8_t _state = NET_STATE_CONNECTING;
+    uint32_t _stateMs = 0;
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <types.h>
+
+/**
+ * PM1006 (IKEA vindriktning) frame decoding and averaging - no Arduino
+ * dependencies so the same code runs in the firmware and the Linux gateway.
+ *
+ *   0x16 0x11 0x0B  DF1 DF2 DF3 DF4 ... DF16  CS
+ *
+ * PM 2.5 is DF3 (MSB) and DF4 (LSB), and all 20 bytes sum to 0.
+ */
+namespace pm1006 {
+    constexpr static const uint8_t FRAME_LENGTH = 20;
+    constexpr static const uint8_t HEADER[3] = { 0x16, 0x11, 0x0B };
+
+    inline bool isValidHeader(const uint8_t * frame) {
+        return frame[0] == HEADER[0] && frame[1] == HEADER[1] && frame[2] == HEADER[2];
+    }
+
+    inline uint8_t checksum(const uint8_t * frame) {
+        uint8_t sum = 0;
+
+        for (uint8_t i = 0; i < FRAME_LENGTH; i++) {
+            sum += frame[i];
+        }
+
+        return sum;
+    }
+
+    inline bool isValidChecksum(const uint8_t * frame) {
+        return checksum(frame) == 0;
+    }
+
+    inline uint16_t pm25(const uint8_t * frame) {
+        /**
+         *         MSB  DF 3     DF 4  LSB
+         * uint16_t = xxxxxxxx xxxxxxxx
+         */
+        return (frame[5] << 8) | frame[6];
+    }
+
+    // Add a reading to the 5 sample averaging window, returns true when a
+    // new average has been calculated
+    inline bool addMeasurement(particleSensorState_t& state, uint16_t pm25) {
+        state.measurements[state.measurementIdx] = pm25;
+
+        state.measurementIdx = (state.measurementIdx + 1) % 5;
+
+        if (state.measurementIdx != 0) {
+            return false;
+        }
+
+        float avgPM25 = 0.0f;
+
+        for (uint8_t i = 0; i < 5; ++i) {
+            avgPM25 += state.measurements[i] / 5.0f;
+        }
+
+        state.avgPM25 = avgPM25;
+        state.valid = true;
+
+        return true;
+    }
+
+    /**
+     * Streaming decoder, feed it bytes as they arrive (in any sized chunks)
+     * and it re-synchronises on the header by itself.
+     */
+    class parser {
+    public:
+        enum result_t {
+            NONE,               // byte consumed, nothing to report
+            SKIPPED,            // byte discarded while looking for a header
+            FRAME,              // frame() holds a valid frame
+            BAD_HEADER,         // header started but didn't match
+            BAD_CHECKSUM,       // full frame, bad checksum
+        };
+
+        result_t feed(uint8_t byte) {
+            if (_length < sizeof(HEADER) && byte != HEADER[_length]) {
+                bool started = _length > 0;
+
+                // This byte might be the start of the next header
+                _length = 0;
+                if (byte == HEADER[0]) {
+                    _frame[_length++] = byte;
+                }
+
+                return started ? BAD_HEADER : SKIPPED;
+            }
+
+            _frame[_length++] = byte;
+
+            if (_length < FRAME_LENGTH) {
+                return NONE;
+            }
+
+            _length = 0;
+            return isValidChecksum(_frame) ? FRAME : BAD_CHECKSUM;
+        }
+
+        const uint8_t * frame() const {
+            return _frame;
+        }
+
+        void reset() {
+            _length = 0;
+        }
+
+    private:
+        uint8_t _frame[FRAME_LENGTH];
+        uint8_t _length = 0;
+    };
+} // namespace pm1006
@@ -0,0 +1,322 @@
+#pragma once
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+
+// Message classes, highest priority first
+#define PUBLISH_CLASS_PRIORITY      0       // adoption, alerts
+#define PUBLISH_CLASS_TELEMETRY     1
+#define PUBLISH_CLASS_LOG           2
+#define PUBLISH_CLASS_COUNT         3
+
+// Bounds on what can be waiting at once. The biggest message queued is the
+// diagnostics status event, about 1KB with 4 PM sensors. Adoption info (over
+// 5KB, more with the I2C sensor schemas) doesn't fit and is published
+// directly instead, see beginDirect().
+#define PUBLISH_QUEUE_SLOTS         8
+#define PUBLISH_QUEUE_MAX_BYTES     4096
+
+// Messages published per loop() at most
+#define PUBLISH_BATCH_SIZE          4
+
+// Direct publishes are handed to the socket in chunks of this size
+#define PUBLISH_DIRECT_CHUNK_SIZE   128
+
+// lwIP never has more than about this much send buffer free, bigger
+// messages go once this much is free and may wait briefly for the rest
+#define PUBLISH_MAX_WRITE_WINDOW    1460
+
+/**
+ * Batches the writes of a direct publish into chunks, ArduinoJson writes
+ * numbers a character at a time and each would otherwise be a separate
+ * write to the socket. Counts what actually made it out.
+ */
+class directWriter : public Print {
+public:
+    directWriter(PubSubClient& mqttClient) : _mqtt(mqttClient) {}
+
+    void begin() {
+        _length = 0;
+        written = 0;
+    }
+
+    size_t write(uint8_t c) override {
+        _buffer[_length++] = c;
+
+        if (_length == sizeof(_buffer)) {
+            finish();
+        }
+
+        return 1;
+    }
+
+    using Print::write;
+
+    // Write out whatever is left in the buffer, returns bytes written in total
+    size_t finish() {
+        if (_length) {
+            written += _mqtt.write(_buffer, _length);
+            _length = 0;
+        }
+
+        return written;
+    }
+
+    size_t written = 0;
+
+private:
+    PubSubClient& _mqtt;
+
+    uint8_t _buffer[PUBLISH_DIRECT_CHUNK_SIZE];
+    uint8_t _length = 0;
+};
+
+/**
+ * Bounded priority queue of outbound MQTT messages, drained from loop()
+ * only while the TCP send buffer has room so a marginal link never stalls
+ * the rest of the firmware on a blocking write.
+ *
+ * Messages are published oldest first within a class, and higher classes
+ * first. When the queue is full the oldest message of a lower class is
+ * dropped to make room, otherwise the new message is dropped. Drops and
+ * time spent queued are counted per class.
+ *
+ * Messages live in a fixed PUBLISH_QUEUE_MAX_BYTES arena, packed end to
+ * end in the order they were queued. Since they can leave in any order,
+ * those after a message which leaves are moved down over it, so there is
+ * never a gap to fragment the space and nothing is allocated per message.
+ */
+class publishQueue {
+public:
+    publishQueue(PubSubClient& mqttClient, Client& net) : _mqtt(mqttClient), _net(net), _direct(mqttClient) {}
+
+    // Queue a message, false (and counted as a drop) if there is no room
+    bool push(uint8_t cls, const char * topic, const uint8_t * payload, size_t length, bool retained) {
+        uint8_t * buffer = reserve(cls, topic, length, retained);
+        if (!buffer) {
+            return false;
+        }
+
+        memcpy(buffer, payload, length);
+        return true;
+    }
+
+    // Queue a message of 'length' bytes and return where to write the
+    // payload (with room for a trailing null), NULL if there is no room
+    uint8_t * reserve(uint8_t cls, const char * topic, size_t length, bool retained) {
+        size_t topicLength = strlen(topic);
+        size_t size = topicLength + 1 + length + 1;
+
+        if (size > PUBLISH_QUEUE_MAX_BYTES) {
+            drops[cls]++;
+            return NULL;
+        }
+
+        // Make room by dropping lower priority messages, oldest first
+        int8_t slot = _freeSlot();
+        while (slot < 0 || _bytes + size > PUBLISH_QUEUE_MAX_BYTES) {
+            int8_t victim = _oldest(cls + 1);
+            if (victim < 0) {
+                drops[cls]++;
+                return NULL;
+            }
+
+            drops[_slots[victim].cls]++;
+            _release(victim);
+
+            if (slot < 0) {
+                slot = victim;
+            }
+        }
+
+        uint8_t * data = _arena + _bytes;
+
+        slot_t& entry = _slots[slot];
+        entry.offset = _bytes;
+        entry.size = size;
+        entry.length = length;
+        entry.cls = cls;
+        entry.retained = retained;
+        entry.seq = _seq++;
+        entry.queuedMs = millis();
+
+        memcpy(data, topic, topicLength + 1);
+        _bytes += size;
+        _count++;
+
+        return data + topicLength + 1;
+    }
+
+    // Call from loop(), publishes whatever the socket will take without blocking
+    void loop() {
+        if (!_mqtt.connected()) {
+            return;
+        }
+
+        for (uint8_t i = 0; i < PUBLISH_BATCH_SIZE; i++) {
+            int8_t slot = _oldest(0);
+            if (slot < 0) {
+                return;
+            }
+
+            slot_t& entry = _slots[slot];
+            const char * topic = (const char *)_arena + entry.offset;
+            const uint8_t * payload = (const uint8_t *)topic + strlen(topic) + 1;
+
+            // Fixed header (up to 5 bytes) + topic length (2 bytes)
+            size_t needed = 7 + strlen(topic) + entry.length;
+            if (needed > PUBLISH_MAX_WRITE_WINDOW) {
+                needed = PUBLISH_MAX_WRITE_WINDOW;
+            }
+
+            if ((size_t)_net.availableForWrite() < needed) {
+                return;
+            }
+
+            if (_mqtt.beginPublish(topic, entry.length, entry.retained)) {
+                _mqtt.write(payload, entry.length);
+
+                if (_mqtt.endPublish()) {
+                    published[entry.cls]++;
+                } else {
+                    drops[entry.cls]++;
+                }
+            } else {
+                drops[entry.cls]++;
+            }
+
+            lastLatencyMs[entry.cls] = millis() - entry.queuedMs;
+            if (lastLatencyMs[entry.cls] > maxLatencyMs[entry.cls]) {
+                maxLatencyMs[entry.cls] = lastLatencyMs[entry.cls];
+            }
+
+            _release(slot);
+        }
+    }
+
+    // Publish straight away, bypassing the queue, for the odd message too
+    // big to queue. Write exactly 'length' bytes of payload to the returned
+    // Print then call endDirect(). Unlike loop() this blocks until the socket
+    // has taken the whole message. NULL (and counted as a drop) on failure.
+    Print * beginDirect(uint8_t cls, const char * topic, size_t length, bool retained) {
+        _directClass = cls;
+        _directLength = length;
+        _direct.begin();
+
+        if (!_mqtt.connected() || !_mqtt.beginPublish(topic, length, retained)) {
+            drops[cls]++;
+            return NULL;
+        }
+
+        return &_direct;
+    }
+
+    // False (and counted as a drop) if the whole message didn't go
+    bool endDirect() {
+        bool sent = _direct.finish() == _directLength && _mqtt.endPublish();
+
+        if (sent) {
+            published[_directClass]++;
+        } else {
+            drops[_directClass]++;
+        }
+
+        return sent;
+    }
+
+    bool connected() {
+        return _mqtt.connected();
+    }
+
+    uint8_t depth() {
+        return _count;
+    }
+
+    size_t bytes() {
+        return _bytes;
+    }
+
+    uint32_t published[PUBLISH_CLASS_COUNT] = {0};
+    uint32_t drops[PUBLISH_CLASS_COUNT] = {0};
+    uint32_t lastLatencyMs[PUBLISH_CLASS_COUNT] = {0};
+    uint32_t maxLatencyMs[PUBLISH_CLASS_COUNT] = {0};
+
+private:
+    struct slot_t {
+        uint16_t offset;        // into _arena: topic, null, payload, null
+        uint16_t size;          // 0 if free
+        uint16_t length;        // payload
+        uint8_t cls;
+        bool retained;
+        uint32_t seq;
+        uint32_t queuedMs;
+    };
+
+    int8_t _freeSlot() {
+        for (uint8_t i = 0; i < PUBLISH_QUEUE_SLOTS; i++) {
+            if (!_slots[i].size) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    // Oldest message of the lowest priority class at or below 'minClass'
+    // when evicting (minClass > 0), or of the highest class when publishing
+    int8_t _oldest(uint8_t minClass) {
+        int8_t found = -1;
+
+        for (uint8_t i = 0; i < PUBLISH_QUEUE_SLOTS; i++) {
+            const slot_t& entry = _slots[i];
+            if (!entry.size || entry.cls < minClass) {
+                continue;
+            }
+
+            if (found < 0) {
+                found = i;
+                continue;
+            }
+
+            const slot_t& best = _slots[found];
+            bool better = minClass > 0
+                ? entry.cls > best.cls || (entry.cls == best.cls && (int32_t)(entry.seq - best.seq) < 0)
+                : entry.cls < best.cls || (entry.cls == best.cls && (int32_t)(entry.seq - best.seq) < 0);
+
+            if (better) {
+                found = i;
+            }
+        }
+
+        return found;
+    }
+
+    // Close the gap, moving everything queued after it down
+    void _release(int8_t slot) {
+        uint16_t offset = _slots[slot].offset;
+        uint16_t size = _slots[slot].size;
+
+        memmove(_arena + offset, _arena + offset + size, _bytes - offset - size);
+        for (uint8_t i = 0; i < PUBLISH_QUEUE_SLOTS; i++) {
+            if (_slots[i].size && _slots[i].offset > offset) {
+                _slots[i].offset -= size;
+            }
+        }
+
+        _slots[slot].size = 0;
+        _bytes -= size;
+        _count--;
+    }
+
+    PubSubClient& _mqtt;
+    Client& _net;
+
+    directWriter _direct;
+    uint8_t _directClass = 0;
+    size_t _directLength = 0;
+
+    slot_t _slots[PUBLISH_QUEUE_SLOTS] = {};
+    uint8_t _arena[PUBLISH_QUEUE_MAX_BYTES];
+    size_t _bytes = 0;              // in use, from the start of _arena
+    uint8_t _count = 0;
+    uint32_t _seq = 0;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <string.h>
+
+/**
+ * Single writer sequence lock for handing snapshots from acquisition to
+ * consumers. The writer never waits, readers retry if they overlap a write
+ * so always get a consistent copy - no interrupts need to be disabled.
+ *
+ * The sequence is odd while a write is in progress.
+ */
+template <typename T>
+class seqlock {
+public:
+    // Only ever call from a single producer (e.g. the UART handler/ISR)
+    void write(const T& value) {
+        uint32_t seq = _seq.load(std::memory_order_relaxed);
+
+        _seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        memcpy((void *)&_value, &value, sizeof(T));
+
+        _seq.store(seq + 2, std::memory_order_release);
+    }
+
+    T read() const {
+        T copy;
+        uint32_t before;
+        uint32_t after;
+
+        do {
+            before = _seq.load(std::memory_order_acquire);
+
+            memcpy(&copy, (const void *)&_value, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            after = _seq.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        return copy;
+    }
+
+    // Number of writes so far, lets consumers spot a new snapshot cheaply
+    uint32_t version() const {
+        return _seq.load(std::memory_order_acquire) >> 1;
+    }
+
+private:
+    std::atomic<uint32_t> _seq{0};
+    volatile T _value;
+};
@@ -3,111 +3,115 @@
 #include <SoftwareSerial.h>
 
 #include <types.h>
-
-namespace serialCom {
-    // constexpr static const uint8_t PIN_UART_RX = 2; // D2 on Wemos D1 Mini
-
-    SoftwareSerial sensorSerial(PIN_UART_RX,-1);
-
-    uint8_t serialRxBuf[255];
-    uint8_t rxBufIdx = 0;
-
-    void setup() {
-        sensorSerial.begin(9600);
+#include <pm1006.h>
+
+// Upper bounds of the inter-frame gap histogram buckets, plus one more
+// bucket for anything longer
+constexpr static const uint32_t UART_GAP_BUCKETS_MS[] = { 1500, 3000, 10000, 30000, 60000 };
+#define UART_GAP_BUCKET_COUNT   (sizeof(UART_GAP_BUCKETS_MS) / sizeof(UART_GAP_BUCKETS_MS[0]) + 1)
+
+// Link quality counters for one sensor, to tell a bad sensor (checksum
+// errors) from a bad wire (header errors, resyncs) from interrupt
+// interference (overflows)
+struct uartStats_t {
+    uint32_t bytes = 0;
+    uint32_t framesAccepted = 0;
+    uint32_t headerErrors = 0;      // header started but didn't match
+    uint32_t checksumErrors = 0;
+    uint32_t overflows = 0;         // software serial RX buffer overran
+    uint32_t resyncs = 0;           // times bytes were discarded to find a header
+    uint32_t gaps[UART_GAP_BUCKET_COUNT] = {0};
+    uint32_t gapSumMs = 0;
+
+    uint32_t framesRejected() const {
+        return headerErrors + checksumErrors;
     }
-
-    void clearRxBuf() {
-        // Clear everything for the next message
-        memset(serialRxBuf, 0, sizeof(serialRxBuf));
-        rxBufIdx = 0;
+};
+
+/**
+ * Receiver for a single PM1006 sensor on a software serial RX pin, one
+ * instance per sensor.
+ *
+ * Bytes are fed through the pm1006 streaming parser as they arrive, so
+ * frames split across loop() calls are reassembled and handleUart() never
+ * waits on the wire.
+ */
+class serialCom {
+public:
+    // Sensor TX (IKEA board REST pad) to 'rxPin', e.g. D2 on Wemos D1 Mini
+    void begin(uint8_t rxPin) {
+        // Frames are 20 bytes every few seconds, so a small buffer is plenty
+        _sensorSerial.begin(9600, SWSERIAL_8N1, rxPin, -1, false, RX_BUFFER_SIZE);
     }
 
-    void parseState(particleSensorState_t& state) {
-        /**
-         *         MSB  DF 3     DF 4  LSB
-         * uint16_t = xxxxxxxx xxxxxxxx
-         */
-        const uint16_t pm25 = (serialRxBuf[5] << 8) | serialRxBuf[6];
-
-        Serial.printf("Received PM 2.5 reading: %d\n", pm25);
+    // Returns true if a new frame was decoded into state
+    bool handleUart(particleSensorState_t& state) {
+        bool decoded = false;
 
-        state.measurements[state.measurementIdx] = pm25;
+        if (_sensorSerial.overflow()) {
+            stats.overflows++;
+        }
 
-        state.measurementIdx = (state.measurementIdx + 1) % 5;
+        while (_sensorSerial.available()) {
+            stats.bytes++;
 
-        if (state.measurementIdx == 0) {
-            float avgPM25 = 0.0f;
+            pm1006::parser::result_t result = _parser.feed(_sensorSerial.read());
 
-            for (uint8_t i = 0; i < 5; ++i) {
-                avgPM25 += state.measurements[i] / 5.0f;
+            // Count each run of discarded bytes once
+            if (result == pm1006::parser::SKIPPED && !_skipping) {
+                stats.resyncs++;
+            }
+            _skipping = result == pm1006::parser::SKIPPED;
+
+            switch (result) {
+                case pm1006::parser::FRAME:
+                    stats.framesAccepted++;
+                    _recordGap();
+                    pm1006::addMeasurement(state, pm1006::pm25(_parser.frame()));
+                    decoded = true;
+                    break;
+
+                case pm1006::parser::BAD_HEADER:
+                    stats.headerErrors++;
+                    break;
+
+                case pm1006::parser::BAD_CHECKSUM:
+                    stats.checksumErrors++;
+                    break;
+
+                default:
+                    break;
             }
-
-            state.avgPM25 = avgPM25;
-            state.valid = true;
-
-            Serial.printf("New Avg PM25: %d\n", state.avgPM25);
         }
 
-        clearRxBuf();
+        return decoded;
     }
 
-    bool isValidHeader() {
-        bool headerValid = serialRxBuf[0] == 0x16 && serialRxBuf[1] == 0x11 && serialRxBuf[2] == 0x0B;
-
-        if (!headerValid) {
-            Serial.println("Received message with invalid header.");
-        }
+    uartStats_t stats;
 
-        return headerValid;
-    }
+private:
+    void _recordGap() {
+        uint32_t now = millis();
 
-    bool isValidChecksum() {
-        uint8_t checksum = 0;
+        if (stats.framesAccepted > 1) {
+            uint32_t gap = now - _lastFrameMs;
 
-        for (uint8_t i = 0; i < 20; i++) {
-            checksum += serialRxBuf[i];
-        }
+            uint8_t bucket = 0;
+            while (bucket < UART_GAP_BUCKET_COUNT - 1 && gap > UART_GAP_BUCKETS_MS[bucket]) {
+                bucket++;
+            }
 
-        if (checksum != 0) {
-            Serial.printf("Received message with invalid checksum. Expected: 0. Actual: %d\n", checksum);
+            stats.gaps[bucket]++;
+            stats.gapSumMs += gap;
         }
 
-        return checksum == 0;
+        _lastFrameMs = now;
     }
 
-    void handleUart(particleSensorState_t& state) {
-        if (!sensorSerial.available()) {
-            return;
-        }
-
-        Serial.print("Receiving:");
-        while (sensorSerial.available()) {
-            serialRxBuf[rxBufIdx++] = sensorSerial.read();
-            Serial.print(".");
+    constexpr static const int RX_BUFFER_SIZE = 64;
 
-            // Without this delay, receiving data breaks for reasons that are beyond me
-            delay(15);
-
-            if (rxBufIdx >= 64) {
-                clearRxBuf();
-            }
-        }
-        Serial.println("Done.");
-
-        if (isValidHeader() && isValidChecksum()) {
-            parseState(state);
-
-            Serial.printf(
-                "Current measurements: %d, %d, %d, %d, %d\n",
-
-                state.measurements[0],
-                state.measurements[1],
-                state.measurements[2],
-                state.measurements[3],
-                state.measurements[4]
-            );
-        } else {
-            clearRxBuf();
-        }
-    }
-} // namespace SerialCom
\ No newline at end of file
+    SoftwareSerial _sensorSerial;
+    pm1006::parser _parser;
+    bool _skipping = false;
+    uint32_t _lastFrameMs = 0;
+};
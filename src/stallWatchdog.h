@@ -0,0 +1,277 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// loop() stages, in the order they run
+#define STALL_STAGE_SETUP           0
+#define STALL_STAGE_NETWORK         1       // WiFi bring-up/captive portal
+#define STALL_STAGE_MQTT            2       // broker connection, log and publish queue
+#define STALL_STAGE_API             3       // event stream and HTTP connections
+#define STALL_STAGE_LEDS            4
+#define STALL_STAGE_UART            5       // PM sensors, alerts and sampling
+#define STALL_STAGE_TELEMETRY       6       // diagnostics, backlog, fast boot and telemetry
+#define STALL_STAGE_SYSTEM          7       // between loop() calls, i.e. the SDK/WiFi stack
+#define STALL_STAGE_COUNT           8
+
+// Stall records kept, oldest are overwritten
+#define STALL_LOG_SIZE              8
+
+// Record flags
+#define STALL_FLAG_OPEN             0x01    // stage still running when last checked
+#define STALL_FLAG_RESET            0x02    // ...and we never got back from it
+
+// rst_info reasons for the watchdog resets (REASON_WDT_RST/REASON_SOFT_WDT_RST)
+#define STALL_RESET_HW_WDT          1
+#define STALL_RESET_SOFT_WDT        3
+
+// How long a stage has to run without yielding before each watchdog fires,
+// the least a stall ending in that reset can have lasted
+#define STALL_HW_WDT_MS             8000
+#define STALL_SOFT_WDT_MS           3200
+
+static const char * const STALL_STAGE_NAMES[STALL_STAGE_COUNT] = { "setup", "network", "mqtt", "api", "leds", "uart", "telemetry", "system" };
+
+struct stallRecord_t {
+    uint8_t stage;
+    uint8_t flags;          // STALL_FLAG_xxx
+    uint8_t resetReason;    // rst_info reason, if STALL_FLAG_RESET
+    uint8_t reserved;
+    uint32_t startMs;       // device clock
+    uint32_t durationMs;
+};
+
+// Kept in RTC memory, so stalls which end in a watchdog reset are still
+// there to publish once we are back
+struct stallLog_t {
+    uint32_t magic;
+    uint32_t checksum;
+    uint32_t recorded;      // total records, the next goes at recorded % STALL_LOG_SIZE
+    uint32_t published;
+    stallRecord_t records[STALL_LOG_SIZE];
+};
+
+// The running stage, also kept in RTC memory. Rewritten on every enter(),
+// since the check() timer can't run while a stage spins without yielding,
+// which is exactly how it ends up reset by a watchdog.
+struct stallStage_t {
+    uint32_t check;         // STAGE_MAGIC ^ stage ^ startMs, 0 once exited
+    uint32_t stage;
+    uint32_t startMs;
+};
+
+/**
+ * Software watchdog for loop() stages. Each stage is entered in turn, and
+ * any which runs for longer than 'thresholdMs' is recorded with its start
+ * time and duration.
+ *
+ * check() is called from a timer while a stage is still running (the timer
+ * only runs when the stage yields, e.g. waiting on a socket or delay()),
+ * saving an open record straight away so a stage which ends in a hardware
+ * watchdog reset is still caught. Every change to the log is handed to the
+ * persist callback, e.g. to write it to RTC memory.
+ *
+ * A stage which never yields never sees check() either, so each enter()
+ * also hands the stage and its start time to the stage callback, and
+ * exit() clears it. After a watchdog reset restore() turns that into a
+ * record of the stall.
+ *
+ * No Arduino dependencies, the clock is supplied, so it can be driven by a
+ * virtual clock on the host.
+ */
+class stallWatchdog {
+public:
+    typedef uint32_t (*clockCallback)();
+    typedef void (*persistCallback)(const stallLog_t& log);
+    typedef void (*stageCallback)(const stallStage_t& stage);
+
+    constexpr static const uint32_t MAGIC = 0x53544C31;      // 'STL1'
+    constexpr static const uint32_t STAGE_MAGIC = 0x53544731;    // 'STG1'
+
+    // Read anything saved before the last reset before calling this, the
+    // setup stage is handed to 'persistStage' straight away
+    void begin(clockCallback clock, persistCallback persist, stageCallback persistStage = nullptr) {
+        _clock = clock;
+        _persist = persist;
+        _persistStage = persistStage;
+
+        _stage = STALL_STAGE_SETUP;
+        _stageStartMs = _clock();
+        _open = false;
+        _saveStage();
+    }
+
+    // Carry on with a log restored after a warm restart. A record still
+    // open is the stage we were stuck in when we were reset, and after a
+    // watchdog reset so is the saved stage, whether or not check() got to
+    // see it.
+    void restore(const stallLog_t& saved, const stallStage_t& stage, uint8_t resetReason) {
+        if (saved.magic == MAGIC && saved.checksum == checksum(saved)) {
+            history = saved;
+        }
+
+        stallRecord_t * open = nullptr;
+        for (uint8_t i = 0; i < STALL_LOG_SIZE; i++) {
+            stallRecord_t& record = history.records[i];
+            if (record.flags & STALL_FLAG_OPEN) {
+                record.flags = (record.flags & ~STALL_FLAG_OPEN) | STALL_FLAG_RESET;
+                record.resetReason = resetReason;
+                open = &record;
+            }
+        }
+
+        uint32_t watchdogMs = 0;
+        if (resetReason == STALL_RESET_SOFT_WDT) {
+            watchdogMs = STALL_SOFT_WDT_MS;
+        } else if (resetReason == STALL_RESET_HW_WDT) {
+            watchdogMs = STALL_HW_WDT_MS;
+        }
+
+        bool valid = stage.check == (STAGE_MAGIC ^ stage.stage ^ stage.startMs) && stage.stage < STALL_STAGE_COUNT;
+        if (thresholdMs && watchdogMs && valid) {
+            // The clock carries on from about when we were reset
+            int32_t elapsed = (int32_t)(_clock() - stage.startMs);
+            uint32_t duration = elapsed > (int32_t)watchdogMs ? elapsed : watchdogMs;
+
+            // check() may already have caught it
+            stallRecord_t * record = open;
+            if (!record || record->stage != stage.stage || record->startMs != stage.startMs) {
+                record = &history.records[history.recorded++ % STALL_LOG_SIZE];
+                memset(record, 0, sizeof(*record));
+                record->stage = stage.stage;
+                record->startMs = stage.startMs;
+                record->flags = STALL_FLAG_RESET;
+                record->resetReason = resetReason;
+            }
+
+            if (duration > record->durationMs) {
+                record->durationMs = duration;
+            }
+        }
+
+        _save();
+    }
+
+    // Call at the start of each stage, ends the previous one
+    void enter(uint8_t stage) {
+        uint32_t now = _clock();
+        uint32_t duration = now - _stageStartMs;
+
+        if (thresholdMs && duration > thresholdMs) {
+            stallRecord_t& record = _open ? _current() : _add();
+            record.durationMs = duration;
+            record.flags &= ~STALL_FLAG_OPEN;
+            _save();
+        }
+
+        _stage = stage;
+        _stageStartMs = now;
+        _open = false;
+        _saveStage();
+    }
+
+    // Call before a deliberate restart, ends the running stage and clears
+    // the saved one
+    void exit() {
+        enter(_stage);
+
+        if (_persistStage) {
+            stallStage_t cleared = {};
+            _persistStage(cleared);
+        }
+    }
+
+    // Call from a timer, saves the running stage if it is stalled
+    void check() {
+        uint32_t duration = _clock() - _stageStartMs;
+
+        if (!thresholdMs || duration <= thresholdMs) {
+            return;
+        }
+
+        stallRecord_t& record = _open ? _current() : _add();
+        record.durationMs = duration;
+        record.flags |= STALL_FLAG_OPEN;
+        _open = true;
+        _save();
+    }
+
+    // Records not yet published
+    uint8_t pending() {
+        uint32_t count = history.recorded - history.published;
+
+        // Don't count the stall still in progress
+        if (_open && count) {
+            count--;
+        }
+
+        return count > STALL_LOG_SIZE ? STALL_LOG_SIZE : count;
+    }
+
+    // Oldest record not yet published, call published() once it has been
+    const stallRecord_t& next() {
+        if (history.recorded - history.published > STALL_LOG_SIZE) {
+            history.published = history.recorded - STALL_LOG_SIZE;
+        }
+
+        return history.records[history.published % STALL_LOG_SIZE];
+    }
+
+    void published() {
+        history.published++;
+        _save();
+    }
+
+    static uint32_t checksum(const stallLog_t& saved) {
+        // FNV-1a over everything after the header
+        const uint8_t * data = (const uint8_t *)&saved + offsetof(stallLog_t, recorded);
+        uint32_t hash = 2166136261UL;
+
+        for (size_t i = offsetof(stallLog_t, recorded); i < sizeof(saved); i++) {
+            hash = (hash ^ *data++) * 16777619UL;
+        }
+
+        return hash;
+    }
+
+    uint32_t thresholdMs = 0;       // 0 disables
+    stallLog_t history = {};
+
+private:
+    stallRecord_t& _current() {
+        return history.records[(history.recorded - 1) % STALL_LOG_SIZE];
+    }
+
+    stallRecord_t& _add() {
+        stallRecord_t& record = history.records[history.recorded++ % STALL_LOG_SIZE];
+        memset(&record, 0, sizeof(record));
+        record.stage = _stage;
+        record.startMs = _stageStartMs;
+        return record;
+    }
+
+    void _save() {
+        history.magic = MAGIC;
+        history.checksum = checksum(history);
+
+        if (_persist) {
+            _persist(history);
+        }
+    }
+
+    void _saveStage() {
+        if (_persistStage) {
+            stallStage_t current = { STAGE_MAGIC ^ _stage ^ _stageStartMs, _stage, _stageStartMs };
+            _persistStage(current);
+        }
+    }
+
+    clockCallback _clock = nullptr;
+    persistCallback _persist = nullptr;
+    stageCallback _persistStage = nullptr;
+
+    uint8_t _stage = STALL_STAGE_SETUP;
+    uint32_t _stageStartMs = 0;
+    bool _open = false;             // the running stage already has a record
+};
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <Arduino.h>
+#include <EEPROM.h>
+
+/**
+ * Bounded store-and-forward queue for readings taken while MQTT is down.
+ *
+ * New records go into a small RAM ring, when that fills the oldest half is
+ * spilled to a ring in (emulated EEPROM) flash. Everything in flash is older
+ * than anything in RAM so records always come back out oldest first. When
+ * both are full the oldest record is dropped.
+ *
+ * Flash records are tagged with the boot epoch they were taken in, records
+ * from a different epoch (i.e. before a power cycle) have meaningless
+ * timestamps and are discarded on begin().
+ */
+template <typename T, uint8_t RAM_SIZE>
+class teleQueue {
+public:
+    typedef bool (*publishCallback)(T& record);
+
+    void begin(int eepromOffset, uint16_t spillSize, uint32_t epoch) {
+        _offset = eepromOffset;
+        _spillSize = spillSize;
+
+        EEPROM.get(_offset, _spill);
+
+        bool compatible = _spill.magic == MAGIC && _spill.recordSize == sizeof(T);
+
+        if (!compatible || _spill.epoch != epoch || _spill.head >= _spillSize || _spill.count > _spillSize) {
+            if (compatible && _spill.count) {
+                drops += _spill.count;
+            }
+
+            memset(&_spill, 0, sizeof(_spill));
+            _spill.magic = MAGIC;
+            _spill.recordSize = sizeof(T);
+            _spill.epoch = epoch;
+            commit(true);
+        }
+    }
+
+    // Bytes of EEPROM needed for a spill ring of 'spillSize' records
+    static int eepromSize(uint16_t spillSize) {
+        return sizeof(spillHeader_t) + (spillSize * sizeof(T));
+    }
+
+    uint16_t depth() {
+        return _spill.count + _count;
+    }
+
+    void push(const T& record) {
+        if (_count == RAM_SIZE) {
+            // Only spill what flash has room for, so nothing is dropped
+            // until both are full
+            uint16_t room = _spillSize - _spill.count;
+            _spillOldest(room && room < RAM_SIZE / 2 ? room : RAM_SIZE / 2);
+        }
+
+        _ram[(_head + _count) % RAM_SIZE] = record;
+        _count++;
+    }
+
+    // Oldest record, false if empty
+    bool peek(T& record) {
+        if (_spill.count) {
+            EEPROM.get(_recordOffset(_spill.head), record);
+            return true;
+        }
+
+        if (_count) {
+            record = _ram[_head];
+            return true;
+        }
+
+        return false;
+    }
+
+    void pop() {
+        if (_spill.count) {
+            _spill.head = (_spill.head + 1) % _spillSize;
+            _spill.count--;
+            _dirty = true;
+            return;
+        }
+
+        if (_count) {
+            _head = (_head + 1) % RAM_SIZE;
+            _count--;
+        }
+    }
+
+    // Hand up to 'batch' of the oldest records to 'publish', stopping at the
+    // first it can't take (that one stays queued). Returns how many went.
+    uint8_t drain(uint8_t batch, publishCallback publish) {
+        T record;
+        uint8_t sent = 0;
+
+        while (sent < batch && peek(record)) {
+            if (!publish(record)) {
+                break;
+            }
+
+            pop();
+            sent++;
+        }
+
+        commit();
+        return sent;
+    }
+
+    // Move everything to flash, e.g. before a restart
+    void persist() {
+        _spillOldest(_count);
+    }
+
+    // Write any pending flash changes, pops are batched up to save wear
+    void commit(bool force = false) {
+        if (!_dirty && !force) {
+            return;
+        }
+
+        EEPROM.put(_offset, _spill);
+        EEPROM.commit();
+        _dirty = false;
+    }
+
+    uint32_t drops = 0;
+
+private:
+    constexpr static const uint8_t MAGIC = 0x7E;
+
+    struct spillHeader_t {
+        uint8_t magic;
+        uint8_t recordSize;
+        uint16_t head;
+        uint16_t count;
+        uint16_t reserved2;
+        uint32_t epoch;
+    };
+
+    int _recordOffset(uint16_t index) {
+        return _offset + sizeof(spillHeader_t) + (index * sizeof(T));
+    }
+
+    void _spillOldest(uint8_t records) {
+        if (_spillSize == 0) {
+            // No flash to spill to, drop instead
+            _head = (_head + records) % RAM_SIZE;
+            _count -= records;
+            drops += records;
+            return;
+        }
+
+        for (uint8_t i = 0; i < records; i++) {
+            if (_spill.count == _spillSize) {
+                // Flash is full too, lose the oldest
+                _spill.head = (_spill.head + 1) % _spillSize;
+                _spill.count--;
+                drops++;
+            }
+
+            EEPROM.put(_recordOffset((_spill.head + _spill.count) % _spillSize), _ram[_head]);
+            _spill.count++;
+
+            _head = (_head + 1) % RAM_SIZE;
+            _count--;
+        }
+
+        commit(true);
+    }
+
+    int _offset;
+    uint16_t _spillSize;
+    spillHeader_t _spill;
+    bool _dirty = false;
+
+    T _ram[RAM_SIZE];
+    uint8_t _head = 0;
+    uint8_t _count = 0;
+};
@@ -1,10 +1,87 @@
 #pragma once
 
+#if defined(ARDUINO)
 #include <Arduino.h>
+#else
+// Linux gateway build
+#include <stdint.h>
+typedef bool boolean;
+#endif
+
+// Number of PM1006 sensors on this controller
+#if !defined(PM_SENSOR_COUNT)
+#define PM_SENSOR_COUNT         1
+#endif
 
 struct particleSensorState_t {
     uint16_t avgPM25 = 0;
     uint16_t measurements[5] = {0, 0, 0, 0, 0};
     uint8_t measurementIdx = 0;
     boolean valid = false;
-};
\ No newline at end of file
+
+    // Most recent (un-averaged) reading
+    uint16_t latest() const {
+        return measurements[(measurementIdx + 4) % 5];
+    }
+};
+
+// Applied config, snapshotted to flash and RTC memory for fast restarts
+struct configSnapshot_t {
+    uint32_t updateMs;
+    uint32_t fadeIntervalUs;
+    uint32_t autoFadeIntervalUs;
+    uint8_t autoBrightness;
+    uint8_t ledMode;
+    uint8_t payloadEncoding;
+    uint8_t retainedMetrics;
+    uint16_t stallThresholdMs;
+};
+
+// Optional id sent with a command, echoed back in its ack
+#define CORRELATION_ID_SIZE     24
+
+// Everything needed to resume after a warm restart, kept in RTC memory
+struct rtcState_t {
+    uint32_t magic;
+    uint32_t crc;
+    configSnapshot_t config;
+    particleSensorState_t sensor;
+    uint8_t ledState;
+    uint8_t ledColour[12];
+    uint8_t wifiBssid[6];
+    int32_t wifiChannel;
+    uint32_t clockMs;       // device clock, carried across warm restarts
+    uint32_t epoch;         // random id, changes on every cold boot
+    char restartCorrelationId[CORRELATION_ID_SIZE];     // restart command to ack once we're back
+    uint32_t restartReceivedMs;
+};
+
+// Timings of a command with a correlationId, acked once it has been
+// applied (and shown on the LEDs, or the device is back after a restart)
+struct commandAck_t {
+    char correlationId[CORRELATION_ID_SIZE];
+    uint32_t receivedMs;    // device clock
+    uint32_t receivedUs;
+    uint32_t applyUs;       // receive -> applied
+    uint32_t showUs;        // receive -> first LED frame with the change
+    uint32_t showCount;     // LED frames shown when applied
+    bool awaitingShow;
+    bool awaitingRestart;
+};
+
+// Sensors present in a telemetry reading
+#define TELE_HAS_TEMPERATURE    0x01
+#define TELE_HAS_HUMIDITY       0x02
+#define TELE_HAS_LUX            0x04
+#define TELE_HAS_PM_SENSOR(i)   (0x10 << (i))
+
+// A single time-aligned telemetry reading - PM plus the I2C sensors read
+// on the same PM frame. Also what gets queued while MQTT is down.
+struct teleReading_t {
+    uint32_t ms;            // device clock when the reading was taken
+    uint16_t pm25[PM_SENSOR_COUNT];     // averaged, one per sensor
+    uint16_t flags;         // TELE_HAS_xxx
+    int16_t temperature;    // hundredths of a degree
+    uint16_t humidity;      // hundredths of a percent
+    uint32_t lux;
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+// Just enough of Arduino.h for the headers under test to build on the host
+
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+// No separate flash address space on the host
+class __FlashStringHelper;
+#define F(string) (reinterpret_cast<const __FlashStringHelper *>(string))
+#define PSTR(string) (string)
+
+// Virtual clock, tests move it along by setting hostMillis
+inline uint32_t hostMillis = 0;
+
+inline unsigned long millis() {
+    return hostMillis;
+}
+
+inline char * ultoa(unsigned long value, char * buffer, int radix) {
+    (void)radix;
+    sprintf(buffer, "%lu", value);
+    return buffer;
+}
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t * buffer, size_t size) {
+        size_t n = 0;
+        while (size--) {
+            n += write(*buffer++);
+        }
+        return n;
+    }
+
+    size_t write(const char * string) {
+        return write((const uint8_t *)string, strlen(string));
+    }
+
+    virtual int availableForWrite() {
+        return 0;
+    }
+
+    size_t print(const char * string) { return write(string); }
+    size_t print(const __FlashStringHelper * string) { return write((const char *)string); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(int value) { return _printf("%d", value); }
+    size_t print(unsigned int value) { return _printf("%u", value); }
+    size_t print(long value) { return _printf("%ld", value); }
+    size_t print(unsigned long value) { return _printf("%lu", value); }
+    size_t print(double value, int digits = 2) { return _printf("%.*f", digits, value); }
+
+    size_t println() { return write("\r\n"); }
+
+    template <typename T>
+    size_t println(T value) {
+        size_t n = print(value);
+        return n + println();
+    }
+
+    size_t println(double value, int digits) {
+        size_t n = print(value, digits);
+        return n + println();
+    }
+
+private:
+    template <typename... A>
+    size_t _printf(const char * format, A... args) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), format, args...);
+        return write(buffer);
+    }
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <Arduino.h>
+
+class IPAddress {};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() = 0;
+
+    void setTimeout(unsigned long timeout) {
+        _timeout = timeout;
+    }
+
+protected:
+    unsigned long _timeout = 1000;
+};
+
+class Client : public Stream {
+public:
+    virtual int connect(IPAddress ip, uint16_t port) = 0;
+    virtual int connect(const char * host, uint16_t port) = 0;
+    virtual size_t write(uint8_t) = 0;
+    virtual size_t write(const uint8_t * buffer, size_t size) = 0;
+    virtual int read(uint8_t * buffer, size_t size) = 0;
+    virtual void stop() = 0;
+    virtual uint8_t connected() = 0;
+    virtual operator bool() = 0;
+
+    using Stream::read;
+};
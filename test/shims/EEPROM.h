@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+// Emulated EEPROM, backed by a plain buffer the tests can inspect or wipe
+class EEPROMClass {
+public:
+    void begin(size_t size) {
+        this->size = size;
+    }
+
+    template <typename T>
+    T& get(int address, T& value) {
+        memcpy(&value, data + address, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    const T& put(int address, const T& value) {
+        memcpy(data + address, &value, sizeof(T));
+        return value;
+    }
+
+    bool commit() {
+        commits++;
+        return true;
+    }
+
+    uint8_t data[4096] = {};
+    size_t size = sizeof(data);
+    uint32_t commits = 0;
+};
+
+inline EEPROMClass EEPROM;
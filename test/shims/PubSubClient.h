@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <Client.h>
+
+// Just the streaming publish API, over a Client. Every complete message
+// is recorded in 'messages'.
+class PubSubClient : public Print {
+public:
+    struct message_t {
+        std::string topic;
+        std::string payload;
+        bool retained;
+    };
+
+    PubSubClient(Client& client) : _client(client) {}
+
+    bool connected() {
+        return _client.connected();
+    }
+
+    bool beginPublish(const char * topic, unsigned int length, bool retained) {
+        if (!connected()) {
+            return false;
+        }
+
+        _current = { topic, "", retained };
+        _length = length;
+        return true;
+    }
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t * buffer, size_t size) override {
+        size_t written = _client.write(buffer, size);
+        _current.payload.append((const char *)buffer, written);
+        return written;
+    }
+
+    using Print::write;
+
+    int endPublish() {
+        if (_current.payload.size() != _length) {
+            return 0;
+        }
+
+        messages.push_back(_current);
+        return 1;
+    }
+
+    std::vector<message_t> messages;
+
+private:
+    Client& _client;
+    message_t _current;
+    size_t _length = 0;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <Arduino.h>
+
+#define SWSERIAL_8N1    0
+
+// Emulated software serial RX, tests inject() what the wire would deliver
+// into the instance begun on a pin, found with onPin(). Bytes which don't fit
+// in the receive buffer are lost and flag an overflow, as on the device.
+class SoftwareSerial {
+public:
+    static SoftwareSerial *& onPin(int8_t rxPin) {
+        static SoftwareSerial * pins[64] = {};
+        return pins[rxPin & 63];
+    }
+
+    void begin(uint32_t baud, int config, int8_t rxPin, int8_t txPin, bool invert, int bufCapacity) {
+        (void)baud; (void)config; (void)txPin; (void)invert;
+        onPin(rxPin) = this;
+        _capacity = bufCapacity < (int)sizeof(_buffer) ? bufCapacity : (int)sizeof(_buffer);
+    }
+
+    int available() {
+        return _count;
+    }
+
+    int read() {
+        if (!_count) {
+            return -1;
+        }
+
+        uint8_t byte = _buffer[_head];
+        _head = (_head + 1) % _capacity;
+        _count--;
+        return byte;
+    }
+
+    bool overflow() {
+        bool overflowed = _overflow;
+        _overflow = false;
+        return overflowed;
+    }
+
+    void inject(const uint8_t * data, size_t length) {
+        while (length--) {
+            if (_count == _capacity) {
+                _overflow = true;
+                data++;
+                continue;
+            }
+
+            _buffer[(_head + _count++) % _capacity] = *data++;
+        }
+    }
+
+private:
+    uint8_t _buffer[256];
+    int _capacity = 0;
+    int _head = 0;
+    int _count = 0;
+    bool _overflow = false;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <Client.h>
+
+// One emulated TCP connection, shared by every copy of its WiFiClient (as
+// the ESP8266's are). Tests play the remote end: send() what it writes,
+// read 'received' and ack() it to free the send buffer.
+struct hostConnection {
+    std::string incoming;           // sent by the remote end, not yet read
+    std::string received;           // written to the remote end
+    size_t sendBuffer = 2920;       // lwIP TCP_SND_BUF
+    size_t unacked = 0;
+    bool open = true;               // remote end still connected
+    bool stopped = false;
+    bool stalled = false;           // remote end never acks, blocking writes time out
+    uint32_t blockingWrites = 0;    // writes bigger than the send buffer had room for
+
+    void send(const std::string& data) {
+        incoming += data;
+    }
+
+    void ack() {
+        unacked = 0;
+    }
+};
+
+class WiFiClient : public Client {
+public:
+    WiFiClient() {}
+    WiFiClient(std::shared_ptr<hostConnection> connection) : _connection(connection) {}
+
+    int connect(IPAddress, uint16_t) override { return 0; }
+    int connect(const char *, uint16_t) override { return 0; }
+
+    void setNoDelay(bool) {}
+
+    int availableForWrite() override {
+        return _live() ? _connection->sendBuffer - _connection->unacked : 0;
+    }
+
+    size_t write(uint8_t c) override {
+        return write(&c, 1);
+    }
+
+    // Waits for room as the ESP8266's does: the remote end acks as it goes
+    // unless stalled, when the write times out part way
+    size_t write(const uint8_t * buffer, size_t size) override {
+        if (!_live()) {
+            return 0;
+        }
+
+        size_t room = availableForWrite();
+        if (size > room) {
+            _connection->blockingWrites++;
+
+            if (_connection->stalled) {
+                size = room;
+            } else {
+                _connection->ack();
+            }
+        }
+
+        _connection->received.append((const char *)buffer, size);
+        _connection->unacked = min(_connection->unacked + size, _connection->sendBuffer);
+        return size;
+    }
+
+    using Print::write;
+
+    int available() override {
+        return _live() ? _connection->incoming.size() : 0;
+    }
+
+    int read() override {
+        uint8_t c;
+        return read(&c, 1) == 1 ? c : -1;
+    }
+
+    int read(uint8_t * buffer, size_t size) override {
+        if (!_live()) {
+            return 0;
+        }
+
+        size_t count = min(size, _connection->incoming.size());
+        memcpy(buffer, _connection->incoming.data(), count);
+        _connection->incoming.erase(0, count);
+        return count;
+    }
+
+    int peek() override {
+        return available() ? (uint8_t)_connection->incoming[0] : -1;
+    }
+
+    void flush() override {}
+
+    void stop() override {
+        if (_connection) {
+            _connection->stopped = true;
+        }
+    }
+
+    uint8_t connected() override {
+        return _live() && _connection->open;
+    }
+
+    operator bool() override {
+        return (bool)_connection;
+    }
+
+private:
+    bool _live() {
+        return _connection && !_connection->stopped;
+    }
+
+    std::shared_ptr<hostConnection> _connection;
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <deque>
+
+#include <WiFiClient.h>
+
+// Connections wait in the backlog until accepted with available()
+class WiFiServer {
+public:
+    WiFiServer(uint16_t port = 80) : port(port) {}
+
+    WiFiClient available() {
+        if (backlog.empty()) {
+            return WiFiClient();
+        }
+
+        WiFiClient client(backlog.front());
+        backlog.pop_front();
+        return client;
+    }
+
+    std::shared_ptr<hostConnection> connect() {
+        auto connection = std::make_shared<hostConnection>();
+        backlog.push_back(connection);
+        return connection;
+    }
+
+    uint16_t port;
+    std::deque<std::shared_ptr<hostConnection>> backlog;
+};
@@ -0,0 +1,189 @@
+#include <unity.h>
+#include <stdlib.h>
+
+#include <alerts.h>
+
+// PM1006 frames, about a second apart
+#define FRAME_MS        1000
+
+struct event_t {
+    uint8_t index;
+    bool triggered;
+    uint16_t pm25;
+    int32_t ratePerMinute;
+};
+
+static alerts rules;
+static event_t events[64];
+static uint8_t eventCount;
+static uint32_t nowMs;
+
+static void onAlert(uint8_t index, bool triggered, uint16_t pm25, int32_t ratePerMinute) {
+    if (eventCount < 64) {
+        events[eventCount++] = { index, triggered, pm25, ratePerMinute };
+    }
+}
+
+static void frame(uint16_t pm25) {
+    nowMs += FRAME_MS;
+    rules.evaluate(pm25, nowMs);
+}
+
+static alertRule_t threshold(uint16_t level, uint16_t hysteresis, uint32_t cooldownMs = 0) {
+    alertRule_t rule = {};
+    rule.threshold = level;
+    rule.hysteresis = hysteresis;
+    rule.cooldownMs = cooldownMs;
+    return rule;
+}
+
+static alertRule_t rise(uint16_t ratePerMinute, uint16_t rateHysteresis) {
+    alertRule_t rule = {};
+    rule.riseRatePerMinute = ratePerMinute;
+    rule.rateHysteresis = rateHysteresis;
+    return rule;
+}
+
+void setUp() {
+    rules = alerts();
+    rules.onAlert(onAlert);
+    eventCount = 0;
+    nowMs = 100000;
+}
+
+void tearDown() {}
+
+void test_threshold_trigger_and_clear_with_hysteresis() {
+    rules.add(threshold(50, 10));
+
+    frame(40);
+    frame(49);
+    TEST_ASSERT_EQUAL_UINT8(0, eventCount);
+
+    frame(50);
+    TEST_ASSERT_EQUAL_UINT8(1, eventCount);
+    TEST_ASSERT_TRUE(events[0].triggered);
+    TEST_ASSERT_EQUAL_UINT16(50, events[0].pm25);
+
+    // Still within the hysteresis band
+    frame(45);
+    frame(41);
+    TEST_ASSERT_EQUAL_UINT8(1, eventCount);
+
+    frame(39);
+    TEST_ASSERT_EQUAL_UINT8(2, eventCount);
+    TEST_ASSERT_FALSE(events[1].triggered);
+}
+
+void test_rate_trigger() {
+    rules.add(rise(60, 20));
+
+    // Steady then climbing 5 ug/m3 a second, 300/min
+    for (uint8_t i = 0; i < 30; i++) {
+        frame(20);
+    }
+    TEST_ASSERT_EQUAL_UINT8(0, eventCount);
+
+    uint16_t pm25 = 20;
+    while (eventCount == 0 && pm25 < 200) {
+        frame(pm25 += 5);
+    }
+
+    TEST_ASSERT_EQUAL_UINT8(1, eventCount);
+    TEST_ASSERT_TRUE(events[0].triggered);
+    TEST_ASSERT_TRUE(events[0].ratePerMinute >= 60);
+    // Within a few frames, not a whole window
+    TEST_ASSERT_TRUE(pm25 <= 40);
+}
+
+void test_jitter_does_not_trigger_rate() {
+    rules.add(rise(60, 20));
+    srand(1);
+
+    // +-2 ug/m3 of frame to frame noise, which is +-120/min raw
+    for (uint16_t i = 0; i < 600; i++) {
+        frame(30 + rand() % 5 - 2);
+    }
+
+    TEST_ASSERT_EQUAL_UINT8(0, eventCount);
+}
+
+void test_rate_clears_with_its_own_hysteresis() {
+    // A PM hysteresis bigger than the rate limit mustn't hold the rate open
+    alertRule_t rule = rise(60, 10);
+    rule.hysteresis = 500;
+    rules.add(rule);
+
+    uint16_t pm25 = 20;
+    while (eventCount == 0) {
+        frame(pm25 += 5);
+    }
+
+    // Level off, the smoothed rate decays below 50/min and clears
+    for (uint8_t i = 0; i < 120 && eventCount == 1; i++) {
+        frame(pm25);
+    }
+
+    TEST_ASSERT_EQUAL_UINT8(2, eventCount);
+    TEST_ASSERT_FALSE(events[1].triggered);
+    TEST_ASSERT_TRUE(events[1].ratePerMinute < 50);
+}
+
+void test_cooldown_suppresses_retrigger() {
+    rules.add(threshold(50, 0, 60000));
+
+    frame(60);
+    frame(40);
+    TEST_ASSERT_EQUAL_UINT8(2, eventCount);
+
+    // Back over within the cooldown
+    frame(60);
+    TEST_ASSERT_EQUAL_UINT8(2, eventCount);
+
+    nowMs += 60000;
+    frame(60);
+    TEST_ASSERT_EQUAL_UINT8(3, eventCount);
+    TEST_ASSERT_TRUE(events[2].triggered);
+}
+
+void test_rules_independent() {
+    rules.add(threshold(50, 5));
+    rules.add(threshold(100, 5));
+
+    frame(70);
+    TEST_ASSERT_EQUAL_UINT8(1, eventCount);
+    TEST_ASSERT_EQUAL_UINT8(0, events[0].index);
+
+    frame(120);
+    TEST_ASSERT_EQUAL_UINT8(2, eventCount);
+    TEST_ASSERT_EQUAL_UINT8(1, events[1].index);
+}
+
+void test_add_beyond_max_rules() {
+    for (uint8_t i = 0; i < ALERT_MAX_RULES; i++) {
+        TEST_ASSERT_TRUE(rules.add(threshold(10 + i, 0)));
+    }
+
+    TEST_ASSERT_FALSE(rules.add(threshold(5, 0)));
+    TEST_ASSERT_EQUAL_UINT8(ALERT_MAX_RULES, rules.count());
+
+    // The rejected rule never fires
+    frame(9);
+    TEST_ASSERT_EQUAL_UINT8(0, eventCount);
+
+    rules.clear();
+    TEST_ASSERT_EQUAL_UINT8(0, rules.count());
+    TEST_ASSERT_TRUE(rules.add(threshold(5, 0)));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_threshold_trigger_and_clear_with_hysteresis);
+    RUN_TEST(test_rate_trigger);
+    RUN_TEST(test_jitter_does_not_trigger_rate);
+    RUN_TEST(test_rate_clears_with_its_own_hysteresis);
+    RUN_TEST(test_cooldown_suppresses_retrigger);
+    RUN_TEST(test_rules_independent);
+    RUN_TEST(test_add_beyond_max_rules);
+    return UNITY_END();
+}
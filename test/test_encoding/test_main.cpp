@@ -0,0 +1,155 @@
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+
+#include <ArduinoJson.h>
+#include <fields.h>
+
+// JSON vs MessagePack for the payloads we publish - bytes on the wire and
+// serialize time, as queueJson() does it (measure, then serialize in place)
+#define BENCH_ITERATIONS    20000
+
+static uint8_t buffer[8192];
+
+struct result_t {
+    size_t bytes;
+    double nsPerMessage;
+};
+
+template <typename Measure, typename Serialize>
+static result_t bench(JsonVariantConst json, Measure measure, Serialize serialize) {
+    size_t bytes = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < BENCH_ITERATIONS; i++) {
+        bytes = measure(json);
+        serialize(json, bytes);
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return { bytes, elapsed * 1e9 / BENCH_ITERATIONS };
+}
+
+static result_t benchJson(JsonVariantConst json) {
+    return bench(json,
+        [](JsonVariantConst j) { return measureJson(j); },
+        [](JsonVariantConst j, size_t length) { serializeJson(j, (char *)buffer, length + 1); });
+}
+
+static result_t benchMsgPack(JsonVariantConst json) {
+    return bench(json,
+        [](JsonVariantConst j) { return measureMsgPack(j); },
+        [](JsonVariantConst j, size_t length) { serializeMsgPack(j, buffer, length); });
+}
+
+static void report(const char * name, JsonVariantConst json) {
+    result_t text = benchJson(json);
+    result_t binary = benchMsgPack(json);
+
+    char message[160];
+    snprintf(message, sizeof(message), "%s: json %u bytes %.0f ns, msgpack %u bytes %.0f ns (%.0f%% of the bytes)",
+        name, (unsigned)text.bytes, text.nsPerMessage, (unsigned)binary.bytes, binary.nsPerMessage, 100.0 * binary.bytes / text.bytes);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_LESS_THAN(text.bytes, binary.bytes);
+}
+
+// Same shape as publishReading()
+static void telemetry(JsonDocument& json, uint8_t sensors, bool backlog) {
+    json["pm25"] = 12;
+
+    if (sensors > 1) {
+        JsonArray list = json.createNestedArray("sensors");
+        for (uint8_t i = 0; i < sensors; i++) {
+            JsonObject sensor = list.createNestedObject();
+            sensor["index"] = i + 1;
+            sensor["pm25"] = 12 + i;
+        }
+    }
+
+    json["temperature"] = 2150 / 100.0f;
+    json["humidity"] = 4725 / 100.0f;
+    json["lux"] = 312;
+
+    if (backlog) {
+        json["ageMs"] = 183000;
+    }
+}
+
+// A schema from a field table, as the adoption payload is built
+static const char * const MODES[] = { "auto", "manual", "animation" };
+static const char * const STATES[] = { "off", "on" };
+
+static const fields::field_t ledFields[] = {
+    fields::enumeration("mode", MODES, FIELD_COUNT(MODES), nullptr, nullptr, nullptr, true),
+    fields::enumeration("state", STATES, FIELD_COUNT(STATES), nullptr),
+    fields::colour("pixel1", 4, nullptr, 0),
+    fields::colour("pixel2", 4, nullptr, 1),
+    fields::colour("pixel3", 4, nullptr, 2),
+    fields::integer("fadeIntervalUs", 0, FIELD_NO_MAXIMUM, nullptr),
+};
+static const fields::table_t ledTable = { ledFields, FIELD_COUNT(ledFields), nullptr, nullptr };
+
+static const fields::field_t commandFields[] = {
+    fields::objectArray("LED", 0, &ledTable, nullptr, nullptr,
+        "Set the operation of Neopixels - auto will have the leds act like the one ikea had built in show green, yellow, red."),
+    fields::flag("restart", nullptr),
+    fields::string("correlationId", 23, nullptr, nullptr,
+        "Optional id for this command, echoed back in an ack status event with the time taken to apply it"),
+};
+static const fields::table_t commandTable = { commandFields, FIELD_COUNT(commandFields), nullptr, nullptr };
+
+void setUp() {}
+void tearDown() {}
+
+void test_msgpack_round_trip() {
+    DynamicJsonDocument json(512);
+    telemetry(json, 4, true);
+
+    size_t length = measureMsgPack(json);
+    TEST_ASSERT_EQUAL_size_t(length, serializeMsgPack(json, buffer, sizeof(buffer)));
+
+    DynamicJsonDocument decoded(512);
+    TEST_ASSERT_TRUE(deserializeMsgPack(decoded, (const char *)buffer, length) == DeserializationError::Ok);
+
+    TEST_ASSERT_EQUAL_INT(12, decoded["pm25"].as<int>());
+    TEST_ASSERT_EQUAL_INT(4, decoded["sensors"].size());
+    TEST_ASSERT_EQUAL_INT(15, decoded["sensors"][3]["pm25"].as<int>());
+    TEST_ASSERT_EQUAL_INT(2150, (int)(decoded["temperature"].as<float>() * 100.0f + 0.5f));
+    TEST_ASSERT_EQUAL_UINT32(183000, decoded["ageMs"].as<uint32_t>());
+}
+
+void test_benchmark_telemetry() {
+    DynamicJsonDocument json(192);
+    telemetry(json, 1, false);
+    report("telemetry", json.as<JsonVariantConst>());
+}
+
+void test_benchmark_backlog_telemetry_4_sensors() {
+    DynamicJsonDocument json(512);
+    telemetry(json, 4, true);
+    report("backlog telemetry, 4 sensors", json.as<JsonVariantConst>());
+}
+
+void test_benchmark_command_schema() {
+    DynamicJsonDocument json(4096);
+    JsonObject schema = json.createNestedObject("commandSchema");
+    schema["$schema"] = "http://json-schema.org/draft-07/schema#";
+    schema["title"] = "OXRS vindriktning";
+    schema["type"] = "object";
+    fields::schema(schema.createNestedObject("properties"), commandTable);
+
+    TEST_ASSERT_FALSE(json.overflowed());
+    TEST_ASSERT_EQUAL_STRING("mode", json["commandSchema"]["properties"]["LED"]["items"]["required"][0].as<const char *>());
+
+    report("command schema", json.as<JsonVariantConst>());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_msgpack_round_trip);
+    RUN_TEST(test_benchmark_telemetry);
+    RUN_TEST(test_benchmark_backlog_telemetry_4_sensors);
+    RUN_TEST(test_benchmark_command_schema);
+    return UNITY_END();
+}
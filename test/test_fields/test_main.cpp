@@ -0,0 +1,285 @@
+#include <unity.h>
+#include <string>
+#include <vector>
+
+#include <ArduinoJson.h>
+#include <fields.h>
+
+// What dispatch() handed to the handlers, in order
+struct call_t {
+    std::string field;
+    int32_t number;
+    uint8_t arg;
+};
+
+static std::vector<call_t> calls;
+static uint8_t begins;
+static uint8_t ends;
+static uint8_t beginsAllowed;
+
+// Collects what the parser logs
+class logPrint : public Print {
+public:
+    size_t write(uint8_t c) override {
+        text += (char)c;
+        return 1;
+    }
+
+    using Print::write;
+
+    std::string text;
+};
+
+static logPrint parserLog;
+
+#define HANDLER(name) \
+    static void name(JsonVariant, int32_t number, uint8_t arg) { calls.push_back({ #name, number, arg }); }
+
+HANDLER(level)
+HANDLER(enabled)
+HANDLER(mode)
+HANDLER(id)
+HANDLER(pixel)
+HANDLER(items)
+HANDLER(duration)
+HANDLER(glbvs)
+HANDLER(yacxa)
+
+static bool beginItem() {
+    begins++;
+    return begins <= beginsAllowed;
+}
+
+static void endItem() {
+    ends++;
+}
+
+static const char * const MODES[] = { "auto", "manual" };
+
+static const fields::field_t itemFields[] = {
+    fields::enumeration("mode", MODES, FIELD_COUNT(MODES), mode, nullptr, nullptr, true),
+    fields::integer("duration", 0, 1000, duration),
+    fields::colour("pixel", 4, pixel, 2),
+};
+static const fields::table_t itemTable = { itemFields, FIELD_COUNT(itemFields), beginItem, endItem };
+
+// "glbvs" and "yacxa" have the same FNV-1a hash
+static_assert(fields::fnv1a("glbvs") == fields::fnv1a("yacxa"), "not a collision");
+
+static const fields::field_t rootFields[] = {
+    fields::integer("level", -10, 100, level),
+    fields::flag("enabled", enabled),
+    fields::enumeration("mode", MODES, FIELD_COUNT(MODES), mode),
+    fields::string("id", 8, id),
+    fields::colour("pixel", 3, pixel, 1),
+    fields::objectArray("items", 2, &itemTable, items),
+    fields::object("item", &itemTable, nullptr),
+    fields::integer("glbvs", 0, 10, glbvs),
+    fields::integer("yacxa", 0, 10, yacxa),
+};
+static const fields::table_t rootTable = { rootFields, FIELD_COUNT(rootFields), nullptr, nullptr };
+
+static void dispatch(const char * payload) {
+    DynamicJsonDocument json(2048);
+    TEST_ASSERT_TRUE(deserializeJson(json, payload) == DeserializationError::Ok);
+    fields::dispatch(json.as<JsonObject>(), rootTable, parserLog);
+}
+
+static bool logged(const char * name) {
+    return parserLog.text.find(std::string("[AQS] invalid ") + name) != std::string::npos;
+}
+
+void setUp() {
+    calls.clear();
+    parserLog.text.clear();
+    begins = 0;
+    ends = 0;
+    beginsAllowed = 255;
+}
+
+void tearDown() {}
+
+void test_integer_in_range() {
+    dispatch("{\"level\": -10}");
+    dispatch("{\"level\": 100}");
+
+    TEST_ASSERT_EQUAL_UINT32(2, calls.size());
+    TEST_ASSERT_EQUAL_INT32(-10, calls[0].number);
+    TEST_ASSERT_EQUAL_INT32(100, calls[1].number);
+    TEST_ASSERT_TRUE(parserLog.text.empty());
+}
+
+void test_integer_out_of_range_or_wrong_type() {
+    dispatch("{\"level\": -11}");
+    dispatch("{\"level\": 101}");
+    dispatch("{\"level\": \"5\"}");
+    dispatch("{\"level\": 2.5}");
+    dispatch("{\"enabled\": 1}");
+
+    TEST_ASSERT_EQUAL_UINT32(0, calls.size());
+    TEST_ASSERT_TRUE(logged("level"));
+    TEST_ASSERT_TRUE(logged("enabled"));
+}
+
+void test_enum() {
+    dispatch("{\"mode\": \"manual\"}");
+    TEST_ASSERT_EQUAL_UINT32(1, calls.size());
+    TEST_ASSERT_EQUAL_INT32(1, calls[0].number);
+
+    dispatch("{\"mode\": \"Manual\"}");
+    dispatch("{\"mode\": 1}");
+    TEST_ASSERT_EQUAL_UINT32(1, calls.size());
+    TEST_ASSERT_TRUE(logged("mode"));
+}
+
+void test_string_max_length() {
+    // Handlers copy into a buffer of maxLength + 1, over long must not get through
+    dispatch("{\"id\": \"12345678\"}");
+    TEST_ASSERT_EQUAL_UINT32(1, calls.size());
+    TEST_ASSERT_EQUAL_INT32(8, calls[0].number);
+
+    dispatch("{\"id\": \"123456789\"}");
+    dispatch("{\"id\": 12}");
+    TEST_ASSERT_EQUAL_UINT32(1, calls.size());
+    TEST_ASSERT_TRUE(logged("id"));
+}
+
+void test_colour_channels() {
+    dispatch("{\"pixel\": [0, 128, 255]}");
+    TEST_ASSERT_EQUAL_UINT32(1, calls.size());
+    TEST_ASSERT_EQUAL_INT32(3, calls[0].number);
+    TEST_ASSERT_EQUAL_UINT8(1, calls[0].arg);
+
+    // Out of range, wrong type, too many items
+    dispatch("{\"pixel\": [0, 300, 0]}");
+    dispatch("{\"pixel\": [-1]}");
+    dispatch("{\"pixel\": [\"red\"]}");
+    dispatch("{\"pixel\": [1.5]}");
+    dispatch("{\"pixel\": [1, 2, 3, 4]}");
+    dispatch("{\"pixel\": 7}");
+
+    TEST_ASSERT_EQUAL_UINT32(1, calls.size());
+    TEST_ASSERT_TRUE(logged("pixel"));
+}
+
+void test_object_array_items() {
+    dispatch("{\"items\": [{\"mode\": \"auto\", \"duration\": 5}, {\"mode\": \"manual\", \"pixel\": [1, 2]}]}");
+
+    TEST_ASSERT_EQUAL_UINT8(2, begins);
+    TEST_ASSERT_EQUAL_UINT8(2, ends);
+
+    static const char * const order[] = { "items", "mode", "duration", "mode", "pixel" };
+    TEST_ASSERT_EQUAL_UINT32(5, calls.size());
+    for (uint8_t i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL_STRING(order[i], calls[i].field.c_str());
+    }
+    TEST_ASSERT_EQUAL_INT32(2, calls[0].number);
+    // Each colour field's own arg
+    TEST_ASSERT_EQUAL_UINT8(2, calls[4].arg);
+}
+
+void test_object_array_max_items() {
+    dispatch("{\"items\": [{\"mode\": \"auto\"}, {\"mode\": \"auto\"}, {\"mode\": \"auto\"}]}");
+
+    TEST_ASSERT_EQUAL_UINT32(0, calls.size());
+    TEST_ASSERT_EQUAL_UINT8(0, begins);
+    TEST_ASSERT_TRUE(logged("items"));
+}
+
+void test_nested_object() {
+    dispatch("{\"item\": {\"mode\": \"auto\", \"duration\": 10}}");
+
+    TEST_ASSERT_EQUAL_UINT8(1, begins);
+    TEST_ASSERT_EQUAL_UINT8(1, ends);
+    TEST_ASSERT_EQUAL_UINT32(2, calls.size());
+    TEST_ASSERT_EQUAL_INT32(10, calls[1].number);
+}
+
+void test_begin_false_skips_object() {
+    beginsAllowed = 1;
+    dispatch("{\"items\": [{\"mode\": \"auto\"}, {\"mode\": \"manual\", \"duration\": 5}]}");
+
+    // The second item is skipped whole, end() isn't called for it
+    TEST_ASSERT_EQUAL_UINT8(2, begins);
+    TEST_ASSERT_EQUAL_UINT8(1, ends);
+    TEST_ASSERT_EQUAL_UINT32(2, calls.size());
+    TEST_ASSERT_EQUAL_STRING("items", calls[0].field.c_str());
+    TEST_ASSERT_EQUAL_INT32(0, calls[1].number);
+}
+
+void test_required_field_missing() {
+    dispatch("{\"items\": [{\"duration\": 5}, {\"mode\": \"manual\"}]}");
+
+    // Only the item with a mode is handled, begin() never sees the other
+    TEST_ASSERT_EQUAL_UINT8(1, begins);
+    TEST_ASSERT_EQUAL_UINT32(2, calls.size());
+    TEST_ASSERT_EQUAL_STRING("mode", calls[1].field.c_str());
+    TEST_ASSERT_TRUE(logged("mode"));
+
+    dispatch("{\"item\": {\"duration\": 5}}");
+    TEST_ASSERT_EQUAL_UINT8(1, begins);
+}
+
+void test_unknown_keys_ignored() {
+    dispatch("{\"temperature\": 5, \"levels\": 1, \"items\": [{\"mode\": \"auto\", \"colour\": [1]}]}");
+
+    TEST_ASSERT_EQUAL_UINT32(2, calls.size());
+    TEST_ASSERT_TRUE(parserLog.text.empty());
+}
+
+void test_hash_collision() {
+    dispatch("{\"yacxa\": 3}");
+    dispatch("{\"glbvs\": 4}");
+
+    TEST_ASSERT_EQUAL_UINT32(2, calls.size());
+    TEST_ASSERT_EQUAL_STRING("yacxa", calls[0].field.c_str());
+    TEST_ASSERT_EQUAL_INT32(3, calls[0].number);
+    TEST_ASSERT_EQUAL_STRING("glbvs", calls[1].field.c_str());
+    TEST_ASSERT_EQUAL_INT32(4, calls[1].number);
+}
+
+void test_schema_publishes_what_is_enforced() {
+    DynamicJsonDocument json(4096);
+    fields::schema(json.createNestedObject("properties"), rootTable);
+    JsonObject properties = json["properties"];
+
+    TEST_ASSERT_EQUAL_INT32(2, properties["items"]["maxItems"].as<int32_t>());
+    TEST_ASSERT_EQUAL_STRING("mode", properties["items"]["items"]["required"][0].as<const char *>());
+    TEST_ASSERT_EQUAL_STRING("mode", properties["item"]["required"][0].as<const char *>());
+    TEST_ASSERT_EQUAL_INT32(3, properties["pixel"]["maxItems"].as<int32_t>());
+    TEST_ASSERT_EQUAL_INT32(255, properties["pixel"]["items"]["maximum"].as<int32_t>());
+    TEST_ASSERT_EQUAL_INT32(8, properties["id"]["maxLength"].as<int32_t>());
+}
+
+void test_schema_one_property() {
+    // A property at a time matches the same property built with the rest
+    DynamicJsonDocument whole(4096);
+    fields::schema(whole.to<JsonObject>(), rootTable);
+
+    for (uint8_t i = 0; i < rootTable.count; i++) {
+        DynamicJsonDocument one(1024);
+        fields::schema(one.to<JsonObject>(), rootTable, i);
+
+        TEST_ASSERT_EQUAL_UINT32(1, one.as<JsonObject>().size());
+        TEST_ASSERT_TRUE(one[rootFields[i].name] == whole[rootFields[i].name]);
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_integer_in_range);
+    RUN_TEST(test_integer_out_of_range_or_wrong_type);
+    RUN_TEST(test_enum);
+    RUN_TEST(test_string_max_length);
+    RUN_TEST(test_colour_channels);
+    RUN_TEST(test_object_array_items);
+    RUN_TEST(test_object_array_max_items);
+    RUN_TEST(test_nested_object);
+    RUN_TEST(test_begin_false_skips_object);
+    RUN_TEST(test_required_field_missing);
+    RUN_TEST(test_unknown_keys_ignored);
+    RUN_TEST(test_hash_collision);
+    RUN_TEST(test_schema_publishes_what_is_enforced);
+    RUN_TEST(test_schema_one_property);
+    return UNITY_END();
+}
@@ -0,0 +1,309 @@
+#include <unity.h>
+#include <string>
+
+#include <httpPool.h>
+
+// Streamed test responses, parts of PART_SIZE bytes each
+#define PART_SIZE       1000
+#define STREAM_PARTS    20
+
+static WiFiServer server(80);
+static httpPool * pool;
+
+static std::string cannedResponse;
+static uint16_t streamParts;
+static bool detach;
+static bool readFirst;
+
+static const char GET_STREAM[] = "GET /stream HTTP/1.1\r\nHost: aqs\r\n\r\n";
+static const char GET_CANNED[] = "GET /canned HTTP/1.1\r\nHost: aqs\r\n\r\n";
+
+// Part n is PART_SIZE copies of 'a' + n, so order and completeness show
+static bool streamer(Print& out, uint16_t part) {
+    if (part >= streamParts) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < PART_SIZE; i++) {
+        out.write((uint8_t)('a' + part % 26));
+    }
+    return true;
+}
+
+static std::string streamed(uint16_t parts) {
+    std::string expected;
+    for (uint16_t part = 0; part < parts; part++) {
+        expected.append(PART_SIZE, (char)('a' + part % 26));
+    }
+    return expected;
+}
+
+static void handler(httpRequest_t& request) {
+    if (detach) {
+        request.detach();
+    } else if (request.isGet("/stream")) {
+        request.stream(streamer);
+    } else if (readFirst) {
+        // Read the whole request, then respond with just the canned response
+        httpBufferedClient client(request);
+        while (client.read() >= 0) {
+        }
+        client.print(cannedResponse.c_str());
+    } else {
+        // Echo the request back, after the canned response, through the
+        // buffered client as the REST API would
+        httpBufferedClient client(request);
+        client.print(cannedResponse.c_str());
+
+        uint8_t buffer[64];
+        int count;
+        while ((count = client.read(buffer, sizeof(buffer))) > 0) {
+            client.write(buffer, count);
+        }
+    }
+}
+
+// loop() with the remote end reading everything between passes
+static void run(uint32_t loops, std::shared_ptr<hostConnection> connection = nullptr) {
+    for (uint32_t i = 0; i < loops; i++) {
+        pool->loop();
+        hostMillis += 10;
+
+        if (connection) {
+            connection->ack();
+        }
+    }
+}
+
+void setUp() {
+    hostMillis = 0;
+    server.backlog.clear();
+
+    delete pool;
+    pool = new httpPool(server);
+    pool->onRequest(handler);
+
+    cannedResponse = "HTTP/1.1 200 OK\r\n\r\n";
+    streamParts = STREAM_PARTS;
+    detach = false;
+    readFirst = false;
+}
+
+void tearDown() {}
+
+void test_request_split_across_loops() {
+    auto connection = server.connect();
+    std::string request(GET_CANNED);
+
+    connection->send(request.substr(0, 10));
+    run(3);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->requests);
+    TEST_ASSERT_EQUAL_UINT8(1, pool->active());
+
+    connection->send(request.substr(10));
+    run(5, connection);
+
+    TEST_ASSERT_EQUAL_UINT32(1, pool->requests);
+    TEST_ASSERT_EQUAL_STRING((cannedResponse + request).c_str(), connection->received.c_str());
+    TEST_ASSERT_TRUE(connection->stopped);
+    TEST_ASSERT_EQUAL_UINT8(0, pool->active());
+}
+
+void test_streamed_response_without_blocking() {
+    auto connection = server.connect();
+    connection->send(GET_STREAM);
+
+    // 20KB through a 2KB slot buffer and a 2920 byte send buffer
+    run(100, connection);
+
+    TEST_ASSERT_EQUAL_UINT32(STREAM_PARTS * PART_SIZE, connection->received.size());
+    TEST_ASSERT_TRUE(streamed(STREAM_PARTS) == connection->received);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->blockingWrites);
+    TEST_ASSERT_EQUAL_UINT32(0, connection->blockingWrites);
+    TEST_ASSERT_TRUE(connection->stopped);
+}
+
+void test_stream_waits_for_slow_client() {
+    auto connection = server.connect();
+    connection->send(GET_STREAM);
+
+    // The client reads nothing, the pool writes no more than it has room
+    // for and renders no more parts than it has sent
+    run(20);
+    TEST_ASSERT_EQUAL_UINT32(connection->sendBuffer, connection->received.size());
+    TEST_ASSERT_EQUAL_UINT32(0, connection->blockingWrites);
+    TEST_ASSERT_EQUAL_UINT32(3 * PART_SIZE - connection->sendBuffer, pool->bytes());
+
+    run(100, connection);
+    TEST_ASSERT_TRUE(streamed(STREAM_PARTS) == connection->received);
+    TEST_ASSERT_EQUAL_UINT32(0, connection->blockingWrites);
+}
+
+void test_oversized_response_spills() {
+    // A buffered response bigger than the slot buffer goes out as it fills
+    cannedResponse = std::string(5000, 'x');
+
+    auto connection = server.connect();
+    connection->send(GET_CANNED);
+    run(10, connection);
+
+    TEST_ASSERT_TRUE(pool->blockingWrites > 0);
+    TEST_ASSERT_TRUE(cannedResponse + GET_CANNED == connection->received);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->timeouts);
+}
+
+void test_response_reuses_request_space() {
+    // A request near the limit, then a response filling the buffer
+    readFirst = true;
+    cannedResponse = std::string(HTTP_SLOT_BUFFER_SIZE, 'r');
+
+    std::string body(1200, '{');
+    std::string request = "POST /api HTTP/1.1\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+    TEST_ASSERT_TRUE(request.size() > HTTP_SLOT_BUFFER_SIZE - 512);
+
+    auto connection = server.connect();
+    connection->send(request);
+    run(10, connection);
+
+    TEST_ASSERT_EQUAL_UINT32(1, pool->requests);
+    TEST_ASSERT_TRUE(cannedResponse == connection->received);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->blockingWrites);
+    TEST_ASSERT_EQUAL_UINT32(0, connection->blockingWrites);
+}
+
+void test_response_before_request_read() {
+    // Written while the request is still being read goes after it, and is
+    // moved down intact once the last of the request has been read
+    std::string body(300, 'b');
+    std::string request = "POST /api HTTP/1.1\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+
+    auto connection = server.connect();
+    connection->send(request);
+    run(10, connection);
+
+    TEST_ASSERT_TRUE(cannedResponse + request == connection->received);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->blockingWrites);
+}
+
+void test_failed_spill_drops_client() {
+    cannedResponse = std::string(5000, 'x');
+
+    auto connection = server.connect();
+    connection->stalled = true;
+    connection->send(GET_CANNED);
+    run(10);
+
+    TEST_ASSERT_EQUAL_UINT32(1, pool->timeouts);
+    TEST_ASSERT_TRUE(connection->stopped);
+    TEST_ASSERT_EQUAL_UINT8(0, pool->active());
+}
+
+void test_request_too_large() {
+    auto connection = server.connect();
+    connection->send("POST /api HTTP/1.1\r\nContent-Length: 4000\r\n\r\n" + std::string(HTTP_REQUEST_MAX_BYTES, '{'));
+    run(10, connection);
+
+    TEST_ASSERT_EQUAL_UINT32(1, pool->rejected);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->requests);
+    TEST_ASSERT_EQUAL_STRING("HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", connection->received.c_str());
+}
+
+void test_slowloris_evicted() {
+    auto connection = server.connect();
+    connection->send("GET /metrics HTTP/1.1\r\n");
+
+    run(HTTP_REQUEST_TIMEOUT_MS / 10 - 10);
+    TEST_ASSERT_EQUAL_UINT8(1, pool->active());
+
+    run(20);
+    TEST_ASSERT_EQUAL_UINT32(1, pool->timeouts);
+    TEST_ASSERT_TRUE(connection->stopped);
+    TEST_ASSERT_EQUAL_UINT8(0, pool->active());
+}
+
+void test_stalled_reader_evicted() {
+    auto connection = server.connect();
+    connection->send(GET_STREAM);
+
+    // Send buffer full and never acked
+    run(HTTP_WRITE_TIMEOUT_MS / 10 + 10);
+
+    TEST_ASSERT_EQUAL_UINT32(1, pool->timeouts);
+    TEST_ASSERT_TRUE(connection->stopped);
+}
+
+void test_extra_clients_wait_for_a_slot() {
+    std::shared_ptr<hostConnection> connections[HTTP_POOL_SLOTS + 1];
+
+    for (uint8_t i = 0; i <= HTTP_POOL_SLOTS; i++) {
+        connections[i] = server.connect();
+    }
+
+    run(HTTP_POOL_SLOTS + 1);
+    TEST_ASSERT_EQUAL_UINT8(HTTP_POOL_SLOTS, pool->active());
+    TEST_ASSERT_EQUAL_UINT32(1, server.backlog.size());
+
+    // One request completes, the waiting client gets its slot
+    connections[0]->send(GET_CANNED);
+    run(5, connections[0]);
+    TEST_ASSERT_TRUE(connections[0]->stopped);
+    TEST_ASSERT_EQUAL_UINT32(0, server.backlog.size());
+
+    connections[HTTP_POOL_SLOTS]->send(GET_STREAM);
+    for (uint8_t i = 0; i < 100; i++) {
+        run(1, connections[HTTP_POOL_SLOTS]);
+    }
+    TEST_ASSERT_TRUE(streamed(STREAM_PARTS) == connections[HTTP_POOL_SLOTS]->received);
+}
+
+void test_concurrent_streams_interleave() {
+    std::shared_ptr<hostConnection> connections[HTTP_POOL_SLOTS];
+
+    for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+        connections[i] = server.connect();
+        connections[i]->send(GET_STREAM);
+    }
+
+    for (uint32_t loop = 0; loop < 200; loop++) {
+        pool->loop();
+        for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+            connections[i]->ack();
+        }
+    }
+
+    for (uint8_t i = 0; i < HTTP_POOL_SLOTS; i++) {
+        TEST_ASSERT_TRUE(streamed(STREAM_PARTS) == connections[i]->received);
+    }
+    TEST_ASSERT_EQUAL_UINT32(HTTP_POOL_SLOTS, pool->requests);
+    TEST_ASSERT_EQUAL_UINT32(0, pool->blockingWrites);
+}
+
+void test_detached_connection_left_open() {
+    detach = true;
+
+    auto connection = server.connect();
+    connection->send(GET_CANNED);
+    run(5);
+
+    TEST_ASSERT_EQUAL_UINT8(0, pool->active());
+    TEST_ASSERT_FALSE(connection->stopped);
+    TEST_ASSERT_EQUAL_UINT32(0, connection->received.size());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_request_split_across_loops);
+    RUN_TEST(test_streamed_response_without_blocking);
+    RUN_TEST(test_stream_waits_for_slow_client);
+    RUN_TEST(test_oversized_response_spills);
+    RUN_TEST(test_response_reuses_request_space);
+    RUN_TEST(test_response_before_request_read);
+    RUN_TEST(test_failed_spill_drops_client);
+    RUN_TEST(test_request_too_large);
+    RUN_TEST(test_slowloris_evicted);
+    RUN_TEST(test_stalled_reader_evicted);
+    RUN_TEST(test_extra_clients_wait_for_a_slot);
+    RUN_TEST(test_concurrent_streams_interleave);
+    RUN_TEST(test_detached_connection_left_open);
+    return UNITY_END();
+}
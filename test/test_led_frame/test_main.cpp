@@ -0,0 +1,136 @@
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+
+#include <ledFrame.h>
+
+// Firmware drives 3 pixels, the benchmark also runs the largest frame the
+// header can describe
+#define PIXELS          3
+#define MAX_PIXELS      255
+#define BENCH_FRAMES    200000
+
+static uint8_t colour[MAX_PIXELS * 4];
+static uint8_t frame[ledFrame::HEADER_SIZE + MAX_PIXELS * 4];
+
+static unsigned int buildFrame(uint8_t bpp, uint8_t first, uint8_t count) {
+    frame[0] = ledFrame::MAGIC;
+    frame[1] = bpp;
+    frame[2] = first;
+    frame[3] = count;
+
+    for (unsigned int i = 0; i < (unsigned int)count * bpp; i++) {
+        frame[ledFrame::HEADER_SIZE + i] = (uint8_t)(i * 7 + 1);
+    }
+
+    return ledFrame::HEADER_SIZE + count * bpp;
+}
+
+void setUp() {
+    memset(colour, 0xAA, sizeof(colour));
+}
+
+void tearDown() {}
+
+void test_rgbw_frame_copied() {
+    unsigned int length = buildFrame(4, 0, PIXELS);
+
+    TEST_ASSERT_TRUE(ledFrame::apply(frame, length, colour, PIXELS, 4));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(frame + ledFrame::HEADER_SIZE, colour, PIXELS * 4);
+}
+
+void test_rgb_frame_on_rgbw_pixels_leaves_white_off() {
+    unsigned int length = buildFrame(3, 1, 2);
+
+    TEST_ASSERT_TRUE(ledFrame::apply(frame, length, colour, PIXELS, 4));
+
+    // Pixel 0 untouched
+    TEST_ASSERT_EQUAL_HEX8(0xAA, colour[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xAA, colour[3]);
+
+    for (uint8_t p = 0; p < 2; p++) {
+        const uint8_t * src = frame + ledFrame::HEADER_SIZE + p * 3;
+        const uint8_t * dst = colour + (p + 1) * 4;
+
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(src, dst, 3);
+        TEST_ASSERT_EQUAL_HEX8(0, dst[3]);
+    }
+}
+
+void test_rgbw_frame_on_rgb_pixels_drops_white() {
+    unsigned int length = buildFrame(4, 0, PIXELS);
+
+    TEST_ASSERT_TRUE(ledFrame::apply(frame, length, colour, PIXELS, 3));
+
+    for (uint8_t p = 0; p < PIXELS; p++) {
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(frame + ledFrame::HEADER_SIZE + p * 4, colour + p * 3, 3);
+    }
+}
+
+void test_malformed_frames_rejected() {
+    uint8_t before[sizeof(colour)];
+    memcpy(before, colour, sizeof(colour));
+
+    unsigned int length = buildFrame(4, 0, PIXELS);
+
+    // Short header, wrong magic, bad bpp, truncated/overlong payload
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, 3, colour, PIXELS, 4));
+    frame[0] = 0;
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, length, colour, PIXELS, 4));
+    frame[0] = ledFrame::MAGIC;
+    frame[1] = 5;
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, length, colour, PIXELS, 4));
+    frame[1] = 4;
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, length - 1, colour, PIXELS, 4));
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, length + 1, colour, PIXELS, 4));
+
+    // Empty, or running off the end of the strip
+    buildFrame(4, 0, 0);
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, ledFrame::HEADER_SIZE, colour, PIXELS, 4));
+    length = buildFrame(4, PIXELS, 1);
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, length, colour, PIXELS, 4));
+    length = buildFrame(4, 1, PIXELS);
+    TEST_ASSERT_FALSE(ledFrame::apply(frame, length, colour, PIXELS, 4));
+
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(before, colour, sizeof(colour));
+}
+
+static void benchmark(uint8_t pixels) {
+    unsigned int length = buildFrame(4, 0, pixels);
+    uint32_t applied = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < BENCH_FRAMES; i++) {
+        // Vary a byte so the copy can't be hoisted out of the loop
+        frame[ledFrame::HEADER_SIZE] = (uint8_t)i;
+        applied += ledFrame::apply(frame, length, colour, pixels, 4);
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    TEST_ASSERT_EQUAL_UINT32(BENCH_FRAMES, applied);
+    TEST_ASSERT_EQUAL_HEX8((uint8_t)(BENCH_FRAMES - 1), colour[0]);
+
+    char message[128];
+    snprintf(message, sizeof(message), "%u pixel RGBW frames: %.0f frames/s, %.1f ns/frame",
+        pixels, BENCH_FRAMES / elapsed, elapsed * 1e9 / BENCH_FRAMES);
+    TEST_MESSAGE(message);
+}
+
+void test_benchmark_firmware_frame() {
+    benchmark(PIXELS);
+}
+
+void test_benchmark_largest_frame() {
+    benchmark(MAX_PIXELS);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_rgbw_frame_copied);
+    RUN_TEST(test_rgb_frame_on_rgbw_pixels_leaves_white_off);
+    RUN_TEST(test_rgbw_frame_on_rgb_pixels_drops_white);
+    RUN_TEST(test_malformed_frames_rejected);
+    RUN_TEST(test_benchmark_firmware_frame);
+    RUN_TEST(test_benchmark_largest_frame);
+    return UNITY_END();
+}
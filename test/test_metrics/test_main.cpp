@@ -0,0 +1,137 @@
+#include <unity.h>
+#include <string>
+#include <sstream>
+
+#include <metrics.h>
+
+class stringPrint : public Print {
+public:
+    size_t write(uint8_t c) override {
+        text += (char)c;
+        return 1;
+    }
+
+    std::string text;
+};
+
+static stringPrint out;
+
+// Text format 0.0.4 - every sample has to belong to the family named by
+// the last TYPE line, counters and gauges exactly, histograms with their
+// _bucket/_sum/_count suffixes. HELP has to name the same family.
+static void assertValidExposition(const std::string& text) {
+    std::istringstream lines(text);
+    std::string line, family, type, help;
+    int samples = 0;
+
+    while (std::getline(lines, line)) {
+        TEST_ASSERT_TRUE_MESSAGE(!line.empty() && line.back() == '\r', "lines end in CRLF");
+        line.pop_back();
+
+        if (line.rfind("# HELP ", 0) == 0) {
+            help = line.substr(7, line.find(' ', 7) - 7);
+            continue;
+        }
+
+        if (line.rfind("# TYPE ", 0) == 0) {
+            std::istringstream fields(line.substr(7));
+            fields >> family >> type;
+            TEST_ASSERT_EQUAL_STRING(help.c_str(), family.c_str());
+            continue;
+        }
+
+        std::string name = line.substr(0, line.find_first_of("{ "));
+
+        if (type == "histogram") {
+            bool member = name == family + "_bucket" || name == family + "_sum" || name == family + "_count";
+            TEST_ASSERT_TRUE_MESSAGE(member, line.c_str());
+        } else {
+            TEST_ASSERT_EQUAL_STRING(family.c_str(), name.c_str());
+        }
+
+        samples++;
+    }
+
+    TEST_ASSERT_GREATER_THAN(0, samples);
+}
+
+void setUp() {
+    out.text.clear();
+}
+
+void tearDown() {}
+
+void test_gauge() {
+    metrics::gauge(out, F("aqs_pm25"), F("PM 2.5"), 12.5f);
+    metrics::gauge(out, F("aqs_heap_free"), F("Free heap"), (uint32_t)30000);
+
+    TEST_ASSERT_EQUAL_STRING(
+        "# HELP aqs_pm25 PM 2.5\r\n# TYPE aqs_pm25 gauge\r\naqs_pm25 12.50\r\n"
+        "# HELP aqs_heap_free Free heap\r\n# TYPE aqs_heap_free gauge\r\naqs_heap_free 30000\r\n",
+        out.text.c_str());
+    assertValidExposition(out.text);
+}
+
+void test_counter_family_named_total() {
+    metrics::counter(out, F("aqs_loop_stalls"), F("Stalled loop stages"), 3);
+
+    TEST_ASSERT_EQUAL_STRING(
+        "# HELP aqs_loop_stalls_total Stalled loop stages\r\n"
+        "# TYPE aqs_loop_stalls_total counter\r\n"
+        "aqs_loop_stalls_total 3\r\n",
+        out.text.c_str());
+    assertValidExposition(out.text);
+}
+
+void test_labelled_counter() {
+    metrics::counterHeader(out, F("aqs_publish"), F("Messages published"));
+    metrics::sample(out, F("aqs_publish"), F("class"), "priority", 4, true);
+    metrics::sample(out, F("aqs_publish"), F("class"), "telemetry", 9, true);
+
+    TEST_ASSERT_EQUAL_STRING(
+        "# HELP aqs_publish_total Messages published\r\n"
+        "# TYPE aqs_publish_total counter\r\n"
+        "aqs_publish_total{class=\"priority\"} 4\r\n"
+        "aqs_publish_total{class=\"telemetry\"} 9\r\n",
+        out.text.c_str());
+    assertValidExposition(out.text);
+}
+
+void test_labelled_gauge() {
+    metrics::header(out, F("aqs_sensor_pm25_average"), F("gauge"), F("Averaged PM 2.5 per sensor"));
+    metrics::sample(out, F("aqs_sensor_pm25_average"), F("sensor"), (uint32_t)1, 7);
+    metrics::sample(out, F("aqs_sensor_pm25_average"), F("sensor"), (uint32_t)2, 8);
+
+    TEST_ASSERT_TRUE(out.text.find("aqs_sensor_pm25_average{sensor=\"2\"} 8\r\n") != std::string::npos);
+    assertValidExposition(out.text);
+}
+
+void test_histogram_cumulative() {
+    const uint32_t bounds[] = { 500, 1000, 2000 };
+    const uint32_t counts[] = { 1, 5, 2, 1 };
+
+    metrics::header(out, F("aqs_uart_frame_gap_ms"), F("histogram"), F("Time between PM sensor frames"));
+    metrics::histogram(out, F("aqs_uart_frame_gap_ms"), F("sensor"), 1, bounds, counts, 4, 9000);
+
+    TEST_ASSERT_EQUAL_STRING(
+        "# HELP aqs_uart_frame_gap_ms Time between PM sensor frames\r\n"
+        "# TYPE aqs_uart_frame_gap_ms histogram\r\n"
+        "aqs_uart_frame_gap_ms_bucket{sensor=\"1\",le=\"500\"} 1\r\n"
+        "aqs_uart_frame_gap_ms_bucket{sensor=\"1\",le=\"1000\"} 6\r\n"
+        "aqs_uart_frame_gap_ms_bucket{sensor=\"1\",le=\"2000\"} 8\r\n"
+        "aqs_uart_frame_gap_ms_bucket{sensor=\"1\",le=\"+Inf\"} 9\r\n"
+        "aqs_uart_frame_gap_ms_sum{sensor=\"1\"} 9000\r\n"
+        "aqs_uart_frame_gap_ms_count{sensor=\"1\"} 9\r\n",
+        out.text.c_str());
+    assertValidExposition(out.text);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_gauge);
+    RUN_TEST(test_counter_family_named_total);
+    RUN_TEST(test_labelled_counter);
+    RUN_TEST(test_labelled_gauge);
+    RUN_TEST(test_histogram_cumulative);
+    return UNITY_END();
+}
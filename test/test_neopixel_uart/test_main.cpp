@@ -0,0 +1,150 @@
+#include <unity.h>
+#include <stdlib.h>
+
+#include <neopixelUartEncoder.h>
+
+// 3.2Mbaud, so each bit on the wire lasts 312.5ns and one WS2812 bit
+// (1.25us) is 4 of them
+#define SLOT_NS             312.5
+#define SLOTS_PER_CHAR      8
+#define SLOTS_PER_WS_BIT    4
+
+// WS2812 high times, a 0 must be short and a 1 long enough to be sampled
+// as one (the chip samples around 0.6us after the rising edge)
+#define T0H_MIN_NS          200
+#define T0H_MAX_NS          500
+#define T1H_MIN_NS          625
+#define T1H_MAX_NS          1000
+
+#define MAX_PIXELS          16
+
+// Line levels of one encoded buffer as the pixels see it - the UART frames
+// each character as start (0), 6 data bits LSB first, stop (1), and the TX
+// line is inverted
+static size_t toWire(const uint8_t * chars, size_t count, uint8_t * wire) {
+    size_t slots = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        wire[slots++] = 1;          // start bit
+        for (uint8_t bit = 0; bit < 6; bit++) {
+            wire[slots++] = !((chars[i] >> bit) & 1);
+        }
+        wire[slots++] = 0;          // stop bit
+    }
+
+    return slots;
+}
+
+// Decode the line back into bytes the way a WS2812 does, checking every bit
+// is a single pulse with a high time inside the datasheet windows
+static size_t decode(const uint8_t * wire, size_t slots, uint8_t * data) {
+    TEST_ASSERT_EQUAL_size_t(0, slots % (SLOTS_PER_WS_BIT * 8));
+    size_t bytes = slots / (SLOTS_PER_WS_BIT * 8);
+    memset(data, 0, bytes);
+
+    for (size_t bit = 0; bit < bytes * 8; bit++) {
+        const uint8_t * period = wire + bit * SLOTS_PER_WS_BIT;
+
+        TEST_ASSERT_TRUE_MESSAGE(period[0], "every bit starts with a rising edge");
+
+        uint8_t high = 0;
+        while (high < SLOTS_PER_WS_BIT && period[high]) {
+            high++;
+        }
+
+        for (uint8_t i = high; i < SLOTS_PER_WS_BIT; i++) {
+            TEST_ASSERT_FALSE_MESSAGE(period[i], "one pulse per bit");
+        }
+
+        TEST_ASSERT_TRUE_MESSAGE(high < SLOTS_PER_WS_BIT, "line returns low before the next bit");
+
+        double highNs = high * SLOT_NS;
+        bool one = highNs >= T1H_MIN_NS;
+
+        if (one) {
+            TEST_ASSERT_TRUE(highNs <= T1H_MAX_NS);
+        } else {
+            TEST_ASSERT_TRUE(highNs >= T0H_MIN_NS && highNs <= T0H_MAX_NS);
+        }
+
+        data[bit / 8] |= one << (7 - bit % 8);
+    }
+
+    return bytes;
+}
+
+static void roundTrip(uint8_t channels) {
+    uint8_t pixels[MAX_PIXELS * 4];
+    uint8_t chars[sizeof(pixels) * NEOPIXEL_UART_CHARS_PER_BYTE];
+    uint8_t wire[sizeof(chars) * SLOTS_PER_CHAR];
+    uint8_t decoded[sizeof(pixels)];
+
+    srand(channels);
+
+    for (int run = 0; run < 1000; run++) {
+        size_t length = (1 + rand() % MAX_PIXELS) * channels;
+        for (size_t i = 0; i < length; i++) {
+            pixels[i] = rand();
+        }
+
+        size_t count = neopixelUartEncode(pixels, length, chars);
+        TEST_ASSERT_EQUAL_size_t(length * NEOPIXEL_UART_CHARS_PER_BYTE, count);
+
+        size_t slots = toWire(chars, count, wire);
+        TEST_ASSERT_EQUAL_size_t(length, decode(wire, slots, decoded));
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(pixels, decoded, length);
+    }
+}
+
+void setUp() {}
+void tearDown() {}
+
+void test_every_bit_pair() {
+    uint8_t wire[SLOTS_PER_CHAR];
+    uint8_t decoded;
+
+    // One character carries 2 WS2812 bits, check all 4 against the table
+    for (uint8_t pair = 0; pair < 4; pair++) {
+        toWire(&_neopixelUartBits[pair], 1, wire);
+
+        // decode() wants whole bytes, so pad the character out with zeros
+        uint8_t padded[SLOTS_PER_CHAR * 4];
+        memcpy(padded, wire, SLOTS_PER_CHAR);
+        for (uint8_t i = 1; i < 4; i++) {
+            toWire(&_neopixelUartBits[0], 1, padded + i * SLOTS_PER_CHAR);
+        }
+
+        decode(padded, sizeof(padded), &decoded);
+        TEST_ASSERT_EQUAL_HEX8(pair << 6, decoded);
+    }
+}
+
+void test_byte_values() {
+    const uint8_t values[] = { 0x00, 0xFF, 0xA5, 0x5A, 0x01, 0x80 };
+    uint8_t chars[NEOPIXEL_UART_CHARS_PER_BYTE];
+    uint8_t wire[sizeof(chars) * SLOTS_PER_CHAR];
+    uint8_t decoded;
+
+    for (uint8_t value : values) {
+        neopixelUartEncode(&value, 1, chars);
+        decode(wire, toWire(chars, sizeof(chars), wire), &decoded);
+        TEST_ASSERT_EQUAL_HEX8(value, decoded);
+    }
+}
+
+void test_grb_round_trip() {
+    roundTrip(3);
+}
+
+void test_grbw_round_trip() {
+    roundTrip(4);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_every_bit_pair);
+    RUN_TEST(test_byte_values);
+    RUN_TEST(test_grb_round_trip);
+    RUN_TEST(test_grbw_round_trip);
+    return UNITY_END();
+}
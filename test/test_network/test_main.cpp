@@ -0,0 +1,170 @@
+#include <unity.h>
+
+#include <networkState.h>
+
+// Mocked WiFi layer, driven by a virtual clock
+static uint32_t now;
+static bool linkUp;
+static bool credentials;
+static bool portalConnects;
+static int connects;
+static int portals;
+static int connectedCalls;
+static uint8_t connectedFrom;
+static uint32_t connectedElapsed;
+
+static uint32_t mockClock() { return now; }
+static bool mockConnected() { return linkUp; }
+static bool mockHasCredentials() { return credentials; }
+static void mockConnect() { connects++; }
+static void mockStartPortal() { portals++; }
+static bool mockProcessPortal() { return portalConnects; }
+
+static void onConnected(uint8_t from, uint32_t elapsed) {
+    connectedCalls++;
+    connectedFrom = from;
+    connectedElapsed = elapsed;
+}
+
+static const networkState::driver_t MOCK_DRIVER = {
+    mockClock,
+    mockConnected,
+    mockHasCredentials,
+    mockConnect,
+    mockStartPortal,
+    mockProcessPortal,
+};
+
+static networkState net;
+
+// Poll every 10ms for 'ms', as loop() would
+static void run(uint32_t ms) {
+    for (uint32_t t = 0; t < ms; t += 10) {
+        now += 10;
+        net.loop();
+    }
+}
+
+void setUp() {
+    now = 1000;
+    linkUp = false;
+    credentials = true;
+    portalConnects = false;
+    connects = portals = connectedCalls = 0;
+    connectedFrom = 0xFF;
+    connectedElapsed = 0;
+
+    net = networkState();
+    net.fastTimeoutMs = 3000;
+    net.connectTimeoutMs = 20000;
+}
+
+void tearDown() {}
+
+void test_fast_connect() {
+    net.begin(MOCK_DRIVER, onConnected, true);
+    run(500);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_FAST_CONNECTING, net.state());
+    TEST_ASSERT_FALSE(net.online());
+
+    linkUp = true;
+    run(10);
+
+    TEST_ASSERT_TRUE(net.online());
+    TEST_ASSERT_EQUAL_INT(1, connectedCalls);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_FAST_CONNECTING, connectedFrom);
+    TEST_ASSERT_EQUAL_UINT32(510, connectedElapsed);
+    TEST_ASSERT_EQUAL_INT(0, connects);
+}
+
+void test_fast_connect_falls_back_to_saved_credentials() {
+    net.begin(MOCK_DRIVER, onConnected, true);
+    run(3000);
+    TEST_ASSERT_EQUAL_INT(0, connects);
+
+    run(10);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_CONNECTING, net.state());
+    TEST_ASSERT_EQUAL_INT(1, connects);
+
+    run(2000);
+    linkUp = true;
+    run(10);
+
+    TEST_ASSERT_TRUE(net.online());
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_CONNECTING, connectedFrom);
+    TEST_ASSERT_EQUAL_INT(0, portals);
+}
+
+void test_no_credentials_goes_straight_to_portal() {
+    credentials = false;
+    net.begin(MOCK_DRIVER, onConnected, false);
+
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_PORTAL, net.state());
+    TEST_ASSERT_EQUAL_INT(0, connects);
+    TEST_ASSERT_EQUAL_INT(1, portals);
+}
+
+void test_connect_timeout_starts_portal() {
+    net.begin(MOCK_DRIVER, onConnected, false);
+    run(20000);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_CONNECTING, net.state());
+
+    run(10);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_PORTAL, net.state());
+    TEST_ASSERT_EQUAL_INT(1, portals);
+
+    // Portal keeps running (and is only started once) until someone connects
+    run(60000);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_PORTAL, net.state());
+    TEST_ASSERT_EQUAL_INT(1, portals);
+    TEST_ASSERT_EQUAL_INT(0, connectedCalls);
+
+    portalConnects = linkUp = true;
+    run(10);
+
+    TEST_ASSERT_TRUE(net.online());
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_PORTAL, connectedFrom);
+}
+
+void test_ap_drop_and_reconnect() {
+    net.begin(MOCK_DRIVER, onConnected, false);
+    linkUp = true;
+    run(10);
+    TEST_ASSERT_TRUE(net.online());
+
+    // AP goes away - the SDK reconnects on its own, so no portal and no
+    // new connect, we are just offline until it comes back
+    linkUp = false;
+    run(120000);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_CONNECTED, net.state());
+    TEST_ASSERT_FALSE(net.online());
+    TEST_ASSERT_EQUAL_INT(1, connects);
+    TEST_ASSERT_EQUAL_INT(0, portals);
+
+    linkUp = true;
+    run(10);
+    TEST_ASSERT_TRUE(net.online());
+    TEST_ASSERT_EQUAL_INT(1, connectedCalls);
+}
+
+void test_timeouts_across_clock_wrap() {
+    now = 0xFFFFFFFF - 1000;
+    net.begin(MOCK_DRIVER, onConnected, true);
+
+    run(2000);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_FAST_CONNECTING, net.state());
+
+    run(1010);
+    TEST_ASSERT_EQUAL_UINT8(NET_STATE_CONNECTING, net.state());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_fast_connect);
+    RUN_TEST(test_fast_connect_falls_back_to_saved_credentials);
+    RUN_TEST(test_no_credentials_goes_straight_to_portal);
+    RUN_TEST(test_connect_timeout_starts_portal);
+    RUN_TEST(test_ap_drop_and_reconnect);
+    RUN_TEST(test_timeouts_across_clock_wrap);
+    return UNITY_END();
+}
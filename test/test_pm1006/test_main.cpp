@@ -0,0 +1,246 @@
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+
+#include <serialCom.h>
+
+// Up to 4 sensors per controller, on the firmware's default pins
+#define MAX_SENSORS     4
+#define BENCH_POLLS     2000000
+
+static const uint8_t PINS[MAX_SENSORS] = { 4, 14, 12, 13 };
+
+static serialCom sensors[MAX_SENSORS];
+static particleSensorState_t states[MAX_SENSORS];
+
+static void makeFrame(uint8_t * frame, uint16_t pm25) {
+    memset(frame, 0, pm1006::FRAME_LENGTH);
+    memcpy(frame, pm1006::HEADER, sizeof(pm1006::HEADER));
+    frame[5] = pm25 >> 8;
+    frame[6] = pm25 & 0xFF;
+    frame[pm1006::FRAME_LENGTH - 1] = -pm1006::checksum(frame);
+}
+
+static void send(uint8_t sensor, const uint8_t * data, size_t length) {
+    SoftwareSerial::onPin(PINS[sensor])->inject(data, length);
+}
+
+static void sendFrame(uint8_t sensor, uint16_t pm25) {
+    uint8_t frame[pm1006::FRAME_LENGTH];
+    makeFrame(frame, pm25);
+    send(sensor, frame, sizeof(frame));
+}
+
+void setUp() {
+    hostMillis = 0;
+
+    for (uint8_t i = 0; i < MAX_SENSORS; i++) {
+        sensors[i] = serialCom();
+        sensors[i].begin(PINS[i]);
+        states[i] = particleSensorState_t();
+    }
+}
+
+void tearDown() {}
+
+void test_frame_split_across_polls() {
+    uint8_t frame[pm1006::FRAME_LENGTH];
+    makeFrame(frame, 42);
+
+    // A byte at a time, as a slow loop() would see it
+    for (uint8_t i = 0; i < sizeof(frame) - 1; i++) {
+        send(0, frame + i, 1);
+        TEST_ASSERT_FALSE(sensors[0].handleUart(states[0]));
+    }
+
+    send(0, frame + sizeof(frame) - 1, 1);
+    TEST_ASSERT_TRUE(sensors[0].handleUart(states[0]));
+    TEST_ASSERT_EQUAL_UINT16(42, states[0].latest());
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.framesAccepted);
+    TEST_ASSERT_EQUAL_UINT32(sizeof(frame), sensors[0].stats.bytes);
+}
+
+void test_average_valid_after_five_frames() {
+    static const uint16_t readings[5] = { 10, 20, 30, 40, 50 };
+
+    for (uint8_t i = 0; i < 5; i++) {
+        TEST_ASSERT_FALSE(states[0].valid);
+        sendFrame(0, readings[i]);
+        TEST_ASSERT_TRUE(sensors[0].handleUart(states[0]));
+    }
+
+    TEST_ASSERT_TRUE(states[0].valid);
+    TEST_ASSERT_EQUAL_UINT16(30, states[0].avgPM25);
+}
+
+void test_resync_after_noise() {
+    // Noise, a false start on the header, then a good frame
+    static const uint8_t noise[] = { 0x00, 0xFF, 0x42, 0x16, 0x11, 0x99, 0x07 };
+    send(0, noise, sizeof(noise));
+    sendFrame(0, 17);
+
+    TEST_ASSERT_TRUE(sensors[0].handleUart(states[0]));
+    TEST_ASSERT_EQUAL_UINT16(17, states[0].latest());
+
+    uartStats_t& stats = sensors[0].stats;
+    TEST_ASSERT_EQUAL_UINT32(1, stats.framesAccepted);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.headerErrors);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.checksumErrors);
+    // Each run of discarded bytes counts once, either side of the false start
+    TEST_ASSERT_EQUAL_UINT32(2, stats.resyncs);
+}
+
+void test_header_start_inside_noise_not_lost() {
+    // 0x16 0x16 0x11 0x0B: the second 0x16 restarts the header
+    static const uint8_t lead[] = { 0x16 };
+    send(0, lead, sizeof(lead));
+    sendFrame(0, 99);
+
+    TEST_ASSERT_TRUE(sensors[0].handleUart(states[0]));
+    TEST_ASSERT_EQUAL_UINT16(99, states[0].latest());
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.headerErrors);
+}
+
+void test_bad_checksum_rejected() {
+    uint8_t frame[pm1006::FRAME_LENGTH];
+    makeFrame(frame, 500);
+    frame[10] ^= 0x01;
+    send(0, frame, sizeof(frame));
+    sendFrame(0, 12);
+
+    TEST_ASSERT_TRUE(sensors[0].handleUart(states[0]));
+    TEST_ASSERT_EQUAL_UINT16(12, states[0].latest());
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.checksumErrors);
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.framesAccepted);
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.framesRejected());
+}
+
+void test_overflow_counted() {
+    // More than the 64 byte receive buffer arrives between polls
+    for (uint8_t i = 0; i < 4; i++) {
+        sendFrame(0, 1);
+    }
+
+    sensors[0].handleUart(states[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.overflows);
+
+    sensors[0].handleUart(states[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, sensors[0].stats.overflows);
+}
+
+void test_gap_histogram() {
+    // 1s, 2s, 20s and 2 minutes between frames
+    static const uint32_t gaps[] = { 1000, 2000, 20000, 120000 };
+
+    sendFrame(0, 1);
+    sensors[0].handleUart(states[0]);
+
+    for (uint32_t gap : gaps) {
+        hostMillis += gap;
+        sendFrame(0, 1);
+        sensors[0].handleUart(states[0]);
+    }
+
+    uartStats_t& stats = sensors[0].stats;
+    TEST_ASSERT_EQUAL_UINT32(1, stats.gaps[0]);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.gaps[1]);
+    TEST_ASSERT_EQUAL_UINT32(0, stats.gaps[2]);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.gaps[3]);
+    TEST_ASSERT_EQUAL_UINT32(1, stats.gaps[UART_GAP_BUCKET_COUNT - 1]);
+    TEST_ASSERT_EQUAL_UINT32(143000, stats.gapSumMs);
+}
+
+void test_instances_independent() {
+    uint8_t frame[pm1006::FRAME_LENGTH];
+
+    // Interleave half frames across all four sensors
+    for (uint8_t i = 0; i < MAX_SENSORS; i++) {
+        makeFrame(frame, 100 + i);
+        send(i, frame, 10);
+        sensors[i].handleUart(states[i]);
+    }
+
+    for (uint8_t i = 0; i < MAX_SENSORS; i++) {
+        makeFrame(frame, 100 + i);
+        send(i, frame + 10, 10);
+        TEST_ASSERT_TRUE(sensors[i].handleUart(states[i]));
+    }
+
+    for (uint8_t i = 0; i < MAX_SENSORS; i++) {
+        TEST_ASSERT_EQUAL_UINT16(100 + i, states[i].latest());
+        TEST_ASSERT_EQUAL_UINT32(1, sensors[i].stats.framesAccepted);
+        TEST_ASSERT_EQUAL_UINT32(0, sensors[i].stats.framesRejected());
+        TEST_ASSERT_EQUAL_UINT32(0, sensors[i].stats.resyncs);
+    }
+}
+
+// loop() polls every sensor every pass; a frame's bytes arrive every
+// 'spacing' polls and the rest find nothing waiting
+static double benchmark(uint8_t count, uint32_t spacing) {
+    uint8_t frame[pm1006::FRAME_LENGTH];
+    makeFrame(frame, 7);
+    uint32_t decoded = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t poll = 0; poll < BENCH_POLLS; poll++) {
+        bool arrive = poll % spacing == 0;
+
+        for (uint8_t i = 0; i < count; i++) {
+            if (arrive) {
+                send(i, frame, sizeof(frame));
+            }
+            decoded += sensors[i].handleUart(states[i]);
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint32_t frames = (BENCH_POLLS + spacing - 1) / spacing;
+    TEST_ASSERT_EQUAL_UINT32(frames * count, decoded);
+    for (uint8_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_UINT32(0, sensors[i].stats.framesRejected());
+    }
+
+    return elapsed * 1e9 / BENCH_POLLS;
+}
+
+static void benchmarkScaling(uint32_t spacing, const char * label) {
+    double single = 0;
+
+    for (uint8_t count = 1; count <= MAX_SENSORS; count++) {
+        setUp();
+        double ns = benchmark(count, spacing);
+        if (count == 1) {
+            single = ns;
+        }
+
+        char message[128];
+        snprintf(message, sizeof(message), "%u sensor(s), %s: %.1f ns/poll, %.1f ns/sensor (x%.2f of 1 sensor)",
+            count, label, ns, ns / count, ns / single);
+        TEST_MESSAGE(message);
+    }
+}
+
+void test_benchmark_polling_idle() {
+    // Frame every 1000 polls, most loop() passes find nothing waiting
+    benchmarkScaling(1000, "mostly idle");
+}
+
+void test_benchmark_polling_busy() {
+    // A whole frame to decode on every poll
+    benchmarkScaling(1, "frame per poll");
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_frame_split_across_polls);
+    RUN_TEST(test_average_valid_after_five_frames);
+    RUN_TEST(test_resync_after_noise);
+    RUN_TEST(test_header_start_inside_noise_not_lost);
+    RUN_TEST(test_bad_checksum_rejected);
+    RUN_TEST(test_overflow_counted);
+    RUN_TEST(test_gap_histogram);
+    RUN_TEST(test_instances_independent);
+    RUN_TEST(test_benchmark_polling_idle);
+    RUN_TEST(test_benchmark_polling_busy);
+    return UNITY_END();
+}
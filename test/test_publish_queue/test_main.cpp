@@ -0,0 +1,185 @@
+#include <unity.h>
+#include <stdlib.h>
+#include <string>
+
+#include <WiFiClient.h>
+#include <PubSubClient.h>
+#include <publishQueue.h>
+
+static std::shared_ptr<hostConnection> connection;
+static WiFiClient * net;
+static PubSubClient * mqtt;
+static publishQueue * publisher;
+
+static bool push(uint8_t cls, const std::string& topic, const std::string& payload) {
+    return publisher->push(cls, topic.c_str(), (const uint8_t *)payload.data(), payload.size(), false);
+}
+
+// Bytes a message takes in the arena
+static size_t footprint(const std::string& topic, const std::string& payload) {
+    return topic.size() + 1 + payload.size() + 1;
+}
+
+// loop() with the broker reading everything between passes
+static void drain() {
+    for (uint8_t i = 0; i < 100 && publisher->depth(); i++) {
+        publisher->loop();
+        connection->ack();
+    }
+}
+
+void setUp() {
+    delete publisher;
+    delete mqtt;
+    delete net;
+
+    connection = std::make_shared<hostConnection>();
+    net = new WiFiClient(connection);
+    mqtt = new PubSubClient(*net);
+    publisher = new publishQueue(*mqtt, *net);
+}
+
+void tearDown() {}
+
+void test_priority_then_oldest_first() {
+    push(PUBLISH_CLASS_LOG, "log", "l1");
+    push(PUBLISH_CLASS_TELEMETRY, "tele", "t1");
+    push(PUBLISH_CLASS_PRIORITY, "stat", "p1");
+    push(PUBLISH_CLASS_TELEMETRY, "tele", "t2");
+
+    drain();
+
+    static const char * const order[] = { "p1", "t1", "t2", "l1" };
+    TEST_ASSERT_EQUAL_UINT32(4, mqtt->messages.size());
+    for (uint8_t i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL_STRING(order[i], mqtt->messages[i].payload.c_str());
+    }
+    TEST_ASSERT_EQUAL_UINT32(0, publisher->bytes());
+}
+
+void test_arena_compacts_out_of_order() {
+    // Fill the arena exactly, log messages either side of telemetry
+    std::string log1(1000, 'a'), tele(1000, 'b'), log2(1000, 'c');
+    push(PUBLISH_CLASS_LOG, "l", log1);
+    push(PUBLISH_CLASS_TELEMETRY, "t", tele);
+    push(PUBLISH_CLASS_LOG, "l", log2);
+
+    size_t used = 2 * footprint("l", log1) + footprint("t", tele);
+    std::string last(PUBLISH_QUEUE_MAX_BYTES - used - footprint("p", ""), 'd');
+    TEST_ASSERT_TRUE(push(PUBLISH_CLASS_LOG, "p", last));
+    TEST_ASSERT_EQUAL_UINT32(PUBLISH_QUEUE_MAX_BYTES, publisher->bytes());
+
+    // Telemetry goes first, from the middle, with only room for one
+    connection->unacked = connection->sendBuffer - 1500;
+    publisher->loop();
+    TEST_ASSERT_EQUAL_UINT32(PUBLISH_QUEUE_MAX_BYTES - footprint("t", tele), publisher->bytes());
+
+    // Its space is usable in one piece
+    std::string next(1000, 'e');
+    TEST_ASSERT_TRUE(push(PUBLISH_CLASS_LOG, "n", next));
+    TEST_ASSERT_EQUAL_UINT32(0, publisher->drops[PUBLISH_CLASS_LOG]);
+
+    drain();
+    static const std::string * const order[] = { &tele, &log1, &log2, &last, &next };
+    TEST_ASSERT_EQUAL_UINT32(5, mqtt->messages.size());
+    for (uint8_t i = 0; i < 5; i++) {
+        TEST_ASSERT_TRUE(*order[i] == mqtt->messages[i].payload);
+    }
+}
+
+void test_full_queue_evicts_lower_class() {
+    std::string big(1500, 'x');
+    push(PUBLISH_CLASS_LOG, "log", big);
+    push(PUBLISH_CLASS_TELEMETRY, "tele", big);
+
+    // Only fits once the log message has gone
+    TEST_ASSERT_TRUE(push(PUBLISH_CLASS_PRIORITY, "stat", big));
+    TEST_ASSERT_EQUAL_UINT32(1, publisher->drops[PUBLISH_CLASS_LOG]);
+    TEST_ASSERT_EQUAL_UINT8(2, publisher->depth());
+
+    // Nothing lower left to evict
+    TEST_ASSERT_FALSE(push(PUBLISH_CLASS_LOG, "log", big));
+    TEST_ASSERT_EQUAL_UINT32(2, publisher->drops[PUBLISH_CLASS_LOG]);
+
+    drain();
+    TEST_ASSERT_EQUAL_STRING("stat", mqtt->messages[0].topic.c_str());
+    TEST_ASSERT_EQUAL_STRING("tele", mqtt->messages[1].topic.c_str());
+}
+
+void test_slots_bound_count() {
+    for (uint8_t i = 0; i < PUBLISH_QUEUE_SLOTS; i++) {
+        TEST_ASSERT_TRUE(push(PUBLISH_CLASS_TELEMETRY, "t", std::to_string(i)));
+    }
+
+    TEST_ASSERT_FALSE(push(PUBLISH_CLASS_TELEMETRY, "t", "over"));
+    TEST_ASSERT_EQUAL_UINT32(1, publisher->drops[PUBLISH_CLASS_TELEMETRY]);
+}
+
+void test_oversized_rejected() {
+    std::string huge(PUBLISH_QUEUE_MAX_BYTES, 'x');
+    TEST_ASSERT_FALSE(push(PUBLISH_CLASS_PRIORITY, "stat", huge));
+    TEST_ASSERT_EQUAL_UINT32(1, publisher->drops[PUBLISH_CLASS_PRIORITY]);
+    TEST_ASSERT_EQUAL_UINT32(0, publisher->bytes());
+}
+
+void test_waits_for_send_buffer() {
+    connection->unacked = connection->sendBuffer - 10;
+    push(PUBLISH_CLASS_TELEMETRY, "tele", std::string(100, 'x'));
+
+    publisher->loop();
+    TEST_ASSERT_EQUAL_UINT8(1, publisher->depth());
+    TEST_ASSERT_EQUAL_UINT32(0, connection->blockingWrites);
+
+    connection->ack();
+    publisher->loop();
+    TEST_ASSERT_EQUAL_UINT8(0, publisher->depth());
+    TEST_ASSERT_EQUAL_UINT32(1, publisher->published[PUBLISH_CLASS_TELEMETRY]);
+}
+
+void test_churn_keeps_payloads_intact() {
+    // Random sizes, classes and partial drains, each payload tagged with
+    // its own sequence number so a bad move shows up
+    srand(7);
+    uint32_t pushed = 0;
+
+    for (uint32_t round = 0; round < 2000; round++) {
+        uint8_t count = rand() % 4;
+        for (uint8_t i = 0; i < count; i++) {
+            std::string payload = std::to_string(pushed) + ":";
+            payload.append(rand() % 900, (char)('a' + pushed % 26));
+            if (push(rand() % PUBLISH_CLASS_COUNT, "t/" + std::to_string(pushed), payload)) {
+                pushed++;
+            }
+        }
+
+        if (rand() % 2) {
+            publisher->loop();
+            connection->ack();
+        }
+        TEST_ASSERT_TRUE(publisher->bytes() <= PUBLISH_QUEUE_MAX_BYTES);
+    }
+    drain();
+
+    TEST_ASSERT_TRUE(mqtt->messages.size() > 1000);
+    for (const PubSubClient::message_t& message : mqtt->messages) {
+        std::string sequence = message.topic.substr(2);
+        TEST_ASSERT_EQUAL_STRING(sequence.c_str(), message.payload.substr(0, sequence.size()).c_str());
+
+        uint32_t n = strtoul(sequence.c_str(), NULL, 10);
+        size_t tail = message.payload.find(':') + 1;
+        TEST_ASSERT_EQUAL_UINT32(message.payload.size() - tail,
+            std::count(message.payload.begin() + tail, message.payload.end(), (char)('a' + n % 26)));
+    }
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_priority_then_oldest_first);
+    RUN_TEST(test_arena_compacts_out_of_order);
+    RUN_TEST(test_full_queue_evicts_lower_class);
+    RUN_TEST(test_slots_bound_count);
+    RUN_TEST(test_oversized_rejected);
+    RUN_TEST(test_waits_for_send_buffer);
+    RUN_TEST(test_churn_keeps_payloads_intact);
+    return UNITY_END();
+}
@@ -0,0 +1,141 @@
+#include <unity.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <seqlock.h>
+
+#define WRITES      2000000
+#define READERS     3
+
+// Roughly the size and shape of particleSensorState_t, every field set
+// from the same write number so a torn copy shows up as a mismatch
+struct snapshot_t {
+    uint32_t sequence;
+    uint16_t measurements[20];
+    uint8_t index;
+    bool valid;
+    uint16_t average;
+};
+
+static snapshot_t make(uint32_t n) {
+    snapshot_t s;
+    s.sequence = n;
+    for (uint8_t i = 0; i < 20; i++) {
+        s.measurements[i] = (uint16_t)(n + i);
+    }
+    s.index = (uint8_t)n;
+    s.valid = n & 1;
+    s.average = (uint16_t)(n * 3);
+    return s;
+}
+
+static bool consistent(const snapshot_t& s) {
+    snapshot_t expected = make(s.sequence);
+
+    for (uint8_t i = 0; i < 20; i++) {
+        if (s.measurements[i] != expected.measurements[i]) {
+            return false;
+        }
+    }
+
+    return s.index == expected.index && s.valid == expected.valid && s.average == expected.average;
+}
+
+struct readerResult_t {
+    uint64_t reads = 0;
+    uint64_t torn = 0;
+    uint64_t backwards = 0;
+    uint64_t versionMismatch = 0;
+};
+
+void setUp() {}
+void tearDown() {}
+
+void test_single_thread_round_trip() {
+    seqlock<snapshot_t> lock;
+    TEST_ASSERT_EQUAL_UINT32(0, lock.version());
+
+    lock.write(make(42));
+    snapshot_t s = lock.read();
+
+    TEST_ASSERT_EQUAL_UINT32(42, s.sequence);
+    TEST_ASSERT_TRUE(consistent(s));
+    TEST_ASSERT_EQUAL_UINT32(1, lock.version());
+}
+
+void test_concurrent_readers_never_see_a_torn_snapshot() {
+    seqlock<snapshot_t> lock;
+    std::atomic<bool> stop{false};
+    readerResult_t results[READERS];
+    std::vector<std::thread> readers;
+
+    lock.write(make(0));
+
+    for (int r = 0; r < READERS; r++) {
+        readers.emplace_back([&lock, &stop, &results, r] {
+            readerResult_t& result = results[r];
+            uint32_t last = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint32_t version = lock.version();
+                snapshot_t s = lock.read();
+                result.reads++;
+
+                if (!consistent(s)) {
+                    result.torn++;
+                }
+
+                // Snapshots only ever move forwards
+                if (s.sequence < last) {
+                    result.backwards++;
+                }
+                last = s.sequence;
+
+                // Write n bumps the version to n + 1, the copy can't be
+                // older than the version seen before reading it
+                if (s.sequence + 1 < version) {
+                    result.versionMismatch++;
+                }
+            }
+        });
+    }
+
+    // Single writer, as the UART handler is
+    std::thread writer([&lock] {
+        for (uint32_t n = 1; n <= WRITES; n++) {
+            lock.write(make(n));
+        }
+    });
+
+    writer.join();
+    stop = true;
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    uint64_t reads = 0;
+    for (int r = 0; r < READERS; r++) {
+        TEST_ASSERT_EQUAL_UINT32(0, results[r].torn);
+        TEST_ASSERT_EQUAL_UINT32(0, results[r].backwards);
+        TEST_ASSERT_EQUAL_UINT32(0, results[r].versionMismatch);
+        reads += results[r].reads;
+    }
+
+    TEST_ASSERT_GREATER_THAN(0, reads);
+    TEST_ASSERT_EQUAL_UINT32(WRITES, lock.read().sequence);
+    TEST_ASSERT_EQUAL_UINT32(WRITES + 1, lock.version());
+
+    char message[64];
+    snprintf(message, sizeof(message), "%llu reads during %u writes", (unsigned long long)reads, WRITES);
+    TEST_MESSAGE(message);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_single_thread_round_trip);
+    RUN_TEST(test_concurrent_readers_never_see_a_torn_snapshot);
+    return UNITY_END();
+}
@@ -0,0 +1,235 @@
+#include <unity.h>
+
+#include <stallWatchdog.h>
+
+#define THRESHOLD_MS    1000
+
+// Virtual device clock, carried on across a simulated reset as the
+// firmware's is from RTC memory
+static uint32_t clockMs;
+
+// Stand-in for RTC user memory, survives "resets"
+static stallLog_t rtcLog;
+static stallStage_t rtcStage;
+
+static stallWatchdog * stalls;
+
+static uint32_t virtualClock() {
+    return clockMs;
+}
+
+static void saveLog(const stallLog_t& log) {
+    rtcLog = log;
+}
+
+static void saveStage(const stallStage_t& stage) {
+    rtcStage = stage;
+}
+
+static void boot() {
+    delete stalls;
+    stalls = new stallWatchdog();
+    stalls->thresholdMs = THRESHOLD_MS;
+}
+
+// What initialiseStallWatchdog() does after a warm restart
+static void reset(uint8_t reason, uint32_t bootMs = 200) {
+    stallLog_t savedLog = rtcLog;
+    stallStage_t savedStage = rtcStage;
+
+    clockMs += bootMs;
+    boot();
+    stalls->begin(virtualClock, saveLog, saveStage);
+    stalls->restore(savedLog, savedStage, reason);
+}
+
+void setUp() {
+    clockMs = 50000;
+    memset(&rtcLog, 0, sizeof(rtcLog));
+    memset(&rtcStage, 0, sizeof(rtcStage));
+
+    boot();
+    stalls->begin(virtualClock, saveLog, saveStage);
+}
+
+void tearDown() {}
+
+void test_short_stages_not_recorded() {
+    for (uint8_t stage = STALL_STAGE_NETWORK; stage < STALL_STAGE_COUNT; stage++) {
+        stalls->enter(stage);
+        clockMs += THRESHOLD_MS;
+        stalls->check();
+    }
+    stalls->enter(STALL_STAGE_NETWORK);
+
+    TEST_ASSERT_EQUAL_UINT8(0, stalls->pending());
+}
+
+void test_stall_recorded_on_enter() {
+    stalls->enter(STALL_STAGE_LEDS);
+    uint32_t start = clockMs;
+    clockMs += 1500;
+    stalls->enter(STALL_STAGE_UART);
+
+    TEST_ASSERT_EQUAL_UINT8(1, stalls->pending());
+    const stallRecord_t& record = stalls->next();
+    TEST_ASSERT_EQUAL_UINT8(STALL_STAGE_LEDS, record.stage);
+    TEST_ASSERT_EQUAL_UINT32(start, record.startMs);
+    TEST_ASSERT_EQUAL_UINT32(1500, record.durationMs);
+    TEST_ASSERT_EQUAL_UINT8(0, record.flags);
+
+    stalls->published();
+    TEST_ASSERT_EQUAL_UINT8(0, stalls->pending());
+    TEST_ASSERT_EQUAL_UINT32(stallWatchdog::checksum(rtcLog), rtcLog.checksum);
+}
+
+void test_stage_saved_on_enter() {
+    stalls->enter(STALL_STAGE_API);
+
+    TEST_ASSERT_EQUAL_UINT32(STALL_STAGE_API, rtcStage.stage);
+    TEST_ASSERT_EQUAL_UINT32(clockMs, rtcStage.startMs);
+    TEST_ASSERT_EQUAL_UINT32(stallWatchdog::STAGE_MAGIC ^ rtcStage.stage ^ rtcStage.startMs, rtcStage.check);
+}
+
+void test_soft_wdt_without_check() {
+    // The stage spins without yielding, so the check() timer never runs
+    stalls->enter(STALL_STAGE_UART);
+    uint32_t start = clockMs;
+    clockMs += 500;
+    TEST_ASSERT_EQUAL_UINT32(0, rtcLog.recorded);
+
+    // The device clock is restored from RTC memory, last saved before the stall
+    clockMs = start - 300;
+    reset(STALL_RESET_SOFT_WDT);
+
+    TEST_ASSERT_EQUAL_UINT8(1, stalls->pending());
+    const stallRecord_t& record = stalls->next();
+    TEST_ASSERT_EQUAL_UINT8(STALL_STAGE_UART, record.stage);
+    TEST_ASSERT_EQUAL_UINT32(start, record.startMs);
+    TEST_ASSERT_EQUAL_UINT32(STALL_SOFT_WDT_MS, record.durationMs);
+    TEST_ASSERT_EQUAL_UINT8(STALL_FLAG_RESET, record.flags);
+    TEST_ASSERT_EQUAL_UINT8(STALL_RESET_SOFT_WDT, record.resetReason);
+
+    // Saved for the next reset, and the saved stage is now setup
+    TEST_ASSERT_EQUAL_UINT32(1, rtcLog.recorded);
+    TEST_ASSERT_EQUAL_UINT32(STALL_STAGE_SETUP, rtcStage.stage);
+}
+
+void test_hw_wdt_duration_from_clock() {
+    stalls->enter(STALL_STAGE_SYSTEM);
+    uint32_t start = clockMs;
+
+    // The clock says we were gone for longer than the watchdog timeout
+    clockMs += 11000;
+    reset(STALL_RESET_HW_WDT, 0);
+
+    const stallRecord_t& record = stalls->next();
+    TEST_ASSERT_EQUAL_UINT8(STALL_STAGE_SYSTEM, record.stage);
+    TEST_ASSERT_EQUAL_UINT32(start, record.startMs);
+    TEST_ASSERT_EQUAL_UINT32(11000, record.durationMs);
+    TEST_ASSERT_EQUAL_UINT8(STALL_RESET_HW_WDT, record.resetReason);
+}
+
+void test_wdt_merges_checked_record() {
+    // check() got to run once before the stage stopped yielding
+    stalls->enter(STALL_STAGE_NETWORK);
+    uint32_t start = clockMs;
+    clockMs += 1200;
+    stalls->check();
+    TEST_ASSERT_EQUAL_UINT32(1, rtcLog.recorded);
+    TEST_ASSERT_EQUAL_UINT8(STALL_FLAG_OPEN, rtcLog.records[0].flags);
+
+    clockMs += 100;
+    reset(STALL_RESET_SOFT_WDT);
+
+    TEST_ASSERT_EQUAL_UINT8(1, stalls->pending());
+    const stallRecord_t& record = stalls->next();
+    TEST_ASSERT_EQUAL_UINT32(start, record.startMs);
+    TEST_ASSERT_EQUAL_UINT32(STALL_SOFT_WDT_MS, record.durationMs);
+    TEST_ASSERT_EQUAL_UINT8(STALL_FLAG_RESET, record.flags);
+}
+
+void test_wdt_after_earlier_stalls() {
+    stalls->enter(STALL_STAGE_LEDS);
+    clockMs += 2000;
+    stalls->enter(STALL_STAGE_MQTT);
+    clockMs += 100;
+    reset(STALL_RESET_SOFT_WDT);
+
+    TEST_ASSERT_EQUAL_UINT8(2, stalls->pending());
+    TEST_ASSERT_EQUAL_UINT8(STALL_STAGE_LEDS, stalls->next().stage);
+    TEST_ASSERT_EQUAL_UINT8(0, stalls->next().flags);
+    stalls->published();
+    TEST_ASSERT_EQUAL_UINT8(STALL_STAGE_MQTT, stalls->next().stage);
+    TEST_ASSERT_EQUAL_UINT8(STALL_FLAG_RESET, stalls->next().flags);
+}
+
+void test_exit_clears_stage() {
+    stalls->enter(STALL_STAGE_MQTT);
+    stalls->exit();
+    TEST_ASSERT_EQUAL_UINT32(0, rtcStage.check);
+
+    reset(STALL_RESET_SOFT_WDT);
+    TEST_ASSERT_EQUAL_UINT8(0, stalls->pending());
+}
+
+void test_other_resets_not_recorded() {
+    // A restart or crash part way through a stage isn't a stall
+    static const uint8_t reasons[] = { 2, 4, 6 };
+
+    for (uint8_t reason : reasons) {
+        stalls->enter(STALL_STAGE_API);
+        reset(reason);
+        TEST_ASSERT_EQUAL_UINT8(0, stalls->pending());
+    }
+}
+
+void test_corrupt_stage_ignored() {
+    stalls->enter(STALL_STAGE_UART);
+    rtcStage.startMs ^= 0x10;
+
+    reset(STALL_RESET_HW_WDT);
+    TEST_ASSERT_EQUAL_UINT8(0, stalls->pending());
+}
+
+void test_disabled_not_recorded() {
+    stalls->enter(STALL_STAGE_UART);
+
+    stallLog_t savedLog = rtcLog;
+    stallStage_t savedStage = rtcStage;
+    boot();
+    stalls->thresholdMs = 0;
+    stalls->begin(virtualClock, saveLog, saveStage);
+    stalls->restore(savedLog, savedStage, STALL_RESET_SOFT_WDT);
+
+    TEST_ASSERT_EQUAL_UINT8(0, stalls->pending());
+}
+
+void test_log_wraps() {
+    for (uint8_t i = 0; i < STALL_LOG_SIZE + 3; i++) {
+        stalls->enter(STALL_STAGE_LEDS);
+        clockMs += THRESHOLD_MS + 1 + i;
+        stalls->enter(STALL_STAGE_UART);
+    }
+
+    // Only the newest STALL_LOG_SIZE are kept
+    TEST_ASSERT_EQUAL_UINT8(STALL_LOG_SIZE, stalls->pending());
+    TEST_ASSERT_EQUAL_UINT32(THRESHOLD_MS + 1 + 3, stalls->next().durationMs);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_short_stages_not_recorded);
+    RUN_TEST(test_stall_recorded_on_enter);
+    RUN_TEST(test_stage_saved_on_enter);
+    RUN_TEST(test_soft_wdt_without_check);
+    RUN_TEST(test_hw_wdt_duration_from_clock);
+    RUN_TEST(test_wdt_merges_checked_record);
+    RUN_TEST(test_wdt_after_earlier_stalls);
+    RUN_TEST(test_exit_clears_stage);
+    RUN_TEST(test_other_resets_not_recorded);
+    RUN_TEST(test_corrupt_stage_ignored);
+    RUN_TEST(test_disabled_not_recorded);
+    RUN_TEST(test_log_wraps);
+    return UNITY_END();
+}
@@ -0,0 +1,220 @@
+#include <unity.h>
+#include <vector>
+
+#include <teleQueue.h>
+
+// Same shape and sizing as the firmware, see main.cpp
+#define RAM_SIZE        16
+#define EEPROM_SIZE     1024
+#define QUEUE_OFFSET    512
+#define BATCH_SIZE      5
+
+struct reading_t {
+    uint32_t ms;
+    uint16_t pm25;
+    uint16_t flags;
+    int16_t temperature;
+    uint16_t humidity;
+    uint32_t lux;
+};
+
+#define SPILL_SIZE      ((EEPROM_SIZE - QUEUE_OFFSET - 16) / sizeof(reading_t))
+
+typedef teleQueue<reading_t, RAM_SIZE> queue_t;
+
+// Stand-in broker, takes publishes until its socket 'fills'
+static std::vector<uint32_t> received;
+static uint32_t acceptLimit;
+
+static bool brokerPublish(reading_t& reading) {
+    if (received.size() >= acceptLimit) {
+        return false;
+    }
+
+    received.push_back(reading.ms);
+    return true;
+}
+
+static reading_t reading(uint32_t ms) {
+    reading_t r = {};
+    r.ms = ms;
+    r.pm25 = (uint16_t)ms;
+    return r;
+}
+
+// Reconnect, then drain in batches (as drainBacklog() does) until empty
+static uint32_t replay(queue_t& queue) {
+    uint32_t batches = 0;
+
+    while (queue.depth()) {
+        uint8_t sent = queue.drain(BATCH_SIZE, brokerPublish);
+        TEST_ASSERT_LESS_OR_EQUAL(BATCH_SIZE, sent);
+        TEST_ASSERT_GREATER_THAN(0, sent);
+        batches++;
+    }
+
+    return batches;
+}
+
+void setUp() {
+    memset(EEPROM.data, 0xFF, sizeof(EEPROM.data));
+    EEPROM.commits = 0;
+    received.clear();
+    acceptLimit = UINT32_MAX;
+}
+
+void tearDown() {}
+
+void test_outage_within_ram_replays_in_order() {
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 1);
+
+    for (uint32_t i = 0; i < 10; i++) {
+        queue.push(reading(i));
+    }
+
+    TEST_ASSERT_EQUAL_UINT16(10, queue.depth());
+    TEST_ASSERT_EQUAL_UINT32(2, replay(queue));
+    TEST_ASSERT_EQUAL_size_t(10, received.size());
+
+    for (uint32_t i = 0; i < 10; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i, received[i]);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(0, queue.drops);
+}
+
+void test_outage_spilling_to_flash_replays_in_order() {
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 1);
+
+    uint32_t total = RAM_SIZE + SPILL_SIZE;
+    for (uint32_t i = 0; i < total; i++) {
+        queue.push(reading(i));
+    }
+
+    TEST_ASSERT_EQUAL_UINT16(total, queue.depth());
+    replay(queue);
+
+    TEST_ASSERT_EQUAL_size_t(total, received.size());
+    for (uint32_t i = 0; i < total; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i, received[i]);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(0, queue.drops);
+}
+
+void test_long_outage_drops_oldest() {
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 1);
+
+    uint32_t total = 200;
+    for (uint32_t i = 0; i < total; i++) {
+        queue.push(reading(i));
+    }
+
+    replay(queue);
+
+    // Nothing out of order or repeated, only the oldest lost, and every
+    // loss counted
+    TEST_ASSERT_EQUAL_UINT32(total, received.size() + queue.drops);
+    for (size_t i = 1; i < received.size(); i++) {
+        TEST_ASSERT_EQUAL_UINT32(received[i - 1] + 1, received[i]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(total - 1, received.back());
+}
+
+void test_broker_backpressure_keeps_the_rest_queued() {
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 1);
+
+    for (uint32_t i = 0; i < 12; i++) {
+        queue.push(reading(i));
+    }
+
+    // Broker takes 3 then stops, the rest (and the one it refused) stay
+    acceptLimit = 3;
+    TEST_ASSERT_EQUAL_UINT8(3, queue.drain(BATCH_SIZE, brokerPublish));
+    TEST_ASSERT_EQUAL_UINT8(0, queue.drain(BATCH_SIZE, brokerPublish));
+    TEST_ASSERT_EQUAL_UINT16(9, queue.depth());
+
+    // New readings keep queueing behind the backlog
+    queue.push(reading(12));
+
+    acceptLimit = UINT32_MAX;
+    replay(queue);
+
+    TEST_ASSERT_EQUAL_size_t(13, received.size());
+    for (uint32_t i = 0; i < 13; i++) {
+        TEST_ASSERT_EQUAL_UINT32(i, received[i]);
+    }
+}
+
+void test_warm_restart_keeps_backlog() {
+    {
+        queue_t queue;
+        queue.begin(QUEUE_OFFSET, SPILL_SIZE, 7);
+
+        for (uint32_t i = 0; i < 20; i++) {
+            queue.push(reading(i));
+        }
+
+        queue.persist();
+    }
+
+    // Same boot epoch, e.g. a software restart
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 7);
+    TEST_ASSERT_EQUAL_UINT16(20, queue.depth());
+
+    replay(queue);
+    TEST_ASSERT_EQUAL_size_t(20, received.size());
+    TEST_ASSERT_EQUAL_UINT32(0, received.front());
+    TEST_ASSERT_EQUAL_UINT32(19, received.back());
+}
+
+void test_power_cycle_discards_backlog() {
+    {
+        queue_t queue;
+        queue.begin(QUEUE_OFFSET, SPILL_SIZE, 7);
+
+        for (uint32_t i = 0; i < 20; i++) {
+            queue.push(reading(i));
+        }
+
+        queue.persist();
+    }
+
+    // New epoch, the old timestamps mean nothing now
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 8);
+
+    TEST_ASSERT_EQUAL_UINT16(0, queue.depth());
+    TEST_ASSERT_EQUAL_UINT32(20, queue.drops);
+}
+
+void test_pops_batch_flash_commits() {
+    queue_t queue;
+    queue.begin(QUEUE_OFFSET, SPILL_SIZE, 1);
+
+    for (uint32_t i = 0; i < RAM_SIZE + 10; i++) {
+        queue.push(reading(i));
+    }
+
+    // One commit per drained batch, not per record
+    uint32_t commits = EEPROM.commits;
+    queue.drain(BATCH_SIZE, brokerPublish);
+    TEST_ASSERT_EQUAL_UINT32(commits + 1, EEPROM.commits);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_outage_within_ram_replays_in_order);
+    RUN_TEST(test_outage_spilling_to_flash_replays_in_order);
+    RUN_TEST(test_long_outage_drops_oldest);
+    RUN_TEST(test_broker_backpressure_keeps_the_rest_queued);
+    RUN_TEST(test_warm_restart_keeps_backlog);
+    RUN_TEST(test_power_cycle_discards_backlog);
+    RUN_TEST(test_pops_batch_flash_commits);
+    return UNITY_END();
+}
@@ -0,0 +1,290 @@
+"""
+Reads constants, struct sizes and config/command field tables out of the
+firmware sources, so the host tools model the firmware as built rather than
+a copy of it that drifts.
+
+Only understands as much C as the sources use: #define constants (with
+sizeof() of the structs in types.h), #if/#ifdef on defined() and constants,
+string arrays and the fields::xxx() tables in main.cpp.
+"""
+
+import configparser
+import ctypes
+import json
+import os
+import re
+
+ROOT = os.path.normpath(os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."))
+
+SOURCES = [
+    "lib/ledPWMNeopixel/ledPWMNeopixel.h",
+    "src/types.h", "src/alerts.h", "src/publishQueue.h", "src/bufferedLogger.h", "src/main.cpp",
+]
+
+JSON_SCHEMA_VERSION = "http://json-schema.org/draft-07/schema#"
+FIELD_NO_MAXIMUM = 2 ** 31 - 1
+
+C_TYPES = {
+    "uint8_t": ctypes.c_uint8, "int8_t": ctypes.c_int8, "char": ctypes.c_char,
+    "bool": ctypes.c_bool, "boolean": ctypes.c_bool,
+    "uint16_t": ctypes.c_uint16, "int16_t": ctypes.c_int16,
+    "uint32_t": ctypes.c_uint32, "int32_t": ctypes.c_int32,
+}
+
+
+def _strip_comments(text):
+    text = re.sub(r"/\*.*?\*/", "", text, flags=re.S)
+    return re.sub(r'//[^\n"]*$', "", text, flags=re.M)
+
+
+def _split_top_level(text, separator=","):
+    """Split on separator outside of (), {} and string literals"""
+    parts, depth, current, quoted = [], 0, "", False
+    for i, c in enumerate(text):
+        if c == '"' and text[i - 1] != "\\":
+            quoted = not quoted
+        elif not quoted and c in "({":
+            depth += 1
+        elif not quoted and c in ")}":
+            depth -= 1
+        elif not quoted and depth == 0 and c == separator:
+            parts.append(current.strip())
+            current = ""
+            continue
+        current += c
+    if current.strip():
+        parts.append(current.strip())
+    return parts
+
+
+class Firmware:
+    def __init__(self, led="rgbw", defines=(), root=ROOT):
+        """led: 'rgbw', 'rgb' or None for the build without LEDs"""
+        self.root = root
+        self.defines = {}
+        self.structs = {}
+
+        for name in defines:
+            self.defines[name] = "1"
+        if led:
+            self.defines["LED_" + led.upper()] = "1"
+
+        self.text = "\n".join(self._preprocess(_strip_comments(self._read(path))) for path in SOURCES)
+
+        ini = configparser.ConfigParser(interpolation=None)
+        ini.read(os.path.join(root, "platformio.ini"))
+        self.info = {k: v.strip('\\"') for k, v in ini["firmware"].items()}
+
+    def _read(self, path):
+        with open(os.path.join(self.root, path)) as f:
+            return f.read()
+
+    # ----------------------------------------------------------- constants
+    def _condition(self, expression):
+        expression = re.sub(r"defined\s*\(?\s*(\w+)\s*\)?", lambda m: "1" if m.group(1) in self.defines else "0", expression)
+        expression = expression.replace("&&", " and ").replace("||", " or ")
+        expression = re.sub(r"!(?!=)", " not ", expression)
+        expression = re.sub(r"[A-Za-z_]\w*", lambda m: m.group(0) if m.group(0) in ("and", "or", "not") else str(self.value(m.group(0), 0)), expression)
+        try:
+            return bool(eval(expression))
+        except Exception:
+            return False
+
+    def _preprocess(self, text):
+        """Drop lines in inactive #if branches, collecting #defines as we go"""
+        out = []
+        # (active, a branch was taken, parent active)
+        stack = [(True, True, True)]
+        for line in text.splitlines():
+            directive = re.match(r"\s*#\s*(\w+)\s*(.*)", line)
+            active = stack[-1][0]
+            if directive:
+                kind, rest = directive.groups()
+                if kind in ("if", "ifdef", "ifndef"):
+                    if kind == "ifdef":
+                        taken = rest.split()[0] in self.defines
+                    elif kind == "ifndef":
+                        taken = rest.split()[0] not in self.defines
+                    else:
+                        taken = self._condition(rest)
+                    stack.append((active and taken, taken, active))
+                elif kind == "elif":
+                    _, done, parent = stack.pop()
+                    taken = not done and self._condition(rest)
+                    stack.append((parent and taken, done or taken, parent))
+                elif kind == "else":
+                    _, done, parent = stack.pop()
+                    stack.append((parent and not done, True, parent))
+                elif kind == "endif":
+                    stack.pop()
+                elif kind == "define" and active:
+                    match = re.match(r"(\w+)(?!\()\s*(.*)", rest)
+                    if match and match.group(1) not in self.defines:
+                        self.defines[match.group(1)] = match.group(2).strip()
+                continue
+            if active:
+                out.append(line)
+        return "\n".join(out)
+
+    def value(self, name, default=None):
+        """Evaluate a #define, e.g. value('TELE_QUEUE_SPILL_SIZE')"""
+        if name not in self.defines:
+            if default is None:
+                raise KeyError(name)
+            return default
+        return self.evaluate(self.defines[name])
+
+    def evaluate(self, expression):
+        expression = re.sub(r"sizeof\s*\(\s*(\w+)\s*\)", lambda m: str(self.sizeof(m.group(1))), expression)
+        expression = re.sub(r"(\d+)(UL|U|L)\b", r"\1", expression)
+        expression = re.sub(r"[A-Za-z_]\w*", lambda m: str(self.value(m.group(0))), expression)
+        # Constants are all integer arithmetic
+        return int(eval(expression.replace("/", "//")))
+
+    def sizeof(self, struct):
+        if struct not in self.structs:
+            body = re.search(r"struct\s+%s\s*\{(.*?)\};" % struct, self.text, re.S).group(1)
+            fields = []
+            for type_name, name, count in re.findall(r"^\s*(\w+)\s+(\w+)\s*(?:\[(.+?)\])?\s*(?:=[^;]*)?;", body, re.M):
+                c_type = C_TYPES.get(type_name) or self._struct_type(type_name)
+                if count:
+                    c_type = c_type * self.evaluate(count)
+                fields.append((name, c_type))
+            self.structs[struct] = type(struct, (ctypes.Structure,), {"_fields_": fields})
+        return ctypes.sizeof(self.structs[struct])
+
+    def _struct_type(self, name):
+        self.sizeof(name)
+        return self.structs[name]
+
+    # ----------------------------------------------------------- schemas
+    def strings(self, name):
+        """A const char * const NAME[] = { ... } array"""
+        body = re.search(r"const\s+char\s*\*\s*const\s+%s\s*\[\]\s*=\s*\{(.*?)\};" % name, self.text, re.S).group(1)
+        return re.findall(r'"((?:[^"\\]|\\.)*)"', body)
+
+    def _argument(self, text):
+        text = text.strip()
+        if text.startswith('"'):
+            return "".join(re.findall(r'"((?:[^"\\]|\\.)*)"', text))
+        if text == "nullptr":
+            return None
+        if text in ("true", "false"):
+            return text == "true"
+        if text.startswith("&"):
+            return self._table(text[1:])
+        match = re.match(r"FIELD_COUNT\((\w+)\)", text)
+        if match:
+            return len(self.strings(match.group(1)))
+        if text == "FIELD_NO_MAXIMUM":
+            return FIELD_NO_MAXIMUM
+        try:
+            return self.evaluate(text)
+        except (KeyError, SyntaxError, NameError):
+            # a handler or enum values array
+            return text
+
+    def _table(self, name):
+        """Fields of a fields::table_t, as (kind, arguments) tuples"""
+        match = re.search(r"const\s+fields::table_t\s+%s\s*=\s*\{\s*(\w+)" % name, self.text)
+        fields_name = match.group(1) if match else name
+        body = re.search(r"const\s+fields::field_t\s+%s\s*\[\]\s*=\s*\{(.*?)\n\};" % fields_name, self.text, re.S).group(1)
+
+        fields = []
+        for entry in _split_top_level(body):
+            match = re.match(r"fields::(\w+)\s*\((.*)\)$", entry, re.S)
+            fields.append((match.group(1), [self._argument(a) for a in _split_top_level(match.group(2))]))
+        return fields
+
+    def _schema_field(self, kind, args):
+        name = args[0]
+        prop = {}
+
+        def describe(title, description):
+            if title:
+                prop["title"] = title
+            if description:
+                prop["description"] = description
+
+        if kind == "integer":
+            describe(*(args[4:6] + [None, None])[:2])
+            prop["type"] = "integer"
+            prop["minimum"] = args[1]
+            if args[2] != FIELD_NO_MAXIMUM:
+                prop["maximum"] = args[2]
+        elif kind == "flag":
+            describe(*(args[2:4] + [None, None])[:2])
+            prop["type"] = "boolean"
+        elif kind == "enumeration":
+            describe(*(args[4:6] + [None, None])[:2])
+            prop["type"] = "string"
+            prop["enum"] = self.strings(args[1])
+        elif kind == "string":
+            describe(*(args[3:5] + [None, None])[:2])
+            prop["type"] = "string"
+            prop["maxLength"] = args[1]
+        elif kind == "colour":
+            describe(None, args[4] if len(args) > 4 else None)
+            prop["type"] = "array"
+            prop["maxItems"] = args[1]
+            prop["items"] = {"type": "integer", "minimum": 0, "maximum": 255}
+        elif kind == "object":
+            describe(*(args[3:5] + [None, None])[:2])
+            prop["type"] = "object"
+            prop["properties"] = self.schema(args[1])
+        elif kind == "objectArray":
+            describe(*(args[4:6] + [None, None])[:2])
+            prop["type"] = "array"
+            if args[1]:
+                prop["maxItems"] = args[1]
+            prop["items"] = {"type": "object", "properties": self.schema(args[2])}
+            required = [a[0] for k, a in args[2] if k == "enumeration" and len(a) > 6 and a[6]]
+            if required:
+                prop["items"]["required"] = required
+        return name, prop
+
+    def schema(self, table):
+        """JSON schema properties for a table, as fields::schema() builds them"""
+        if isinstance(table, str):
+            table = self._table(table)
+        return dict(self._schema_field(kind, args) for kind, args in table)
+
+    def adoption(self, client_id, version="SIM"):
+        """The apiAdopt() payload, less anything the I2C sensor library adds"""
+        def schema(table):
+            return {
+                "$schema": JSON_SCHEMA_VERSION,
+                "title": self.info["short_name"],
+                "type": "object",
+                "properties": self.schema(table),
+            }
+
+        return {
+            "firmware": {
+                "name": self.info["name"],
+                "shortName": self.info["short_name"],
+                "maker": self.info["maker"],
+                "version": version,
+                "githubUrl": self.info["github_url"],
+            },
+            "system": {
+                "heapUsedBytes": 3104, "heapFreeBytes": 27456, "flashChipSizeBytes": 4194304,
+                "sketchSpaceUsedBytes": 482160, "sketchSpaceTotalBytes": 1613824,
+                "fileSystemUsedBytes": 0, "fileSystemTotalBytes": 1024000,
+                "telemetryBacklog": {"depth": 0, "drops": 0, "lastDrainMs": 0},
+            },
+            "network": {"mode": "wifi", "ip": "192.168.100.123", "mac": ":".join(client_id[i:i + 2].upper() for i in range(0, 6, 2)) + ":00:00:00"},
+            "configSchema": schema("configTable"),
+            "commandSchema": schema("commandTable"),
+        }
+
+    def log_lines(self, pattern):
+        """logger.println() lines in main.cpp matching a regex"""
+        return [line for line in re.findall(r'logger\.println\(F\("([^"]*)"\)\)', self.text) if re.search(pattern, line)]
+
+
+if __name__ == "__main__":
+    firmware = Firmware()
+    payload = json.dumps(firmware.adoption("a1b2c3"), separators=(",", ":"))
+    print(payload)
+    print("%d bytes" % len(payload))
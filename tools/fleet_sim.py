@@ -0,0 +1,534 @@
+"""
+Fleet load simulator for the vindriktning firmware
+
+Runs N virtual devices against a local MQTT broker (e.g. Mosquitto), each
+mimicking the firmware's MQTT behaviour:
+
+  - connects as <6 hex digit client id>, subscribes to +/<id> and cmnd/<id>/leds
+  - publishes adoption info (adopt/<id>) on every connect, generated from the
+    firmware's config/command field tables (or --adopt-file, a payload
+    captured from a real device, which includes the I2C sensor schemas)
+  - handles config/command messages (conf/<id>, cmnd/<id>)
+  - publishes telemetry (tele/<id>) every --tele-interval seconds, and ships
+    the log lines that go with each reading (log/<id>) in batches
+  - queues telemetry while disconnected and drains it after reconnecting
+    (same queue size, jitter/batch/rate limits as the firmware)
+
+Queue sizes, rate limits, log lines and the field tables are read from the
+firmware sources by tools/firmware.py, so the simulation tracks the build.
+  - reconnects with the OXRS_MQTT backoff after a disconnect
+
+A reconnect storm can be triggered with --storm-at, which drops every device
+at once. At the end the broker message rate, bytes per device per hour and
+reconnect convergence time are reported.
+
+With --command-rate, LED (and with --restart-ratio, restart) commands carrying
+a correlationId are sent to random devices and their acks collected, giving
+command latency percentiles - both end to end and the device's own
+apply/show/restart timings. --command-targets sends them to real devices
+instead of the simulated ones.
+
+  pip install paho-mqtt
+  python tools/fleet_sim.py --devices 1000 --duration 300 --storm-at 120
+  python tools/fleet_sim.py --devices 0 --command-rate 2 --command-targets a1b2c3
+"""
+
+import argparse
+import json
+import random
+import selectors
+import socket
+import statistics
+import time
+
+import paho.mqtt.client as mqtt
+
+import firmware
+
+# Simulated device timings
+LED_FRAME_S = 0.02                  # ANIM_FRAME_MS/fade interval, time to the next LED frame
+RESTART_S = 3.0                     # time for a restart to get back to WiFi/MQTT
+
+# OXRS_MQTT reconnect backoff
+BACKOFF_INITIAL_S = 5
+BACKOFF_MAX_S = 30
+
+
+class FirmwareModel:
+    """Queue sizes, rate limits, log lines and the adoption payload, taken from
+    the firmware sources (see firmware.py) so the simulation tracks the build"""
+
+    def __init__(self, args):
+        fw = firmware.Firmware(led=None if args.led == "none" else args.led)
+
+        self.tele_queue_size = fw.value("TELE_QUEUE_RAM_SIZE") + fw.value("TELE_QUEUE_SPILL_SIZE")
+        self.drain_interval_s = fw.value("TELE_DRAIN_INTERVAL_MS") / 1000.0
+        self.drain_batch_size = fw.value("TELE_DRAIN_BATCH_SIZE")
+        self.drain_jitter_s = fw.value("TELE_DRAIN_JITTER_MS") / 1000.0
+
+        self.log_ring_lines = fw.value("LOG_RING_LINES")
+        self.log_batch_lines = fw.value("LOG_BATCH_LINES")
+        self.log_flush_interval_s = fw.value("LOG_FLUSH_INTERVAL_MS") / 1000.0
+
+        # The lines logged around every telemetry reading, keyed by what follows "tele "
+        self.tele_log = {line.split(" tele ", 1)[1]: line for line in fw.log_lines(r"\] tele ")}
+        for key in ("update ready", "state valid", "data sent", "data queued"):
+            if key not in self.tele_log:
+                raise ValueError("firmware no longer logs 'tele %s', update fleet_sim.py" % key)
+
+        # A captured payload (e.g. mosquitto_sub -t adopt/<id> -C 1) includes
+        # whatever the I2C sensor library adds to the schemas, the generated
+        # one is only what this firmware's field tables describe
+        if args.adopt_file:
+            with open(args.adopt_file) as f:
+                self.adopt_template = f.read().strip()
+        else:
+            self.adopt_template = None
+            self.firmware = fw
+
+    def adoption_payload(self, client_id):
+        if self.adopt_template:
+            return self.adopt_template
+        return json.dumps(self.firmware.adoption(client_id), separators=(",", ":"))
+
+
+class Stats:
+    def __init__(self):
+        self.published = 0
+        self.published_bytes = 0
+        self.kind_bytes = {}
+        self.received = 0
+        self.disconnects = 0
+        self.queue_drops = 0
+        self.log_drops = 0
+
+        # command latency, seconds (end to end) or device reported
+        self.command_latency = {"led": [], "restart": []}
+        self.apply_us = []
+        self.show_us = []
+        self.restart_ms = []
+
+
+class VirtualDevice:
+    def __init__(self, index, args, stats, model):
+        self.client_id = "%06x" % (0x100000 + index)
+        self.args = args
+        self.stats = stats
+        self.model = model
+
+        self.connected = False
+        self.next_connect = 0.0
+        self.backoff = BACKOFF_INITIAL_S
+        self.connected_at = None
+
+        self.next_tele = time.monotonic() + random.uniform(0, args.tele_interval)
+        self.tele_interval = args.tele_interval
+        self.backlog = []
+        self.drain_not_before = 0.0
+        self.last_drain = 0.0
+
+        # bufferedLogger ring, shipped in batches to log/<id>
+        self.log_ring = []
+        self.last_log_flush = 0.0
+
+        # device clock, and acks waiting for an LED frame or a restart
+        self.started = time.monotonic()
+        self.pending_acks = []
+        self.restart_ack = None
+
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=self.client_id)
+        self.client.on_connect = self._on_connect
+        self.client.on_disconnect = self._on_disconnect
+        self.client.on_message = self._on_message
+
+    def _topic(self, kind, suffix=None):
+        topic = "%s/%s" % (kind, self.client_id)
+        if self.args.prefix:
+            topic = "%s/%s" % (self.args.prefix, topic)
+        if suffix:
+            topic = "%s/%s" % (topic, suffix)
+        return topic
+
+    def _publish(self, kind, payload, retain=False):
+        topic = self._topic(kind)
+        info = self.client.publish(topic, payload, retain=retain)
+        if info.rc != mqtt.MQTT_ERR_SUCCESS:
+            return False
+        self.stats.published += 1
+        self.stats.published_bytes += len(topic) + len(payload)
+        self.stats.kind_bytes[kind] = self.stats.kind_bytes.get(kind, 0) + len(topic) + len(payload)
+        return True
+
+    # firmware: bufferedLogger, the oldest line goes when the ring is full
+    def _log(self, line):
+        if len(self.log_ring) == self.model.log_ring_lines:
+            self.log_ring.pop(0)
+            self.stats.log_drops += 1
+        self.log_ring.append(line)
+
+    # firmware: mqttConnected()
+    def _on_connect(self, client, userdata, flags, reason_code, properties):
+        if reason_code.is_failure:
+            self._schedule_reconnect()
+            return
+
+        self.connected = True
+        self.connected_at = time.monotonic()
+        self.backoff = BACKOFF_INITIAL_S
+
+        client.subscribe(self._topic("+"))
+        client.subscribe(self._topic("cmnd", "leds"))
+
+        self._publish("adopt", self.model.adoption_payload(self.client_id), retain=True)
+        self.drain_not_before = time.monotonic() + random.uniform(0, self.model.drain_jitter_s)
+
+        if self.restart_ack:
+            ack = self.restart_ack
+            ack["restartMs"] = self._device_ms() - ack["receivedMs"]
+            self._publish("stat", json.dumps(ack, separators=(",", ":")))
+            self.restart_ack = None
+
+    # firmware: mqttDisconnected()
+    def _on_disconnect(self, client, userdata, flags, reason_code, properties):
+        if self.connected:
+            self.stats.disconnects += 1
+        self.connected = False
+        self._schedule_reconnect()
+
+    # firmware: mqttConfig()/mqttCommand()
+    def _on_message(self, client, userdata, message):
+        self.stats.received += 1
+
+        if message.topic.endswith("/leds"):
+            return
+
+        try:
+            payload = json.loads(message.payload)
+        except ValueError:
+            return
+
+        if message.topic == self._topic("conf"):
+            seconds = payload.get("ikeaSensorUpdateSeconds")
+            if seconds:
+                self.tele_interval = seconds
+
+        if message.topic == self._topic("cmnd"):
+            self._command(payload)
+
+    # firmware: mqttCommand()/startCommandAck()
+    def _command(self, payload):
+        now = time.monotonic()
+        correlation_id = payload.get("correlationId")
+
+        if not correlation_id:
+            if payload.get("restart"):
+                self._restart()
+            return
+
+        ack = {"type": "ack", "correlationId": correlation_id, "receivedMs": self._device_ms()}
+
+        if payload.get("restart"):
+            self.restart_ack = ack
+            self._restart()
+            return
+
+        ack["applyUs"] = random.randint(200, 2000)
+        if "LED" in payload or "animation" in payload:
+            self.pending_acks.append((now + random.uniform(0, LED_FRAME_S), now, ack))
+        else:
+            self._publish("stat", json.dumps(ack, separators=(",", ":")))
+
+    def _device_ms(self):
+        return int((time.monotonic() - self.started) * 1000)
+
+    def _restart(self):
+        self.client.disconnect()
+        self.connected = False
+        self.next_connect = time.monotonic() + RESTART_S
+
+    def _schedule_reconnect(self):
+        self.next_connect = time.monotonic() + self.backoff
+        self.backoff = min(self.backoff * 2, BACKOFF_MAX_S)
+
+    def connect(self):
+        try:
+            self.client.connect_async(self.args.host, self.args.port, keepalive=self.args.keepalive)
+            self.client.reconnect()
+        except OSError:
+            self._schedule_reconnect()
+            return
+        self.next_connect = None
+
+    def drop(self):
+        """Simulate a network drop (no clean DISCONNECT), paho sees EOF on the next read"""
+        sock = self.client.socket()
+        if sock:
+            try:
+                sock.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+
+    def _reading(self):
+        return {
+            "pm25": random.randint(0, 60),
+            "temperature": round(random.uniform(18, 26), 2),
+            "humidity": round(random.uniform(30, 60), 2),
+            "lux": random.randint(0, 500),
+        }
+
+    # firmware: telemetry block in loop() and drainBacklog()
+    def tick(self, now):
+        if not self.connected and self.next_connect is not None and now >= self.next_connect:
+            self.connect()
+
+        # acks waiting for the first LED frame with the change
+        while self.pending_acks and self.pending_acks[0][0] <= now and self.connected:
+            shown, received, ack = self.pending_acks.pop(0)
+            ack["showUs"] = int((shown - received) * 1000000)
+            self._publish("stat", json.dumps(ack, separators=(",", ":")))
+
+        if self.tele_interval and now >= self.next_tele:
+            self.next_tele = now + self.tele_interval
+            reading = self._reading()
+            log = self.model.tele_log
+
+            self._log(log["update ready"])
+            self._log(log["state valid"])
+
+            if self.connected and not self.backlog:
+                self._publish("tele", json.dumps(reading, separators=(",", ":")))
+                self._log(log["data sent"])
+            else:
+                reading["_ms"] = now
+                self.backlog.append(reading)
+                if len(self.backlog) > self.model.tele_queue_size:
+                    self.backlog.pop(0)
+                    self.stats.queue_drops += 1
+                self._log(log["data queued"])
+
+        if self.connected and self.backlog and now >= self.drain_not_before and now - self.last_drain >= self.model.drain_interval_s:
+            self.last_drain = now
+            for _ in range(min(self.model.drain_batch_size, len(self.backlog))):
+                reading = self.backlog.pop(0)
+                reading["ageMs"] = int((now - reading.pop("_ms")) * 1000)
+                self._publish("tele", json.dumps(reading, separators=(",", ":")))
+
+        # firmware: bufferedLogger.loop(), one newline separated batch per interval
+        if self.connected and self.log_ring and now - self.last_log_flush >= self.model.log_flush_interval_s:
+            self.last_log_flush = now
+            batch = self.log_ring[:self.model.log_batch_lines]
+            del self.log_ring[:self.model.log_batch_lines]
+            self._publish("log", "\n".join(batch))
+
+
+class BrokerObserver:
+    """Counts what the broker actually delivers, i.e. the broker message rate"""
+
+    def __init__(self, args, stats):
+        self.args = args
+        self.stats = stats
+        self.messages = 0
+        self.bytes = 0
+
+        # correlationId -> (kind, time sent)
+        self.pending = {}
+        self.sequence = 0
+
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id="fleet-sim-observer")
+        self.client.on_connect = lambda c, u, f, rc, p: c.subscribe(("%s/#" % args.prefix) if args.prefix else "#")
+        self.client.on_message = self._on_message
+        self.client.connect(args.host, args.port)
+
+    def _on_message(self, client, userdata, message):
+        self.messages += 1
+        self.bytes += len(message.topic) + len(message.payload)
+
+        if "/stat/" not in "/" + message.topic:
+            return
+
+        try:
+            payload = json.loads(message.payload)
+        except ValueError:
+            return
+
+        if not isinstance(payload, dict) or payload.get("type") != "ack":
+            return
+
+        sent = self.pending.pop(payload.get("correlationId"), None)
+        if not sent:
+            return
+
+        kind, sent_at = sent
+        self.stats.command_latency[kind].append(time.monotonic() - sent_at)
+        if "applyUs" in payload:
+            self.stats.apply_us.append(payload["applyUs"])
+        if "showUs" in payload:
+            self.stats.show_us.append(payload["showUs"])
+        if "restartMs" in payload:
+            self.stats.restart_ms.append(payload["restartMs"])
+
+    def send_command(self, client_id):
+        """An LED (or restart) command with a correlationId, acked by the device"""
+        self.sequence += 1
+        correlation_id = "sim-%d" % self.sequence
+
+        if random.random() < self.args.restart_ratio:
+            kind = "restart"
+            command = {"restart": True}
+        else:
+            kind = "led"
+            colour = [random.randint(0, 255) for _ in range(3)]
+            command = {"LED": [{"mode": "manual", "state": "on", "pixel1": colour, "pixel2": colour, "pixel3": colour}]}
+
+        command["correlationId"] = correlation_id
+
+        topic = "cmnd/%s" % client_id
+        if self.args.prefix:
+            topic = "%s/%s" % (self.args.prefix, topic)
+
+        self.pending[correlation_id] = (kind, time.monotonic())
+        self.client.publish(topic, json.dumps(command, separators=(",", ":")))
+
+
+def percentiles(values):
+    ordered = sorted(values)
+    pick = lambda p: ordered[min(len(ordered) - 1, int(len(ordered) * p))]
+    return "p50=%.1f p90=%.1f p99=%.1f max=%.1f (n=%d)" % (pick(0.5), pick(0.9), pick(0.99), ordered[-1], len(ordered))
+
+
+def run(args):
+    stats = Stats()
+    model = FirmwareModel(args)
+    observer = BrokerObserver(args, stats)
+    devices = [VirtualDevice(i, args, stats, model) for i in range(args.devices)]
+
+    command_targets = args.command_targets.split(",") if args.command_targets else [d.client_id for d in devices]
+    next_command = time.monotonic() + args.ramp
+
+    # stagger the initial connects like a fleet powering up
+    start = time.monotonic()
+    for device in devices:
+        device.next_connect = start + random.uniform(0, args.ramp)
+
+    selector = selectors.DefaultSelector()
+    registered = {}
+
+    storm_at = start + args.storm_at if args.storm_at else None
+    storm_started = None
+    storm_converged = None
+    last_report = start
+
+    while True:
+        now = time.monotonic()
+        if now - start >= args.duration:
+            break
+
+        if storm_at and now >= storm_at:
+            print("reconnect storm: dropping %d devices" % len(devices))
+            for device in devices:
+                device.drop()
+            storm_at = None
+            storm_started = now
+
+        for device in devices:
+            device.tick(now)
+
+        if args.command_rate and command_targets and now >= next_command:
+            next_command = now + random.expovariate(args.command_rate)
+            observer.send_command(random.choice(command_targets))
+
+        # (re)register sockets, they change on every reconnect
+        for client in [d.client for d in devices] + [observer.client]:
+            sock = client.socket()
+            known = registered.get(client)
+            if known is not sock:
+                if known is not None:
+                    try:
+                        selector.unregister(known)
+                    except (KeyError, ValueError):
+                        pass
+                if sock is not None:
+                    selector.register(sock, selectors.EVENT_READ, client)
+                registered[client] = sock
+            if sock is not None and client.want_write():
+                client.loop_write()
+
+        for key, _ in selector.select(timeout=0.05):
+            key.data.loop_read()
+
+        for client in registered:
+            if registered[client] is not None:
+                client.loop_misc()
+
+        if storm_started and not storm_converged and all(d.connected for d in devices):
+            storm_converged = now - storm_started
+            print("reconnect storm converged in %.1fs" % storm_converged)
+
+        if now - last_report >= args.report_interval:
+            last_report = now
+            connected = sum(1 for d in devices if d.connected)
+            backlog = sum(len(d.backlog) for d in devices)
+            print("t=%5.0fs connected=%d/%d broker msgs=%d backlog=%d" % (now - start, connected, len(devices), observer.messages, backlog))
+
+    elapsed = time.monotonic() - start
+    hours = elapsed / 3600.0
+
+    print()
+    print("devices:                      %d" % len(devices))
+    print("duration:                     %.0fs" % elapsed)
+    print("published:                    %d msgs, %d bytes" % (stats.published, stats.published_bytes))
+    print("broker message rate:          %.1f msgs/s" % (observer.messages / elapsed))
+    # No simulated devices with --devices 0 (only driving --command-targets)
+    if devices:
+        print("bytes per device per hour:    %.0f" % (stats.published_bytes / len(devices) / hours))
+    print("disconnects:                  %d" % stats.disconnects)
+    if devices:
+        for kind in sorted(stats.kind_bytes):
+            print("%-30s%.0f" % ("  %s:" % kind, stats.kind_bytes[kind] / len(devices) / hours))
+    print("telemetry dropped (queue):    %d" % stats.queue_drops)
+    print("log lines dropped (ring):     %d" % stats.log_drops)
+    if storm_started:
+        if storm_converged is not None:
+            print("reconnect convergence:        %.1fs" % storm_converged)
+        else:
+            print("reconnect convergence:        not converged (%d/%d connected)" % (sum(1 for d in devices if d.connected), len(devices)))
+
+    for kind, latencies in stats.command_latency.items():
+        if latencies:
+            print("%-30s%s" % ("%s command -> ack (ms):" % kind, percentiles([l * 1000 for l in latencies])))
+    if stats.apply_us:
+        print("device apply (us):            %s" % percentiles(stats.apply_us))
+    if stats.show_us:
+        print("device first LED frame (us):  %s" % percentiles(stats.show_us))
+    if stats.restart_ms:
+        print("device restart (ms):          %s" % percentiles(stats.restart_ms))
+    if args.command_rate:
+        print("commands without an ack:      %d" % len(observer.pending))
+
+    connect_times = [d.connected_at - start for d in devices if d.connected_at]
+    if connect_times:
+        print("last connect (median/max):    %.1fs / %.1fs" % (statistics.median(connect_times), max(connect_times)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate a fleet of vindriktning devices against an MQTT broker")
+    parser.add_argument("--host", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--prefix", default="", help="MQTT topic prefix, as configured on the devices")
+    parser.add_argument("--devices", type=int, default=100)
+    parser.add_argument("--duration", type=float, default=300, help="seconds to run for")
+    parser.add_argument("--ramp", type=float, default=10, help="spread initial connects over this many seconds")
+    parser.add_argument("--tele-interval", type=float, default=60, help="telemetry interval (ikeaSensorUpdateSeconds)")
+    parser.add_argument("--keepalive", type=int, default=15)
+    parser.add_argument("--storm-at", type=float, default=0, help="drop every device this many seconds in (0 = no storm)")
+    parser.add_argument("--report-interval", type=float, default=10)
+    parser.add_argument("--command-rate", type=float, default=0, help="commands per second with a correlationId, to measure latency (0 = none)")
+    parser.add_argument("--restart-ratio", type=float, default=0, help="fraction of those commands which are restarts")
+    parser.add_argument("--command-targets", default="", help="comma separated client ids to command instead of the simulated devices")
+    parser.add_argument("--led", choices=["rgbw", "rgb", "none"], default="rgbw", help="LED build to model, changes the adoption schemas")
+    parser.add_argument("--adopt-file", default="", help="adoption payload captured from a real device, instead of one generated from the field tables")
+    run(parser.parse_args())
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,262 @@
+"""
+End to end test for the Linux gateway (src/gateway), no hardware needed
+
+Stands in for --sensors PM1006 sensors with pseudo terminals, runs the
+gateway binary on their slave ends against a real MQTT broker and writes
+PM1006 frames to the master ends, each sensor with its own PM 2.5 value.
+The stream is cut into random sized writes and salted with line noise,
+false headers and frames with bad checksums, so the gateway has to
+re-synchronise the way it does on a real wire. Then checks that:
+
+  - every sensor's tele/<id> telemetry arrives with its own pm25 value
+  - the noise was counted as rejected frames rather than as readings
+  - a sensor which goes away (its pty closed, i.e. unplugged) doesn't hold
+    up the others
+  - the gateway's CPU time stays under --max-cpu percent of one core
+
+  pip install paho-mqtt
+  pio run -e gateway
+  python tools/gateway_pty_test.py --port 1883 --sensors 32
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import subprocess
+import sys
+import threading
+import time
+import tty
+
+import paho.mqtt.client as mqtt
+
+HEADER = bytes([0x16, 0x11, 0x0B])
+FRAME_LENGTH = 20
+
+STATS = re.compile(r"^\[(\S+)\] bytes=(\d+) frames=(\d+) rejected=(\d+)")
+
+
+def frame(pm25):
+    """A valid PM1006 frame, PM 2.5 in DF3/DF4 and all 20 bytes summing to 0"""
+    data = bytearray(HEADER + bytes(FRAME_LENGTH - len(HEADER)))
+    data[5] = pm25 >> 8
+    data[6] = pm25 & 0xFF
+    data[-1] = -sum(data) & 0xFF
+    return bytes(data)
+
+
+class Sensor:
+    def __init__(self, index, rng):
+        self.client_id = "pty%02d" % index
+        self.pm25 = 5 + index * 37 % 500
+        self.master, self.slave = os.openpty()
+        tty.setraw(self.slave)
+        self.path = os.ttyname(self.slave)
+        self.rng = rng
+        self.sent = 0
+        self.corrupted = 0
+
+    def stream(self):
+        """The next burst of bytes, one good frame plus maybe some noise"""
+        data = bytearray()
+        roll = self.rng.random()
+
+        if roll < 0.2:
+            # line noise, which may include the first bytes of a header
+            data += bytes(self.rng.randrange(256) for _ in range(self.rng.randrange(1, 8)))
+            data += HEADER[:self.rng.randrange(1, 3)]
+        elif roll < 0.3:
+            bad = bytearray(frame(self.pm25 + 100))
+            bad[self.rng.randrange(len(HEADER), FRAME_LENGTH)] ^= 0x5A
+            data += bad
+            self.corrupted += 1
+
+        data += frame(self.pm25)
+        self.sent += 1
+        return bytes(data)
+
+    def write(self):
+        data = self.stream()
+        while data:
+            chunk = self.rng.randrange(1, len(data) + 1)
+            os.write(self.master, data[:chunk])
+            data = data[chunk:]
+
+    def unplug(self):
+        os.close(self.master)
+        self.master = None
+
+    def close(self):
+        if self.master is not None:
+            os.close(self.master)
+        os.close(self.slave)
+
+
+class Telemetry:
+    """Latest pm25 seen on tele/<id> for each sensor"""
+
+    def __init__(self, args, prefix):
+        self.readings = {}
+        self.lock = threading.Lock()
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id="gateway-pty-test-%d" % os.getpid())
+        self.client.on_message = self._on_message
+        self.client.connect(args.host, args.port)
+        self.client.subscribe(prefix + "/tele/+")
+        self.client.loop_start()
+
+    def _on_message(self, client, userdata, message):
+        client_id = message.topic.rsplit("/", 1)[1]
+        with self.lock:
+            self.readings[client_id] = json.loads(message.payload).get("pm25")
+
+    def clear(self):
+        with self.lock:
+            self.readings.clear()
+
+    def snapshot(self):
+        with self.lock:
+            return dict(self.readings)
+
+    def stop(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+class Gateway:
+    def __init__(self, args, prefix, sensors):
+        command = [args.gateway, "-h", args.host, "-p", str(args.port), "-t", prefix, "-i", "1"]
+        command += ["%s=%s" % (s.path, s.client_id) for s in sensors]
+
+        self.stats = {}
+        self.lines = []
+        self.process = subprocess.Popen(command, stderr=subprocess.PIPE, text=True)
+        self.reader = threading.Thread(target=self._read, daemon=True)
+        self.reader.start()
+
+    def _read(self):
+        for line in self.process.stderr:
+            self.lines.append(line.rstrip())
+            match = STATS.match(line)
+            if match:
+                self.stats[match.group(1)] = [int(v) for v in match.groups()[1:]]
+
+    def cpu_seconds(self):
+        with open("/proc/%d/stat" % self.process.pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        # utime and stime, fields 14 and 15
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+    def alive(self):
+        return self.process.poll() is None
+
+    def stop(self):
+        self.process.terminate()
+        try:
+            self.process.wait(5)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+        self.reader.join(1)
+
+
+def feed(sensors, interval, deadline, until):
+    """Write frames from every sensor every 'interval' until until() or the deadline"""
+    while time.monotonic() < deadline and not until():
+        for sensor in sensors:
+            if sensor.master is not None:
+                sensor.write()
+        time.sleep(interval)
+    return until()
+
+
+def expected(sensors):
+    return {s.client_id: s.pm25 for s in sensors if s.master is not None}
+
+
+def run(args):
+    rng = random.Random(args.seed)
+    prefix = "gateway-pty-test-%d" % os.getpid()
+    sensors = [Sensor(i, rng) for i in range(args.sensors)]
+    telemetry = Telemetry(args, prefix)
+    gateway = Gateway(args, prefix, sensors)
+    ok = True
+
+    try:
+        def all_reported():
+            readings = telemetry.snapshot()
+            return all(readings.get(k) == v for k, v in expected(sensors).items())
+
+        start = time.monotonic()
+        cpu_start = gateway.cpu_seconds()
+
+        if feed(sensors, args.interval, start + args.timeout, all_reported):
+            print("all %d sensors reported in %.1fs" % (len(sensors), time.monotonic() - start))
+        else:
+            readings = telemetry.snapshot()
+            wrong = {k: readings.get(k) for k, v in expected(sensors).items() if readings.get(k) != v}
+            print("FAIL %d sensors missing or wrong: %s" % (len(wrong), dict(list(wrong.items())[:8])))
+            ok = False
+
+        # Keep going for the CPU figure, then unplug one and check the rest carry on
+        feed(sensors, args.interval, time.monotonic() + args.duration, lambda: False)
+        elapsed = time.monotonic() - start
+        cpu = (gateway.cpu_seconds() - cpu_start) / elapsed * 100
+        frames = sum(s.sent for s in sensors)
+        print("%d frames (%.0f/s), gateway cpu %.2f%% of a core" % (frames, frames / elapsed, cpu))
+        if cpu > args.max_cpu:
+            print("FAIL cpu above %.1f%%" % args.max_cpu)
+            ok = False
+
+        sensors[0].unplug()
+        telemetry.clear()
+        if not feed(sensors, args.interval, time.monotonic() + args.timeout, all_reported):
+            print("FAIL remaining sensors stopped reporting after %s was unplugged" % sensors[0].client_id)
+            ok = False
+        elif len(sensors) > 1:
+            print("remaining %d sensors still reporting with %s unplugged" % (len(sensors) - 1, sensors[0].client_id))
+
+        # Wait for a stats line after the last writes
+        time.sleep(1.5)
+        for sensor in sensors:
+            stats = gateway.stats.get(sensor.client_id)
+            if not stats:
+                print("FAIL no stats from the gateway for %s" % sensor.client_id)
+                ok = False
+            elif sensor.corrupted and not stats[2]:
+                print("FAIL %s: %d corrupted frames sent, none rejected" % (sensor.client_id, sensor.corrupted))
+                ok = False
+
+        if not gateway.alive():
+            print("FAIL gateway exited with %d" % gateway.process.returncode)
+            ok = False
+    finally:
+        gateway.stop()
+        telemetry.stop()
+        for sensor in sensors:
+            sensor.close()
+
+    if not ok:
+        for line in gateway.lines[-20:]:
+            print("gateway: " + line)
+
+    print("PASS" if ok else "FAIL")
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--gateway", default=".pio/build/gateway/program", help="gateway binary")
+    parser.add_argument("--host", default="localhost", help="MQTT broker")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--sensors", type=int, default=8, help="ptys to stand in for sensors (max 64)")
+    parser.add_argument("--interval", type=float, default=0.1, help="seconds between frames from each sensor")
+    parser.add_argument("--duration", type=float, default=5, help="seconds to keep feeding for the CPU figure")
+    parser.add_argument("--timeout", type=float, default=20, help="seconds to wait for the expected telemetry")
+    parser.add_argument("--max-cpu", type=float, default=10, help="fail above this percentage of a core")
+    parser.add_argument("--seed", type=int, default=1)
+    sys.exit(run(parser.parse_args()))
+
+
+if __name__ == "__main__":
+    main()
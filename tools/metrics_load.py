@@ -0,0 +1,277 @@
+"""
+/metrics load test for the vindriktning firmware
+
+Scrapes GET /metrics on a real device from --clients concurrent clients as
+fast as it will answer for --duration seconds, alongside --slow-clients
+which read their responses a trickle at a time and --idle-clients which
+open a connection, send half a request and wait to be dropped. Then checks
+that:
+
+  - every scrape was valid Prometheus text (0.0.4) exposition, i.e. each
+    sample belongs to the family named by its TYPE line
+  - the PM sensor UART links didn't suffer, no new overflows, header or
+    checksum errors, and frames kept arriving
+  - no loop() stage stalled
+  - /metrics never outgrew a connection slot's buffer (blocking writes)
+    and free heap didn't drop by more than --heap-margin bytes
+  - idle clients were dropped
+
+and reports the scrape rate, scrape latency percentiles and the worst loop()
+period seen by the device. Exits non-zero if any check fails.
+
+  python tools/metrics_load.py 192.168.1.50 --clients 4 --duration 60
+  python tools/metrics_load.py 192.168.1.50 --clients 2 --slow-clients 2 --idle-clients 2
+"""
+
+import argparse
+import re
+import socket
+import statistics
+import sys
+import threading
+import time
+
+SAMPLE = re.compile(r'^([a-zA-Z_:][a-zA-Z0-9_:]*)(\{[^}]*\})? (\S+)$')
+
+# Summed over their labels, these must not go up under load
+MUST_NOT_INCREASE = [
+    "aqs_uart_overflows_total",
+    "aqs_uart_header_errors_total",
+    "aqs_uart_checksum_errors_total",
+    "aqs_loop_stalls_total",
+    "aqs_http_blocking_writes_total",
+]
+
+REQUEST = b"GET /metrics HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n"
+
+
+def scrape(host, port, timeout):
+    """One GET /metrics, returns (status line, body)"""
+    with socket.create_connection((host, port), timeout=timeout) as sock:
+        sock.sendall(REQUEST % host.encode())
+        return receive(sock, 4096, 0)
+
+
+def receive(sock, size, delay):
+    """Read a whole response, 'size' bytes every 'delay' seconds, returns (status line, body)"""
+    chunks = []
+    while True:
+        chunk = sock.recv(size)
+        if not chunk:
+            break
+        chunks.append(chunk)
+        if delay:
+            time.sleep(delay)
+
+    response = b"".join(chunks).decode("ascii", "replace")
+    head, _, body = response.partition("\r\n\r\n")
+    return head.split("\r\n")[0], body
+
+
+def parse(body):
+    """Validate the exposition, returns ({sample name: summed value}, [errors])"""
+    values = {}
+    errors = []
+    family = None
+    kind = None
+
+    for line in body.splitlines():
+        if not line:
+            continue
+
+        if line.startswith("# TYPE "):
+            _, _, family, kind = line.split(" ", 3)
+            continue
+
+        if line.startswith("#"):
+            continue
+
+        match = SAMPLE.match(line)
+        if not match:
+            errors.append("unparseable: " + line)
+            continue
+
+        name = match.group(1)
+        if kind == "histogram":
+            valid = name in (family + "_bucket", family + "_sum", family + "_count")
+        else:
+            valid = name == family
+
+        if not valid:
+            errors.append("%s not in %s family %s" % (name, kind, family))
+
+        values[name] = values.get(name, 0) + float(match.group(3))
+
+    return values, errors
+
+
+class Scraper(threading.Thread):
+    def __init__(self, args, deadline):
+        super().__init__(daemon=True)
+        self.args = args
+        self.deadline = deadline
+        self.latencies = []
+        self.failures = 0
+        self.errors = []
+
+    def run(self):
+        while time.monotonic() < self.deadline:
+            start = time.monotonic()
+            try:
+                status, body = scrape(self.args.host, self.args.port, self.args.timeout)
+            except OSError as e:
+                self.failures += 1
+                self.errors.append(str(e))
+                continue
+
+            if not status.endswith("200 OK"):
+                self.failures += 1
+                self.errors.append(status)
+                continue
+
+            self.latencies.append(time.monotonic() - start)
+            self.errors.extend(parse(body)[1])
+
+
+class SlowReader(Scraper):
+    """Scrapes with a small receive window, reading a trickle at a time, so
+    the device has to hold the response and write it as the window opens"""
+
+    def run(self):
+        while time.monotonic() < self.deadline:
+            start = time.monotonic()
+            try:
+                with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+                    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1024)
+                    sock.settimeout(self.args.timeout)
+                    sock.connect((self.args.host, self.args.port))
+                    sock.sendall(REQUEST % self.args.host.encode())
+                    status, body = receive(sock, 256, self.args.slow_delay)
+            except OSError as e:
+                self.failures += 1
+                self.errors.append("slow: " + str(e))
+                continue
+
+            if not status.endswith("200 OK"):
+                self.failures += 1
+                self.errors.append("slow: " + status)
+                continue
+
+            self.latencies.append(time.monotonic() - start)
+            self.errors.extend(parse(body)[1])
+
+
+class IdleClient(threading.Thread):
+    """Sends the first line of a request and nothing more, until dropped"""
+
+    def __init__(self, args, deadline):
+        super().__init__(daemon=True)
+        self.args = args
+        self.deadline = deadline
+        self.held = []
+        self.errors = []
+
+    def run(self):
+        while time.monotonic() < self.deadline:
+            start = time.monotonic()
+            try:
+                with socket.create_connection((self.args.host, self.args.port), timeout=self.args.timeout) as sock:
+                    sock.sendall(b"GET /metrics HTTP/1.1\r\n")
+                    while sock.recv(256):
+                        pass
+            except socket.timeout:
+                self.errors.append("idle client not dropped within %.0fs" % self.args.timeout)
+                continue
+            except OSError:
+                # reset rather than closed, dropped all the same
+                pass
+
+            self.held.append(time.monotonic() - start)
+
+
+def percentile(values, p):
+    return sorted(values)[min(len(values) - 1, int(len(values) * p))]
+
+
+def run(args):
+    _, body = scrape(args.host, args.port, args.timeout)
+    before, errors = parse(body)
+    if errors:
+        print("invalid exposition: " + "; ".join(errors[:5]))
+        return 1
+
+    deadline = time.monotonic() + args.duration
+    scrapers = [Scraper(args, deadline) for _ in range(args.clients)]
+    slow = [SlowReader(args, deadline) for _ in range(args.slow_clients)]
+    idle = [IdleClient(args, deadline) for _ in range(args.idle_clients)]
+    for thread in scrapers + slow + idle:
+        thread.start()
+    for thread in scrapers + slow + idle:
+        thread.join()
+
+    _, body = scrape(args.host, args.port, args.timeout)
+    after, _ = parse(body)
+
+    latencies = [l for s in scrapers for l in s.latencies]
+    failures = sum(s.failures for s in scrapers + slow)
+    errors = [e for s in scrapers + slow + idle for e in s.errors]
+
+    print("%d scrapes (%.1f/s) from %d clients, %d failed" % (len(latencies), len(latencies) / args.duration, args.clients, failures))
+    if latencies:
+        print("scrape latency ms: p50 %.0f  p95 %.0f  max %.0f" % (
+            statistics.median(latencies) * 1000, percentile(latencies, 0.95) * 1000, max(latencies) * 1000))
+
+    slow_latencies = [l for s in slow for l in s.latencies]
+    if slow_latencies:
+        print("%d slow scrapes, p50 %.1fs" % (len(slow_latencies), statistics.median(slow_latencies)))
+
+    held = [h for i in idle for h in i.held]
+    if held:
+        print("%d idle clients dropped after p50 %.1fs" % (len(held), statistics.median(held)))
+
+    def delta(name):
+        return after.get(name, 0) - before.get(name, 0)
+
+    print("uart frames +%d, bytes +%d" % (delta("aqs_uart_frames_total"), delta("aqs_uart_bytes_total")))
+    print("loop period max %dus, heap free %d, max block %d" % (
+        after.get("aqs_loop_period_max_us", 0), after.get("aqs_heap_free_bytes", 0), after.get("aqs_heap_max_block_bytes", 0)))
+    print("http requests +%d, timeouts +%d, blocking writes +%d" % (
+        delta("aqs_http_requests_total"), delta("aqs_http_timeouts_total"), delta("aqs_http_blocking_writes_total")))
+
+    ok = failures == 0 and not errors
+    for error in sorted(set(errors))[:10]:
+        print("error: " + error)
+
+    for name in MUST_NOT_INCREASE:
+        if delta(name) > 0:
+            print("FAIL %s +%d" % (name, delta(name)))
+            ok = False
+
+    if before.get("aqs_heap_free_bytes", 0) - after.get("aqs_heap_free_bytes", 0) > args.heap_margin:
+        print("FAIL heap free down %d bytes" % (before["aqs_heap_free_bytes"] - after["aqs_heap_free_bytes"]))
+        ok = False
+
+    if args.duration >= 30 and delta("aqs_uart_frames_total") == 0:
+        print("FAIL no PM sensor frames received under load")
+        ok = False
+
+    print("PASS" if ok else "FAIL")
+    return 0 if ok else 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--clients", type=int, default=4, help="concurrent scrapers")
+    parser.add_argument("--slow-clients", type=int, default=0, help="scrapers reading a trickle at a time")
+    parser.add_argument("--slow-delay", type=float, default=0.05, help="seconds between a slow client's 256 byte reads")
+    parser.add_argument("--idle-clients", type=int, default=0, help="clients sending half a request and waiting to be dropped")
+    parser.add_argument("--duration", type=float, default=60, help="seconds to run for")
+    parser.add_argument("--timeout", type=float, default=15, help="socket timeout per scrape")
+    parser.add_argument("--heap-margin", type=int, default=2048, help="fail if free heap drops by more than this")
+    sys.exit(run(parser.parse_args()))
+
+
+if __name__ == "__main__":
+    main()